@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# bench.sh - Compare the select and io_uring builds of the stock server,
+#     and TCP against the local transports (Unix-domain socket, shared
+#     memory) on the select build
+#
+# usage: ./bench.sh [client#] [orders per client] [pipeline depth]
+#
+# Each server runs in a scratch directory on its own copy of stock.txt,
+# so the benchmark never touches the checked-in data.
+
+CLIENTS=${1:-50}
+ORDERS=${2:-2000}
+DEPTH=${3:-1}
+PORT=${PORT:-60129}
+
+run() {
+    name=$1
+    via=${2:-tcp}
+    dir=$(mktemp -d)
+    cp stock.txt "$dir"
+    (cd "$dir" && exec "$OLDPWD/$name" "$PORT" -u stock.sock > /dev/null 2> server.err) &
+    pid=$!
+    sleep 0.5
+    echo "== $name ($via)"
+    case $via in
+    tcp)  ./benchclient 127.0.0.1 "$PORT" "$CLIENTS" "$ORDERS" "$DEPTH" ;;
+    unix) ./benchclient "$dir/stock.sock" 0 "$CLIENTS" "$ORDERS" "$DEPTH" ;;
+    shm)  ./benchclient -s "$dir/stock.sock" 0 "$CLIENTS" "$ORDERS" "$DEPTH" ;;
+    esac
+    kill -INT $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    grep -h "falling back" "$dir/server.err"
+    rm -rf "$dir"
+    PORT=$((PORT + 1))
+}
+
+run stockserver
+run stockserver_uring
+run stockserver unix
+run stockserver shm
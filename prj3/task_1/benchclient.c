@@ -0,0 +1,169 @@
+/*
+ * benchclient.c - Closed-loop load generator for the stock server
+ *
+ * Each thread opens one connection and sends <orders> requests in
+ * batches of [depth] pipelined requests (default 1), waiting for every
+ * reply of a batch before sending the next. The request mix is the same
+ * as multiclient's (show, buy, sell with equal odds) but seeded per
+ * thread, so runs repeat. Latency is measured per batch.
+ *
+ * A host starting with '/' is the server's Unix-domain socket (-u); with
+ * -s the clients then talk over shared-memory channels (see shmring.h).
+ */
+#include "csapp.h"
+#include "shmring.h"
+#include <time.h>
+
+#define STOCK_NUM 10
+#define BUY_SELL_MAX 10
+
+static char *host, *port;
+static int num_orders;
+static int depth = 1;
+static int use_shm;
+static double *latency; /* latency[t * num_orders + i] in microseconds */
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Switch the connection to a shared-memory channel */
+static shm_chan_t *shm_connect(int clientfd) {
+    char buf[64];
+    int fd;
+    shm_chan_t *ch;
+
+    Rio_writen(clientfd, SHM_HELLO, strlen(SHM_HELLO));
+    ssize_t n = recv_fd(clientfd, buf, sizeof(buf) - 1, &fd);
+    buf[n > 0 ? n : 0] = '\0';
+    if (fd < 0 || strncmp(buf, "[shm] ok\n", 9))
+        app_error("shared memory refused (is the host the server's -u socket?)");
+    if ((ch = shm_attach(fd)) == NULL)
+        unix_error("shm_attach error");
+    Close(fd);
+    return ch;
+}
+
+/* Read n complete replies (each ends with an empty line) off the ring */
+static void shm_replies(shm_chan_t *ch, int clientfd, int n) {
+    char buf[4096];
+    int bol = 1; /* At the start of a line */
+
+    while (n > 0) {
+        ssize_t k = shm_recv(&ch->resp, clientfd, buf, sizeof(buf));
+        if (k <= 0)
+            app_error("server closed the channel");
+        for (ssize_t i = 0; i < k; i++) {
+            if (buf[i] == '\n' && bol)
+                n--;
+            bol = buf[i] == '\n';
+        }
+    }
+}
+
+static void *client_thread(void *vargp) {
+    int t = (int)(long)vargp;
+    unsigned int seed = t + 1;
+    char buf[MAXLINE], *line;
+    rioz_t rio;
+
+    int clientfd = Open_clientfd(host, port);
+    shm_chan_t *ch = use_shm ? shm_connect(clientfd) : NULL;
+    Rioz_readinitb(&rio, clientfd);
+
+    for (int i = 0; i < num_orders; i += depth) {
+        int batch = num_orders - i < depth ? num_orders - i : depth;
+        size_t len = 0;
+
+        for (int j = 0; j < batch; j++) {
+            int option = rand_r(&seed) % 3;
+            int id = rand_r(&seed) % STOCK_NUM + 1;
+            int amt = rand_r(&seed) % BUY_SELL_MAX + 1;
+
+            if (option == 0)
+                len += sprintf(buf + len, "show\n");
+            else
+                len += sprintf(buf + len, "%s %d %d\n",
+                               option == 1 ? "buy" : "sell", id, amt);
+        }
+
+        double start = now_us();
+        if (ch) {
+            if (shm_send(&ch->req, clientfd, buf, len) < 0)
+                unix_error("shm_send error");
+            shm_replies(ch, clientfd, batch);
+        } else {
+            Rio_writen(clientfd, buf, len);
+            for (int j = 0; j < batch; j++)
+                while (Rioz_getline(&rio, &line) > 1)
+                    ; /* reply ends with an empty line */
+        }
+        double elapsed = now_us() - start;
+        for (int j = 0; j < batch; j++)
+            latency[(long)t * num_orders + i + j] = elapsed;
+    }
+
+    if (ch) {
+        shm_send(&ch->req, clientfd, "exit\n", 5);
+        shm_detach(ch);
+    } else {
+        Rio_writen(clientfd, "exit\n", 5);
+    }
+    Close(clientfd);
+    rioz_free(&rio);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "-s")) {
+        use_shm = 1;
+        argv[1] = argv[0];
+        argv++;
+        argc--;
+    }
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "usage: %s [-s] <host>|<socket path> <port> <client#> <orders per client> [depth]\n", argv[0]);
+        fprintf(stderr, "  -s  use shared-memory channels (host must be the server's -u socket)\n");
+        exit(0);
+    }
+    host = argv[1];
+    port = argv[2];
+    int num_client = atoi(argv[3]);
+    num_orders = atoi(argv[4]);
+    if (argc == 6)
+        depth = atoi(argv[5]);
+    if (depth < 1 || depth * 16 > MAXLINE) /* A batch must fit in buf */
+        app_error("depth must be between 1 and MAXLINE/16");
+
+    long total = (long)num_client * num_orders;
+    latency = Malloc(total * sizeof(double));
+    pthread_t *tids = Malloc(num_client * sizeof(pthread_t));
+
+    double start = now_us();
+    for (int t = 0; t < num_client; t++)
+        Pthread_create(&tids[t], NULL, client_thread, (void *)(long)t);
+    for (int t = 0; t < num_client; t++)
+        Pthread_join(tids[t], NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    double sum = 0;
+    for (long i = 0; i < total; i++)
+        sum += latency[i];
+    qsort(latency, total, sizeof(double), cmp_double);
+
+    printf("clients %d, orders %ld, elapsed %.3f s\n", num_client, total, elapsed);
+    printf("throughput %.0f orders/s\n", total / elapsed);
+    printf("latency avg %.1f us, p50 %.1f us, p99 %.1f us\n",
+           sum / total, latency[total / 2], latency[total * 99 / 100]);
+
+    Free(latency);
+    Free(tids);
+    return 0;
+}
@@ -367,6 +367,15 @@ int Dup2(int fd1, int fd2)
     return rc;
 }
 
+int Fcntl(int fd, int cmd, int arg)
+{
+    int rc;
+
+    if ((rc = fcntl(fd, cmd, arg)) < 0)
+	unix_error("Fcntl error");
+    return rc;
+}
+
 void Stat(const char *filename, struct stat *buf) 
 {
     if (stat(filename, buf) < 0)
@@ -744,7 +753,7 @@ ssize_t rio_readn(int fd, void *usrbuf, size_t n)
 		nread = 0;      /* and call read() again */
 	    else
 		return -1;      /* errno set by read() */ 
-	} 
+	}
 	else if (nread == 0)
 	    break;              /* EOF */
 	nleft -= nread;
@@ -778,6 +787,41 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write an array of buffers (unbuffered). The
+ *    iovec array is consumed in place as partial writes advance it, and
+ *    at most IOV_MAX entries are handed to each writev() call.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0 && iov->iov_len == 0) { /* Skip empty segments */
+	iov++;
+	iovcnt--;
+    }
+    while (iovcnt > 0) {
+	if ((nwritten = writev(fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX)) <= 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		nwritten = 0;    /* and call writev() again */
+	    else
+		return -1;       /* errno set by writev() */
+	}
+	total += nwritten;
+	while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+	    nwritten -= iov->iov_len;
+	    iov++;
+	    iovcnt--;
+	}
+	if (iovcnt > 0) {        /* Partially written segment */
+	    iov->iov_base = (char *)iov->iov_base + nwritten;
+	    iov->iov_len -= nwritten;
+	}
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -879,6 +923,423 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * The Rioz package - a buffered line reader that scans with memchr()
+ *    and hands out views into its buffer instead of copying byte by byte.
+ *    Each view is NUL-terminated in place (the byte it covers is put back
+ *    on the next call) and stays valid until the next call on rp.
+ */
+
+/*
+ * rioz_readinitb - Associate a descriptor with an empty reader. The
+ *    buffer is allocated by the first read.
+ */
+void rioz_readinitb(rioz_t *rp, int fd)
+{
+    rp->rio_fd = fd;
+    rp->rio_buf = NULL;
+    rp->rio_size = rp->rio_start = rp->rio_end = 0;
+    rp->rio_nul = 0;
+}
+
+/*
+ * rioz_free - Release the reader's buffer
+ */
+void rioz_free(rioz_t *rp)
+{
+    free(rp->rio_buf);
+    rioz_readinitb(rp, rp->rio_fd);
+}
+
+/*
+ * rioz_reset - Rebind the reader to another descriptor, dropping any
+ *    buffered bytes but keeping the buffer for reuse.
+ */
+void rioz_reset(rioz_t *rp, int fd)
+{
+    rp->rio_fd = fd;
+    rp->rio_start = rp->rio_end = 0;
+    rp->rio_nul = 0;
+}
+
+/* Put back the byte hidden by the NUL after the previous view */
+static void rioz_restore(rioz_t *rp)
+{
+    if (rp->rio_nul) {
+	rp->rio_buf[rp->rio_nul - 1] = rp->rio_saved;
+	rp->rio_nul = 0;
+    }
+}
+
+/*
+ * rioz_fill - Read more bytes, first compacting the buffer or growing
+ *    it when it is full. Returns bytes read, 0 on EOF, -1 on error.
+ */
+static ssize_t rioz_fill(rioz_t *rp)
+{
+    ssize_t n;
+
+    if (rp->rio_end == rp->rio_size) {
+	if (rp->rio_start > 0) {  /* Slide unread bytes to the front */
+	    memmove(rp->rio_buf, rp->rio_buf + rp->rio_start,
+		    rp->rio_end - rp->rio_start);
+	    rp->rio_end -= rp->rio_start;
+	    rp->rio_start = 0;
+	}
+	if (rp->rio_end == rp->rio_size) { /* Still full: grow */
+	    size_t size = rp->rio_size ? 2 * rp->rio_size : RIOZ_MINBUF;
+	    char *buf = realloc(rp->rio_buf, size + 1);
+	    if (!buf)
+		return -1;
+	    rp->rio_buf = buf;
+	    rp->rio_size = size;
+	}
+    }
+
+    while ((n = read(rp->rio_fd, rp->rio_buf + rp->rio_end,
+		     rp->rio_size - rp->rio_end)) < 0) {
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return -1;
+    }
+    rp->rio_end += n;
+    return n;
+}
+
+/* Hand out the next len buffered bytes as a NUL-terminated view */
+static ssize_t rioz_take(rioz_t *rp, char **viewp, size_t len)
+{
+    *viewp = rp->rio_buf + rp->rio_start;
+    rp->rio_start += len;
+    rp->rio_saved = rp->rio_buf[rp->rio_start];
+    rp->rio_buf[rp->rio_start] = '\0';
+    rp->rio_nul = rp->rio_start + 1;
+    return len;
+}
+
+/*
+ * rioz_scan - Find the next line of at most maxlen bytes (including the
+ *    '\n'), reading as needed. Returns its length, 0 on EOF, -1 on error,
+ *    or RIO_AGAIN if a non-blocking descriptor has no complete line yet
+ *    (a partial line stays buffered for the next call).
+ */
+static ssize_t rioz_scan(rioz_t *rp, char **linep, size_t maxlen)
+{
+    size_t scanned = 0, len;
+    ssize_t rc;
+    char *nl;
+
+    rioz_restore(rp);
+    while (1) {
+	size_t avail = rp->rio_end - rp->rio_start;
+	char *start = rp->rio_buf + rp->rio_start;
+	if (avail > maxlen)
+	    avail = maxlen;
+	if ((nl = memchr(start + scanned, '\n', avail - scanned)) != NULL) {
+	    len = nl - start + 1;
+	    break;
+	}
+	scanned = avail;
+	if (avail == maxlen) {    /* Overlong line: return the first part */
+	    len = avail;
+	    break;
+	}
+	if ((rc = rioz_fill(rp)) < 0)
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? RIO_AGAIN : -1;
+	if (rc == 0) {           /* EOF */
+	    if (avail == 0)
+		return 0;
+	    len = avail;          /* Last line has no '\n' */
+	    break;
+	}
+    }
+
+    return rioz_take(rp, linep, len);
+}
+
+/*
+ * rioz_getline - Return a view of the next text line in *linep
+ *    (RIO_AGAIN if a non-blocking descriptor has no complete line yet)
+ */
+ssize_t rioz_getline(rioz_t *rp, char **linep)
+{
+    return rioz_scan(rp, linep, RIOZ_MAXLINE);
+}
+
+/*
+ * rioz_readlineb - Drop-in replacement for rio_readlineb on a rioz_t
+ */
+ssize_t rioz_readlineb(rioz_t *rp, void *usrbuf, size_t maxlen)
+{
+    char *line;
+    ssize_t n;
+
+    if (maxlen == 0)
+	return 0;
+    if ((n = rioz_scan(rp, &line, maxlen - 1)) > 0)
+	memcpy(usrbuf, line, n);
+    if (n >= 0)
+	((char *)usrbuf)[n] = 0;
+    return n;
+}
+
+/*
+ * rioz_getn - Return a view of the next n bytes in *bufp, for fixed-size
+ *    binary records. Returns n, a short count if EOF cuts the record, 0 on
+ *    EOF, -1 on error, or RIO_AGAIN if a non-blocking descriptor has fewer
+ *    than n bytes so far.
+ */
+ssize_t rioz_getn(rioz_t *rp, char **bufp, size_t n)
+{
+    size_t len = n;
+    ssize_t rc;
+
+    rioz_restore(rp);
+    while (rp->rio_end - rp->rio_start < n) {
+	if ((rc = rioz_fill(rp)) < 0)
+	    return (errno == EAGAIN || errno == EWOULDBLOCK) ? RIO_AGAIN : -1;
+	if (rc == 0) {           /* EOF */
+	    if ((len = rp->rio_end - rp->rio_start) == 0)
+		return 0;
+	    break;
+	}
+    }
+    return rioz_take(rp, bufp, len);
+}
+
+/*
+ * rioz_hasn - Are n more bytes already buffered? (no read needed)
+ */
+int rioz_hasn(rioz_t *rp, size_t n)
+{
+    return rp->rio_end - rp->rio_start >= n;
+}
+
+/*
+ * rioz_trim - Release the buffer of an idle reader if it holds no unread
+ *    bytes; the next read allocates a small one again.
+ */
+void rioz_trim(rioz_t *rp)
+{
+    if (rp->rio_start == rp->rio_end)
+	rioz_free(rp);
+}
+
+/*
+ * rioz_buffered - Return a view of every buffered unread byte in *bufp
+ *    without consuming it (e.g. a partial request to carry elsewhere).
+ *    Returns the number of bytes.
+ */
+size_t rioz_buffered(rioz_t *rp, char **bufp)
+{
+    rioz_restore(rp);
+    *bufp = rp->rio_buf + rp->rio_start;
+    return rp->rio_end - rp->rio_start;
+}
+
+/*
+ * rioz_unread - Put n bytes back in front of the unread data, as if they
+ *    had just been read. Returns 0, or -1 if the buffer cannot grow.
+ */
+int rioz_unread(rioz_t *rp, const void *buf, size_t n)
+{
+    size_t avail, size = rp->rio_size ? rp->rio_size : RIOZ_MINBUF;
+
+    rioz_restore(rp);
+    avail = rp->rio_end - rp->rio_start;
+    while (size < avail + n)
+	size *= 2;
+    if (size != rp->rio_size) {
+	char *nbuf = realloc(rp->rio_buf, size + 1);
+	if (!nbuf)
+	    return -1;
+	rp->rio_buf = nbuf;
+	rp->rio_size = size;
+    }
+    memmove(rp->rio_buf + n, rp->rio_buf + rp->rio_start, avail);
+    memcpy(rp->rio_buf, buf, n);
+    rp->rio_start = 0;
+    rp->rio_end = avail + n;
+    return 0;
+}
+
+/*
+ * rioz_hasline - Is a complete line already buffered? (no read needed)
+ */
+int rioz_hasline(rioz_t *rp)
+{
+    size_t start = rp->rio_start;
+
+    if (rp->rio_end == start)
+	return 0;
+    if (rp->rio_nul && rp->rio_saved == '\n') /* Hidden by the NUL */
+	return 1;
+    return memchr(rp->rio_buf + start, '\n', rp->rio_end - start) != NULL;
+}
+
+/*
+ * The Riow package - a buffered writer for non-blocking descriptors.
+ *    Output is written straight away while the socket accepts it; the
+ *    rest is queued in a growable buffer and sent by riow_flush() once
+ *    the descriptor is writable again. Nothing ever blocks.
+ */
+
+/*
+ * riow_init - Associate a descriptor with an empty output queue
+ */
+void riow_init(riow_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_buf = NULL;
+    wp->rio_size = wp->rio_start = wp->rio_end = 0;
+}
+
+/*
+ * riow_free - Drop any queued output and release the buffer
+ */
+void riow_free(riow_t *wp)
+{
+    free(wp->rio_buf);
+    riow_init(wp, wp->rio_fd);
+}
+
+/*
+ * riow_reset - Rebind the writer to another descriptor, dropping any
+ *    queued output but keeping the buffer for reuse.
+ */
+void riow_reset(riow_t *wp, int fd)
+{
+    wp->rio_fd = fd;
+    wp->rio_start = wp->rio_end = 0;
+}
+
+/*
+ * riow_pending - Number of queued bytes not yet written
+ */
+size_t riow_pending(riow_t *wp)
+{
+    return wp->rio_end - wp->rio_start;
+}
+
+/*
+ * riow_trim - Release the buffer of an idle writer if nothing is queued
+ */
+void riow_trim(riow_t *wp)
+{
+    if (wp->rio_start == wp->rio_end)
+	riow_free(wp);
+}
+
+/* Append n bytes to the queue, compacting or growing the buffer */
+static int riow_queue(riow_t *wp, const void *buf, size_t n)
+{
+    if (n == 0)
+	return 0;
+    if (wp->rio_end + n > wp->rio_size) {
+	size_t pending = wp->rio_end - wp->rio_start;
+	memmove(wp->rio_buf, wp->rio_buf + wp->rio_start, pending);
+	wp->rio_start = 0;
+	wp->rio_end = pending;
+	if (pending + n > wp->rio_size) {
+	    size_t size = wp->rio_size ? wp->rio_size : RIOZ_MINBUF;
+	    while (size < pending + n)
+		size *= 2;
+	    char *nbuf = realloc(wp->rio_buf, size);
+	    if (!nbuf)
+		return -1;
+	    wp->rio_buf = nbuf;
+	    wp->rio_size = size;
+	}
+    }
+    memcpy(wp->rio_buf + wp->rio_end, buf, n);
+    wp->rio_end += n;
+    return 0;
+}
+
+/*
+ * riow_flush - Write queued output until done or the descriptor would
+ *    block. Returns 1 if the queue is empty, 0 if output is still pending,
+ *    -1 on error.
+ */
+int riow_flush(riow_t *wp)
+{
+    ssize_t n;
+
+    while (wp->rio_start < wp->rio_end) {
+	n = write(wp->rio_fd, wp->rio_buf + wp->rio_start,
+		  wp->rio_end - wp->rio_start);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return 0;
+	    return -1;
+	}
+	wp->rio_start += n;
+    }
+    wp->rio_start = wp->rio_end = 0;
+    return 1;
+}
+
+/*
+ * riow_writev - Write a gather list without blocking. If nothing is
+ *    queued it goes straight to writev(); whatever the socket does not
+ *    take is copied to the queue, keeping the byte order intact.
+ *    Returns 0 on success (possibly queued), -1 on error.
+ */
+int riow_writev(riow_t *wp, struct iovec *iov, int iovcnt)
+{
+    ssize_t n = 0;
+
+    if (wp->rio_start == wp->rio_end) {
+	while (iovcnt > 0) {
+	    n = writev(wp->rio_fd, iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		    break;
+		return -1;
+	    }
+	    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+		n -= iov->iov_len;
+		iov++;
+		iovcnt--;
+	    }
+	    if (iovcnt > 0) { /* Socket buffer is full: queue the rest */
+		iov->iov_base = (char *)iov->iov_base + n;
+		iov->iov_len -= n;
+		break;
+	    }
+	}
+    }
+    return riow_queuev(wp, iov, iovcnt);
+}
+
+/*
+ * riow_queuev - Append a gather list to the queue without writing it, so
+ *    several replies can leave in one riow_flush(). The data is copied, so
+ *    the caller may reuse or change the buffers right away.
+ */
+int riow_queuev(riow_t *wp, struct iovec *iov, int iovcnt)
+{
+    for (; iovcnt > 0; iov++, iovcnt--)
+	if (riow_queue(wp, iov->iov_base, iov->iov_len) < 0)
+	    return -1;
+    return 0;
+}
+
+/*
+ * riow_write - Write n bytes without blocking (see riow_writev)
+ */
+int riow_write(riow_t *wp, void *buf, size_t n)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = n;
+    return riow_writev(wp, &iov, 1);
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -897,6 +1358,12 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
 	unix_error("Rio_writen error");
 }
 
+void Rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+	unix_error("Rio_writev error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -920,13 +1387,47 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+void Rioz_readinitb(rioz_t *rp, int fd)
+{
+    rioz_readinitb(rp, fd);
+}
+
+ssize_t Rioz_getline(rioz_t *rp, char **linep)
+{
+    ssize_t rc;
+
+    if ((rc = rioz_getline(rp, linep)) == -1)
+	unix_error("Rioz_getline error");
+    return rc;
+}
+
+ssize_t Rioz_getn(rioz_t *rp, char **bufp, size_t n)
+{
+    ssize_t rc;
+
+    if ((rc = rioz_getn(rp, bufp, n)) == -1)
+	unix_error("Rioz_getn error");
+    return rc;
+}
+
+ssize_t Rioz_readlineb(rioz_t *rp, void *usrbuf, size_t maxlen)
+{
+    ssize_t rc;
+
+    if ((rc = rioz_readlineb(rp, usrbuf, maxlen)) == -1)
+	unix_error("Rioz_readlineb error");
+    return rc;
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
- *     function is reentrant and protocol-independent.
+ *     function is reentrant and protocol-independent. A hostname
+ *     starting with '/' is the path of a Unix-domain socket instead
+ *     (port is ignored), so every client can reach a local server.
  * 
  *     On error, returns -1 and sets errno.  
  */
@@ -935,6 +1436,9 @@ int open_clientfd(char *hostname, char *port) {
     int clientfd;
     struct addrinfo hints, *listp, *p;
 
+    if (hostname[0] == '/')
+        return open_clientfd_unix(hostname);
+
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
     hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
@@ -970,7 +1474,25 @@ int open_clientfd(char *hostname, char *port) {
  *     On error, returns -1 and sets errno.
  */
 /* $begin open_listenfd */
+static int open_listenfd_opt(char *port, int reuseport);
+
 int open_listenfd(char *port) 
+{
+    return open_listenfd_opt(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_listenfd_reuseport - Like open_listenfd, but with SO_REUSEPORT set
+ *     so that several sockets (one per worker) can listen on the same port
+ *     and the kernel spreads incoming connections across them.
+ */
+int open_listenfd_reuseport(char *port)
+{
+    return open_listenfd_opt(port, 1);
+}
+
+static int open_listenfd_opt(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, optval=1;
@@ -991,6 +1513,9 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport)
+            Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval , sizeof(int));
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1010,7 +1535,68 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
+
+/* Fill in the address of a Unix-domain socket; -1 if path is too long */
+static int unix_addr(struct sockaddr_un *addr, char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * open_clientfd_unix - Open a connection to the Unix-domain socket at
+ *     path. On error, returns -1 and sets errno.
+ */
+int open_clientfd_unix(char *path)
+{
+    struct sockaddr_un addr;
+    int clientfd;
+
+    if (unix_addr(&addr, path) < 0)
+        return -1;
+    if ((clientfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(clientfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int saved = errno;
+        Close(clientfd);
+        errno = saved;
+        return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * open_listenfd_unix - Open and return a listening Unix-domain socket at
+ *     path, replacing a stale socket file left there (but no other kind
+ *     of file). On error, returns -1 and sets errno.
+ */
+int open_listenfd_unix(char *path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int listenfd;
+
+    if (unix_addr(&addr, path) < 0)
+        return -1;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    if ((listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(listenfd, LISTENQ) < 0) {
+        int saved = errno;
+        Close(listenfd);
+        errno = saved;
+        return -1;
+    }
+    return listenfd;
+}
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1033,6 +1619,33 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_listenfd_reuseport(char *port)
+{
+    int rc;
+
+    if ((rc = open_listenfd_reuseport(port)) < 0)
+	unix_error("Open_listenfd_reuseport error");
+    return rc;
+}
+
+int Open_clientfd_unix(char *path)
+{
+    int rc;
+
+    if ((rc = open_clientfd_unix(path)) < 0)
+	unix_error("Open_clientfd_unix error");
+    return rc;
+}
+
+int Open_listenfd_unix(char *path)
+{
+    int rc;
+
+    if ((rc = open_listenfd_unix(path)) < 0)
+	unix_error("Open_listenfd_unix error");
+    return rc;
+}
+
 /* $end csapp.c */
 
 
@@ -20,11 +20,14 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -51,6 +54,35 @@ typedef struct {
 } rio_t;
 /* $end rio_t */
 
+/* 
+ * Persistent state for the zero-copy line reader (Rioz). Lines are found
+ * with memchr and returned as views into a heap buffer that grows for
+ * long lines, up to RIOZ_MAXLINE bytes per line.
+ */
+#define RIOZ_MAXLINE (1 << 20)
+#define RIOZ_MINBUF  512       /* First buffer size of Rioz and Riow; both grow by doubling */
+typedef struct {
+    int rio_fd;                /* Descriptor for this internal buf */
+    char *rio_buf;             /* Internal buffer (rio_size + 1 bytes) */
+    size_t rio_size;           /* Capacity of rio_buf, excluding the NUL slot */
+    size_t rio_start;          /* First unread byte */
+    size_t rio_end;            /* End of buffered bytes */
+    size_t rio_nul;            /* 1 + index of the NUL put after the last view, or 0 */
+    char rio_saved;            /* Byte the NUL replaced */
+} rioz_t;
+
+/* "No complete line yet" from a reader on a non-blocking descriptor */
+#define RIO_AGAIN (-2)
+
+/* Persistent state for the non-blocking buffered writer (Riow) */
+typedef struct {
+    int rio_fd;                /* Descriptor to write to */
+    char *rio_buf;             /* Queued output */
+    size_t rio_size;           /* Capacity of rio_buf */
+    size_t rio_start;          /* First unwritten byte */
+    size_t rio_end;            /* End of queued bytes */
+} riow_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -59,6 +91,9 @@ extern char **environ; /* Defined by libc */
 #define	MAXLINE	 8192  /* Max text line length */
 #define MAXBUF   8192  /* Max I/O buffer size */
 #define LISTENQ  1024  /* Second argument to listen() */
+#ifndef IOV_MAX
+#define IOV_MAX  1024  /* Max buffers per writev() call */
+#endif
 
 /* Our own error-handling functions */
 void unix_error(char *msg);
@@ -109,6 +144,7 @@ void Close(int fd);
 int Select(int  n, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, 
 	   struct timeval *timeout);
 int Dup2(int fd1, int fd2);
+int Fcntl(int fd, int cmd, int arg);
 void Stat(const char *filename, struct stat *buf);
 void Fstat(int fd, struct stat *buf) ;
 
@@ -175,24 +211,60 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 
+/* Rioz (zero-copy line reader) package */
+void rioz_readinitb(rioz_t *rp, int fd);
+void rioz_free(rioz_t *rp);
+void rioz_reset(rioz_t *rp, int fd);
+ssize_t rioz_getline(rioz_t *rp, char **linep);
+ssize_t rioz_readlineb(rioz_t *rp, void *usrbuf, size_t maxlen);
+int rioz_hasline(rioz_t *rp);
+ssize_t rioz_getn(rioz_t *rp, char **bufp, size_t n);
+int rioz_hasn(rioz_t *rp, size_t n);
+void rioz_trim(rioz_t *rp);
+size_t rioz_buffered(rioz_t *rp, char **bufp);
+int rioz_unread(rioz_t *rp, const void *buf, size_t n);
+
+/* Riow (non-blocking writer) package */
+void riow_init(riow_t *wp, int fd);
+void riow_free(riow_t *wp);
+void riow_reset(riow_t *wp, int fd);
+size_t riow_pending(riow_t *wp);
+void riow_trim(riow_t *wp);
+int riow_flush(riow_t *wp);
+int riow_writev(riow_t *wp, struct iovec *iov, int iovcnt);
+int riow_queuev(riow_t *wp, struct iovec *iov, int iovcnt);
+int riow_write(riow_t *wp, void *buf, size_t n);
+
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void Rioz_readinitb(rioz_t *rp, int fd);
+ssize_t Rioz_getline(rioz_t *rp, char **linep);
+ssize_t Rioz_readlineb(rioz_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rioz_getn(rioz_t *rp, char **bufp, size_t n);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
 int open_listenfd(char *port);
+int open_listenfd_reuseport(char *port);
+int open_clientfd_unix(char *path);
+int open_listenfd_unix(char *path);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
+int Open_listenfd_reuseport(char *port);
+int Open_clientfd_unix(char *path);
+int Open_listenfd_unix(char *path);
 
 
 #endif /* __CSAPP_H__ */
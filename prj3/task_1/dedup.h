@@ -0,0 +1,36 @@
+/*
+ * dedup.h - per-connection window of executed order IDs
+ *
+ * Clients may tag buy/sell requests with increasing order IDs. The
+ * window remembers, for the DEDUP_WINDOW IDs below the highest one seen,
+ * whether each was executed and what change_stock returned, so a
+ * resent order is answered again instead of being executed twice.
+ * Like a TCP/IPsec anti-replay window it is a bitmap plus a ring of
+ * results indexed by id % DEDUP_WINDOW: O(1) and about 300 bytes.
+ */
+#ifndef __DEDUP_H__
+#define __DEDUP_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DEDUP_WINDOW 256    /* Order IDs remembered (multiple of 64) */
+
+typedef struct {
+    unsigned long top;                  /* Highest order ID recorded, 0 if none */
+    uint64_t seen[DEDUP_WINDOW / 64];   /* Bit id % DEDUP_WINDOW: id was executed */
+    signed char result[DEDUP_WINDOW];   /* Its result, by id % DEDUP_WINDOW */
+} dedup_t;
+
+/* dedup_check results */
+#define DEDUP_NEW    0      /* Not seen: execute it, then dedup_record */
+#define DEDUP_DUP    1      /* Already executed: *result is what it returned */
+#define DEDUP_STALE  2      /* Too far below the window to tell: refuse it */
+
+void dedup_init(dedup_t *d);
+int dedup_check(dedup_t *d, unsigned long id, int *result);
+void dedup_record(dedup_t *d, unsigned long id, int result);
+void dedup_save(dedup_t *d, FILE *f);
+int dedup_load(dedup_t *d, FILE *f);
+
+#endif /* __DEDUP_H__ */
@@ -1,4 +1,5 @@
 #include "csapp.h"
+#include "stockproto.h"
 #include <time.h>
 
 #define MAX_CLIENT 1000
@@ -6,19 +7,37 @@
 #define STOCK_NUM 10
 #define BUY_SELL_MAX 10
 
+/* Send one request frame and print its reply as the text protocol would */
+static void frame_request(int clientfd, rioz_t *rp, const char *buf)
+{
+	stock_frame_t req, res;
+	char out[MAXLINE], *p;
+	int more = 1;
+
+	frame_encode(buf, &req);
+	Rio_writen(clientfd, &req, sizeof(req));
+	while (more && Rioz_getn(rp, &p, sizeof(res)) == sizeof(res)) {
+		memcpy(&res, p, sizeof(res));
+		more = frame_format(&res, req.op, out, sizeof(out));
+		Fputs(out, stdout);
+	}
+}
+
 int main(int argc, char **argv) 
 {
 	pid_t pids[MAX_CLIENT];
 	int runprocess = 0, status, i;
 
 	int clientfd, num_client;
-	char *host, *port, buf[MAXLINE], tmp[3];
-	rio_t rio;
+	char *host, *port, buf[MAXLINE], tmp[3], *line;
+	rioz_t rio;
+	int binary;
 
-	if (argc != 4) {
-		fprintf(stderr, "usage: %s <host> <port> <client#>\n", argv[0]);
+	if (argc != 4 && !(argc == 5 && !strcmp(argv[4], "-b"))) {
+		fprintf(stderr, "usage: %s <host> <port> <client#> [-b]\n", argv[0]);
 		exit(0);
 	}
+	binary = argc == 5; /* -b: binary frames (stockproto.h) */
 
 	host = argv[1];
 	port = argv[2];
@@ -36,7 +55,12 @@ int main(int argc, char **argv)
 			printf("child %ld\n", (long)getpid());
 
 			clientfd = Open_clientfd(host, port);
-			Rio_readinitb(&rio, clientfd);
+			Rioz_readinitb(&rio, clientfd);
+			if (binary) { /* Negotiate, then drop the text acknowledgement */
+				Rio_writen(clientfd, BIN_HELLO, strlen(BIN_HELLO));
+				while (Rioz_getline(&rio, &line) > 1)
+					;
+			}
 			srand((unsigned int) getpid());
 
 			for(i=0;i<ORDER_PER_CLIENT;i++){
@@ -72,10 +96,14 @@ int main(int argc, char **argv)
 				}
 				//strcpy(buf, "buy 1 2\n");
 			
-				Rio_writen(clientfd, buf, strlen(buf));
-				// Rio_readlineb(&rio, buf, MAXLINE);
-				Rio_readnb(&rio, buf, MAXLINE);
-				Fputs(buf, stdout);
+				if (binary) {
+					frame_request(clientfd, &rio, buf);
+				} else {
+					Rio_writen(clientfd, buf, strlen(buf));
+					/* reply ends with an empty line */
+					while (Rioz_getline(&rio, &line) > 1)
+						Fputs(line, stdout);
+				}
 
 				usleep(1000000);
 			}
@@ -0,0 +1,213 @@
+/*
+ * replay.c - Replay an order trace (see tracegen.c) against a stock server
+ *
+ * usage: replay <host> <port> <trace> [speed]
+ *
+ * Every client id in the trace gets its own thread and connection and
+ * sends its orders in trace order, each waiting for the previous reply.
+ * With speed > 0 an order leaves at its recorded time divided by speed
+ * (2 = twice as fast) and its latency counts from that scheduled time,
+ * so a stalled server cannot hide behind a client that fell behind.
+ * With speed 0 (default) clients send back to back (closed loop) and
+ * latency counts from the send.
+ *
+ * Reports throughput and latency percentiles, overall and per command.
+ */
+#include "csapp.h"
+#include <time.h>
+
+enum { KIND_SHOW, KIND_BUY, KIND_SELL, KIND_OTHER, NKINDS };
+static const char *kind_name[NKINDS] = { "show", "buy", "sell", "other" };
+
+typedef struct {
+    long t;                 /* Recorded send time, microseconds */
+    int kind;
+    char *line;             /* Request line, '\n' included */
+    double latency;         /* Measured by the replay, microseconds */
+} order_t;
+
+typedef struct {
+    order_t *orders;
+    int n, cap;
+} client_t;
+
+static char *host, *port;
+static double speed = 0;
+static double start_us;
+static pthread_barrier_t connected, go; /* Clock starts between the two */
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void sleep_until_us(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)(t / 1e6);
+    ts.tv_nsec = (long)((t - ts.tv_sec * 1e6) * 1e3);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int order_kind(const char *cmd) {
+    if (!strncmp(cmd, "show", 4))
+        return KIND_SHOW;
+    if (!strncmp(cmd, "buy ", 4))
+        return KIND_BUY;
+    if (!strncmp(cmd, "sell ", 5))
+        return KIND_SELL;
+    return KIND_OTHER;
+}
+
+/* Read the trace into one order list per client id; returns the id count */
+static int load_trace(const char *path, client_t **clientsp, long *norders, long *span) {
+    FILE *f = Fopen(path, "r");
+    char buf[MAXLINE];
+    client_t *clients = NULL;
+    int nclients = 0;
+    long t;
+    int id, off;
+
+    *norders = *span = 0;
+    while (Fgets(buf, MAXLINE, f) != NULL) {
+        if (buf[0] == '#' || sscanf(buf, "%ld %d %n", &t, &id, &off) < 2 || id < 0)
+            continue;
+        if (id >= nclients) {
+            clients = Realloc(clients, (id + 1) * sizeof(client_t));
+            memset(clients + nclients, 0, (id + 1 - nclients) * sizeof(client_t));
+            nclients = id + 1;
+        }
+        client_t *c = &clients[id];
+        if (c->n == c->cap) {
+            c->cap = c->cap ? 2 * c->cap : 64;
+            c->orders = Realloc(c->orders, c->cap * sizeof(order_t));
+        }
+        order_t *o = &c->orders[c->n++];
+        o->t = t;
+        o->kind = order_kind(buf + off);
+        o->line = strdup(buf + off);
+        if (t > *span)
+            *span = t;
+        (*norders)++;
+    }
+    Fclose(f);
+    *clientsp = clients;
+    return nclients;
+}
+
+static void *client_thread(void *vargp) {
+    client_t *c = vargp;
+    rioz_t rio;
+    char *line;
+    int clientfd = Open_clientfd(host, port);
+
+    Rioz_readinitb(&rio, clientfd);
+    pthread_barrier_wait(&connected);
+    pthread_barrier_wait(&go); /* start_us is set */
+
+    for (int i = 0; i < c->n; i++) {
+        order_t *o = &c->orders[i];
+        double sched = 0;
+
+        if (speed > 0) {
+            sched = start_us + o->t / speed;
+            sleep_until_us(sched);
+        }
+        double sent = now_us();
+        Rio_writen(clientfd, o->line, strlen(o->line));
+        while (Rioz_getline(&rio, &line) > 1)
+            ; /* reply ends with an empty line */
+        o->latency = now_us() - (speed > 0 ? sched : sent);
+    }
+
+    Rio_writen(clientfd, "exit\n", 5);
+    Close(clientfd);
+    rioz_free(&rio);
+    return NULL;
+}
+
+/* Print one row of the latency table; sorts lat */
+static void report(const char *name, double *lat, long n) {
+    double sum = 0;
+
+    if (n == 0)
+        return;
+    qsort(lat, n, sizeof(double), cmp_double);
+    for (long i = 0; i < n; i++)
+        sum += lat[i];
+    printf("%-6s %8ld %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, n, sum / n,
+           lat[n / 2], lat[n * 90 / 100], lat[n * 99 / 100], lat[n - 1]);
+}
+
+int main(int argc, char **argv) {
+    client_t *clients;
+    long norders, span;
+    int nclients, nthreads = 0;
+
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s <host> <port> <trace> [speed]\n", argv[0]);
+        fprintf(stderr, "  speed 0 (default): closed loop; 1: recorded timing; 2: twice as fast...\n");
+        exit(0);
+    }
+    host = argv[1];
+    port = argv[2];
+    if (argc == 5)
+        speed = atof(argv[4]);
+    Signal(SIGPIPE, SIG_IGN);
+
+    nclients = load_trace(argv[3], &clients, &norders, &span);
+    for (int c = 0; c < nclients; c++)
+        nthreads += clients[c].n > 0;
+    if (norders == 0)
+        app_error("empty trace");
+
+    pthread_t *tids = Malloc(nthreads * sizeof(pthread_t));
+    pthread_barrier_init(&connected, NULL, nthreads + 1);
+    pthread_barrier_init(&go, NULL, nthreads + 1);
+    for (int c = 0, t = 0; c < nclients; c++)
+        if (clients[c].n > 0)
+            Pthread_create(&tids[t++], NULL, client_thread, &clients[c]);
+    pthread_barrier_wait(&connected); /* Everyone connected: start the clock */
+    start_us = now_us();
+    pthread_barrier_wait(&go);
+    for (int t = 0; t < nthreads; t++)
+        Pthread_join(tids[t], NULL);
+    double elapsed = (now_us() - start_us) / 1e6;
+
+    /* Gather latencies: all orders, then one bucket per command kind */
+    double *all = Malloc(norders * sizeof(double));
+    double *bykind[NKINDS];
+    long nkind[NKINDS] = {0}, n = 0;
+    for (int k = 0; k < NKINDS; k++)
+        bykind[k] = Malloc(norders * sizeof(double));
+    for (int c = 0; c < nclients; c++) {
+        for (int i = 0; i < clients[c].n; i++) {
+            order_t *o = &clients[c].orders[i];
+            all[n++] = o->latency;
+            bykind[o->kind][nkind[o->kind]++] = o->latency;
+            free(o->line);
+        }
+        free(clients[c].orders);
+    }
+
+    printf("trace %s: %ld orders, %d clients, span %.3f s, speed %g%s\n", argv[3],
+           norders, nthreads, span / 1e6, speed, speed > 0 ? "" : " (closed loop)");
+    printf("elapsed %.3f s, throughput %.0f orders/s\n", elapsed, norders / elapsed);
+    printf("%-6s %8s %10s %10s %10s %10s %10s\n", "us", "count", "avg", "p50", "p90", "p99", "max");
+    report("all", all, n);
+    for (int k = 0; k < NKINDS; k++)
+        report(kind_name[k], bykind[k], nkind[k]);
+
+    for (int k = 0; k < NKINDS; k++)
+        Free(bykind[k]);
+    Free(all);
+    Free(tids);
+    free(clients);
+    return 0;
+}
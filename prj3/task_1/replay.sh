@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# replay.sh - Replay one trace against every server build
+#
+# usage: ./replay.sh [trace] [speed]
+#
+# Without a trace, a fixed one is generated (tracegen 50 200 1 1000).
+# Each server runs in a scratch directory on its own copy of stock.txt,
+# so every run starts from the same data and the checked-in file is
+# never touched. Servers: task_1 select and io_uring, task_2 thread
+# pool and thread-per-core (-r).
+
+SPEED=${2:-0}
+PORT=${PORT:-60139}
+T2=../task_2
+TRACE=$1
+if [ -z "$TRACE" ]; then
+    TRACE=$(mktemp)
+    ./tracegen 50 200 1 1000 > "$TRACE"
+fi
+
+run() {
+    name=$1; bin=$2; shift 2
+    dir=$(mktemp -d)
+    cp stock.txt "$dir"
+    (cd "$dir" && exec "$bin" "$PORT" "$@" > /dev/null 2> server.err) &
+    pid=$!
+    sleep 0.5
+    echo "== $name"
+    ./replay 127.0.0.1 "$PORT" "$TRACE" "$SPEED"
+    kill -INT $pid 2> /dev/null
+    wait $pid 2> /dev/null
+    rm -rf "$dir"
+    PORT=$((PORT + 1))
+}
+
+run "select (task_1)" "$PWD/stockserver"
+run "io_uring (task_1)" "$PWD/stockserver_uring"
+if [ -x $T2/stockserver ]; then
+    run "thread pool (task_2)" "$(cd $T2 && pwd)/stockserver"
+    run "thread per core (task_2 -r)" "$(cd $T2 && pwd)/stockserver" -r
+fi
+[ -z "$1" ] && rm -f "$TRACE"
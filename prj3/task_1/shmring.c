@@ -0,0 +1,275 @@
+/*
+ * shmring.c - Shared-memory request/reply rings (see shmring.h)
+ *
+ * The sleeping flag and the positions are ordered with full fences:
+ * the consumer stores the flag then loads tail, the producer stores tail
+ * then loads the flag, so at least one of them sees the other and a
+ * wakeup is never lost. A spurious doorbell byte is harmless.
+ */
+#define _GNU_SOURCE /* memfd_create */
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "shmring.h"
+
+#define MIN(x, y)   ((x) < (y) ? (x) : (y))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+/*
+ * shm_create - Make a zeroed channel in a new memfd. The caller passes
+ *     *fdp to the peer (send_fd) and may then close it.
+ */
+shm_chan_t *shm_create(int *fdp)
+{
+    int fd = memfd_create("stockserver-shm", MFD_CLOEXEC);
+    shm_chan_t *ch;
+
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(shm_chan_t)) < 0 || (ch = shm_attach(fd)) == NULL) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    *fdp = fd;
+    return ch;
+}
+
+/* shm_attach - Map the channel in fd (from recv_fd) */
+shm_chan_t *shm_attach(int fd)
+{
+    void *p = mmap(NULL, sizeof(shm_chan_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+void shm_detach(shm_chan_t *ch)
+{
+    munmap(ch, sizeof(shm_chan_t));
+}
+
+/*
+ * shm_write - Producer: copy up to n bytes into the ring and publish
+ *     them. Returns the number copied, 0 if the ring is full or corrupt.
+ */
+size_t shm_write(shm_ring_t *r, const void *buf, size_t n)
+{
+    uint32_t tail = r->tail;
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    size_t off = tail & (SHM_RING_SIZE - 1), first;
+
+    if (tail - head > SHM_RING_SIZE)
+        return 0;
+    n = MIN(n, SHM_RING_SIZE - (size_t)(tail - head));
+    first = MIN(n, SHM_RING_SIZE - off);
+    memcpy(r->data + off, buf, first);
+    memcpy(r->data, (const char *)buf + first, n - first);
+    __atomic_store_n(&r->tail, tail + (uint32_t)n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+ * shm_read - Consumer: copy up to n bytes out of the ring and release
+ *     their space. Returns the number copied, 0 if the ring is empty or
+ *     corrupt.
+ */
+size_t shm_read(shm_ring_t *r, void *buf, size_t n)
+{
+    uint32_t head = r->head;
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t off = head & (SHM_RING_SIZE - 1), first;
+
+    if (tail - head > SHM_RING_SIZE)
+        return 0;
+    n = MIN(n, (size_t)(tail - head));
+    first = MIN(n, SHM_RING_SIZE - off);
+    memcpy(buf, r->data + off, first);
+    memcpy((char *)buf + first, r->data, n - first);
+    __atomic_store_n(&r->head, head + (uint32_t)n, __ATOMIC_RELEASE);
+    return n;
+}
+
+/* shm_readable - Consumer: bytes waiting in the ring (0 if corrupt) */
+size_t shm_readable(shm_ring_t *r)
+{
+    uint32_t n = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
+
+    return n > SHM_RING_SIZE ? 0 : n;
+}
+
+/* shm_corrupt - Either side: returns 1 if the positions cannot be right */
+int shm_corrupt(shm_ring_t *r)
+{
+    uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - head > SHM_RING_SIZE;
+}
+
+/*
+ * shm_need_wake - Producer, after publishing: returns 1 (once) if the
+ *     consumer is asleep and must be sent a doorbell byte.
+ */
+int shm_need_wake(shm_ring_t *r)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&r->sleeping, __ATOMIC_RELAXED))
+        return 0;
+    return __atomic_exchange_n(&r->sleeping, 0, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * shm_sleep - Consumer: announce a blocking wait. Returns 1 if it may
+ *     block on the doorbell, or 0 (flag cleared) if data arrived first.
+ */
+int shm_sleep(shm_ring_t *r)
+{
+    __atomic_store_n(&r->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (shm_readable(r) == 0)
+        return 1;
+    shm_wake(r);
+    return 0;
+}
+
+/* shm_wake - Consumer: polling again, no doorbell needed */
+void shm_wake(shm_ring_t *r)
+{
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * shm_send - Write all n bytes, yielding while the ring is full, and ring
+ *     bellfd if the consumer sleeps. Returns 0, or -1 if the doorbell fails
+ *     or the ring is corrupt (errno EPROTO).
+ */
+int shm_send(shm_ring_t *r, int bellfd, const void *buf, size_t n)
+{
+    const char *p = buf;
+    size_t done = 0;
+
+    while (done < n) {
+        size_t k = shm_write(r, p + done, n - done);
+        done += k;
+        if (shm_need_wake(r) && write(bellfd, "", 1) < 0 && errno != EAGAIN)
+            return -1;
+        if (k == 0 && shm_corrupt(r)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (k == 0)
+            sched_yield(); /* Full: the consumer is behind */
+    }
+    return 0;
+}
+
+/*
+ * shm_recv - Read at least one byte (at most n): poll for SHM_SPIN_US,
+ *     then sleep on bellfd. Returns the count, 0 if the peer closed the
+ *     socket, or -1 on error (errno EPROTO: the ring is corrupt).
+ */
+ssize_t shm_recv(shm_ring_t *r, int bellfd, void *buf, size_t n)
+{
+    char bell[64];
+    double deadline = 0;
+    size_t k;
+    ssize_t rc;
+
+    for (int spins = 0; (k = shm_read(r, buf, n)) == 0; spins++) {
+        if ((spins & 63) != 63) {
+            cpu_relax();
+            continue;
+        }
+        if (shm_corrupt(r)) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (deadline == 0)
+            deadline = now_us() + SHM_SPIN_US;
+        if (now_us() < deadline) {
+            sched_yield(); /* Let a server on the same core run */
+            continue;
+        }
+        if (!shm_sleep(r))
+            continue;
+        while ((rc = read(bellfd, bell, sizeof(bell))) < 0 && errno == EINTR)
+            ;
+        shm_wake(r);
+        if (rc <= 0)
+            return rc;
+        deadline = 0;
+    }
+    return k;
+}
+
+/*
+ * send_fd - Send n bytes (n >= 1) with fd attached as SCM_RIGHTS.
+ *     Returns 0, or -1 with errno set.
+ */
+int send_fd(int sock, const void *buf, size_t n, int fd)
+{
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov = { (void *)buf, n };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)n ? 0 : -1;
+}
+
+/*
+ * recv_fd - Receive up to n bytes; *fdp gets the descriptor sent with
+ *     them, or -1 if there was none. Returns the byte count like read.
+ */
+ssize_t recv_fd(int sock, void *buf, size_t n, int *fdp)
+{
+    union {
+        struct cmsghdr h;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } ctl;
+    struct iovec iov = { buf, n };
+    struct msghdr msg = { 0 };
+    struct cmsghdr *cm;
+    ssize_t rc;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    while ((rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    *fdp = -1;
+    if (rc >= 0 && (cm = CMSG_FIRSTHDR(&msg)) != NULL
+        && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(fdp, CMSG_DATA(cm), sizeof(int));
+    return rc;
+}
@@ -0,0 +1,76 @@
+/*
+ * shmring.h - Shared-memory request/reply rings for co-located clients
+ *
+ * A client connected over the server's Unix-domain socket may send
+ * SHM_HELLO as a text request. The reply "[shm] ok" arrives together
+ * with a memfd (SCM_RIGHTS) holding one shm_chan_t, and from then on the
+ * client writes its requests (text lines, or frames after BIN_HELLO)
+ * into chan->req and reads the replies from chan->resp, exactly as it
+ * would on the socket. The socket stays open: closing it ends the
+ * session, and otherwise it only carries doorbell bytes.
+ *
+ * Each ring has one producer and one consumer. Positions are
+ * free-running counters; the consumer owns head, the producer owns tail,
+ * and each publishes its own with a store-release. While both sides keep
+ * polling, a round trip makes no system call at all. A consumer that
+ * wants to block sets its ring's sleeping flag (shm_sleep) and waits for
+ * a byte on the socket; a producer that finds the flag set after
+ * publishing (shm_need_wake) sends that byte.
+ *
+ * Either side can scribble over the whole mapping, so neither trusts
+ * the other's position: a ring whose tail is more than SHM_RING_SIZE
+ * past its head is corrupt (shm_corrupt), and reads and writes on it
+ * move nothing.
+ */
+#ifndef __SHMRING_H__
+#define __SHMRING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_HELLO     "shm\n"
+#define SHM_RING_SIZE (64 << 10)    /* Bytes per direction (power of two) */
+#define SHM_SPIN_US   50            /* Polling before a blocking wait */
+
+/* Positions and the flag sit on separate cache lines */
+typedef struct {
+    uint32_t head;                  /* Consumer: next byte to read */
+    char pad0[60];
+    uint32_t tail;                  /* Producer: next byte to write */
+    char pad1[60];
+    uint32_t sleeping;              /* Consumer waits for a doorbell */
+    char pad2[60];
+    char data[SHM_RING_SIZE];
+} shm_ring_t;
+
+typedef struct {
+    shm_ring_t req;                 /* Client to server */
+    shm_ring_t resp;                /* Server to client */
+} shm_chan_t;
+
+/* Channel setup and teardown (return NULL and set errno on failure) */
+shm_chan_t *shm_create(int *fdp);
+shm_chan_t *shm_attach(int fd);
+void shm_detach(shm_chan_t *ch);
+
+/* Non-blocking ring access: copy what fits or what is there */
+size_t shm_write(shm_ring_t *r, const void *buf, size_t n);
+size_t shm_read(shm_ring_t *r, void *buf, size_t n);
+size_t shm_readable(shm_ring_t *r);
+int shm_corrupt(shm_ring_t *r);
+
+/* Doorbell protocol */
+int shm_need_wake(shm_ring_t *r);
+int shm_sleep(shm_ring_t *r);
+void shm_wake(shm_ring_t *r);
+
+/* Blocking helpers for clients: poll, then wait on the doorbell socket */
+int shm_send(shm_ring_t *r, int bellfd, const void *buf, size_t n);
+ssize_t shm_recv(shm_ring_t *r, int bellfd, void *buf, size_t n);
+
+/* Descriptor passing over a Unix-domain socket */
+int send_fd(int sock, const void *buf, size_t n, int fd);
+ssize_t recv_fd(int sock, void *buf, size_t n, int *fdp);
+
+#endif /* __SHMRING_H__ */
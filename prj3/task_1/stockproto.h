@@ -0,0 +1,159 @@
+/*
+ * stockproto.h - Binary wire protocol of the stock server
+ *
+ * A client that sends BIN_HELLO as a text request (normally its first)
+ * gets the text reply "[binary] ok" and from then on both sides exchange
+ * fixed-size stock_frame_t frames, all fields in network byte order:
+ *
+ *   request                       reply
+ *   BIN_SHOW                      one BIN_ROW frame per stock (id, qty =
+ *                                 left stock, price), then a BIN_OK frame
+ *   BIN_SHOW lo hi                the same for lo <= id <= hi in id order
+ *                                 (id = qty = 0: every stock, level order);
+ *                                 BIN_BADID if lo == hi is no stock
+ *   BIN_TOP  n key                the n stocks with the highest key
+ *                                 (TOP_PRICE or TOP_VOLUME), as for BIN_SHOW
+ *   BIN_BUY  id qty               BIN_OK, BIN_NOSTOCK or BIN_BADID
+ *   BIN_SELL id qty               BIN_OK or BIN_BADID
+ *   BIN_EXIT                      none; the server closes the connection
+ *
+ * Unknown opcodes are answered with BIN_BADOP, and a read-only standby
+ * answers buy/sell with BIN_READONLY.
+ */
+#ifndef __STOCKPROTO_H__
+#define __STOCKPROTO_H__
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#define BIN_HELLO "binary\n"
+
+typedef struct {
+    uint8_t op;         /* BIN_SHOW, BIN_BUY, BIN_SELL, BIN_EXIT or BIN_TOP */
+    uint8_t status;     /* Replies only */
+    uint16_t pad;
+    uint32_t id;
+    uint32_t qty;
+    uint32_t price;
+} stock_frame_t;        /* 16 bytes, no implicit padding */
+
+/* Opcodes */
+enum { BIN_SHOW = 1, BIN_BUY, BIN_SELL, BIN_EXIT, BIN_TOP };
+
+/* Reply status */
+enum { BIN_OK, BIN_ROW, BIN_NOSTOCK, BIN_BADID, BIN_BADOP, BIN_READONLY };
+
+/* Sort keys of "top <n> price|volume" (BIN_TOP's qty) */
+enum { TOP_PRICE, TOP_VOLUME };
+
+/*
+ * parse_show - Parse the arguments of "show [<id> | <lo>-<hi>]" into the
+ *     ID range to list; lo = hi = 0 means every stock. Returns 0, or -1
+ *     if the arguments are malformed.
+ */
+static inline int parse_show(const char *args, unsigned *lo, unsigned *hi)
+{
+    char extra;
+
+    *lo = *hi = 0;
+    args += strspn(args, " ");
+    if (*args == '\0' || *args == '\n')
+        return 0;
+    if (*args < '0' || *args > '9')
+        return -1;
+    if (sscanf(args, "%u-%u %c", lo, hi, &extra) == 2)
+        return *lo <= *hi ? 0 : -1;
+    if (sscanf(args, "%u %c", lo, &extra) == 1 && !strchr(args, '-')) {
+        *hi = *lo;
+        return 0;
+    }
+    return -1;
+}
+
+/*
+ * parse_top - Parse the arguments of "top <n> price|volume".
+ *     Returns 0, or -1 if they are malformed.
+ */
+static inline int parse_top(const char *args, unsigned *n, unsigned *key)
+{
+    char name[16], extra;
+
+    if (sscanf(args, "%u %15s %c", n, name, &extra) != 2 || *n == 0
+        || strchr(args, '-'))
+        return -1;
+    if (!strcmp(name, "price"))
+        *key = TOP_PRICE;
+    else if (!strcmp(name, "volume"))
+        *key = TOP_VOLUME;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * frame_encode - Encode a text request ("buy 3 10\n") as a frame.
+ *     Returns 0, or -1 if the line is not a valid request.
+ */
+static inline int frame_encode(const char *line, stock_frame_t *f)
+{
+    char cmd[16];
+    unsigned id = 0, qty = 0;
+    int off = 0;
+    int nargs = sscanf(line, "%15s%n %u %u", cmd, &off, &id, &qty);
+
+    memset(f, 0, sizeof(*f));
+    if (nargs >= 1 && !strcmp(cmd, "show")) {
+        if (parse_show(line + off, &id, &qty) < 0)
+            return -1;
+        f->op = BIN_SHOW;
+    } else if (nargs >= 1 && !strcmp(cmd, "top")) {
+        if (parse_top(line + off, &id, &qty) < 0)
+            return -1;
+        f->op = BIN_TOP;
+    } else if (nargs == 3 && !strcmp(cmd, "buy")) {
+        f->op = BIN_BUY;
+    } else if (nargs == 3 && !strcmp(cmd, "sell")) {
+        f->op = BIN_SELL;
+    } else if (nargs >= 1 && !strcmp(cmd, "exit")) {
+        f->op = BIN_EXIT;
+    } else {
+        return -1;
+    }
+    f->id = htonl(id);
+    f->qty = htonl(qty);
+    return 0;
+}
+
+/*
+ * frame_format - Render a reply frame to op as the text server's reply
+ *     line would read. Returns 1 if more frames of this reply follow.
+ */
+static inline int frame_format(const stock_frame_t *f, int op, char *buf, size_t size)
+{
+    switch (f->status) {
+    case BIN_ROW:
+        snprintf(buf, size, "%u %u %u\n",
+                 ntohl(f->id), ntohl(f->qty), ntohl(f->price));
+        return 1;
+    case BIN_OK:
+        snprintf(buf, size, "%s", op == BIN_BUY ? "[buy] success\n"
+                                : op == BIN_SELL ? "[sell] success\n" : "");
+        return 0;
+    case BIN_NOSTOCK:
+        snprintf(buf, size, "Not enough stock\n");
+        return 0;
+    case BIN_BADID:
+        snprintf(buf, size, "Invalid ID\n");
+        return 0;
+    case BIN_READONLY:
+        snprintf(buf, size, "Read-only standby\n");
+        return 0;
+    default:
+        snprintf(buf, size, "Unknow command\n");
+        return 0;
+    }
+}
+
+#endif /* __STOCKPROTO_H__ */
@@ -5,12 +5,24 @@
  * port: 60029
  */
 #include "csapp.h"
+#include "stockproto.h"
+#include "objpool.h"
+#include "dedup.h"
+#include "shmring.h"
 #include <time.h>
+#include <netinet/tcp.h>
 
 static struct timespec first_connect = {0}, last_disconnect = {0};
 static int clientcnt = 0; /* number of active clients */
 
-#define MAX_STOCK_NUM 1024
+#define ROW_LEN 40 /* "ID left_stock price\n" always fits */
+#define NODE_SLAB 1024 /* Nodes carved per slab */
+
+/* Every reply is a block of lines terminated by an empty line */
+#define END_OF_REPLY "\n"
+
+/* Ordered indexes over the stocks: by ID ascending, by price and by left stock descending */
+enum { BY_ID, BY_PRICE, BY_VOLUME, NINDEX };
 
 /* Stock databse encapsulation */
 typedef struct node {
@@ -18,71 +30,262 @@ typedef struct node {
     int left_stock;
     int price;
     struct node *left, *right;
+    int rowlen;         /* Length of row */
+    char row[ROW_LEN];  /* Pre-rendered "ID left_stock price\n" line for show */
+    stock_frame_t frame; /* ... and its BIN_ROW frame for binary clients */
+    int pos[NINDEX];    /* Position in each of db.index[] */
 } node_t;
 
 typedef struct {
     node_t *root;
-    char buf[MAXLINE];
+    node_t **nodes;     /* Nodes in level order: children of nodes[i] are nodes[2i+1], nodes[2i+2] */
+    int cnt;            /* Number of stocks */
+    int cap;            /* Capacity of nodes, index[] and iov */
+    node_t **index[NINDEX]; /* Nodes sorted by each key, ties broken by ID */
+    struct iovec *iov;  /* Gather list for show: one row (or frame) per stock plus the terminator */
 } stockdb_t;
 
 static stockdb_t db;
+static objpool_t node_pool; /* Every node_t; freed all at once */
 
-/* signal handler */
+/* signal handlers: they only set a flag for the event loop */
+static volatile sig_atomic_t stop_requested;   /* SIGINT/SIGTERM: drain, snapshot, exit */
+static volatile sig_atomic_t reload_requested; /* SIGHUP: drain, snapshot, re-exec */
 static void sigint_handler(int sig);
+static void sighup_handler(int sig);
+
+/* shutdown and hot reload */
+#define DRAIN_TIMEOUT 5                    /* Seconds to flush replies before stopping */
+#define HANDOFF_ENV "STOCKSERVER_HANDOFF"  /* Descriptor of the state a reload passes on */
+static char **server_argv;                 /* What a reload executes */
+static FILE *handoff_open(int *listenfd, int *nclients);
+static FILE *handoff_begin(int listenfd, int nclients);
+static void finish(FILE *handoff);
 
 /* stock operations */
 static void load_stock(const char *path);
 static void dump_stock(const char *path);
-static size_t list_stock(void);
+static int list_rows(node_t **v, int cnt, const stock_frame_t *end);
+static int list_stock(const stock_frame_t *end);
+static int list_range(unsigned lo, unsigned hi, const stock_frame_t *end);
+static int list_top(unsigned n, unsigned key, const stock_frame_t *end);
 static int change_stock(int id, char req, int amt);
+static int apply_stock(int id, int stock, int price);
 static void free_stockdb(void);
 
 /* binary tree operations */
 static node_t *node_create(int id, int stock, int price);
-static void node_insert(node_t **proot, node_t *new_node);
-static node_t *node_search(node_t *r, int id);
-static void node_free(node_t *r);
+static void node_render(node_t *n);
+static void node_insert(node_t *new_node);
+static node_t *node_search(int id);
+static void index_fix(node_t *n, int k);
 
 /* server pool */
+#define OUT_HIGHWAT (1 << 20) /* Stop reading a client with this much unsent output */
+#define CONN_SLAB   64        /* Connection states carved per slab */
+#ifndef IDLE_TRIM
+#define IDLE_TRIM   10        /* Seconds idle before a client's buffers are released */
+#endif
+#ifndef IDLE_TIMEOUT
+#define IDLE_TIMEOUT 600      /* Seconds idle before a client is disconnected */
+#endif
+
+/* Server side of a shared-memory channel */
+typedef struct shmconn {
+    shm_chan_t *ch;
+    int slot;                       /* Index in pool.shm */
+    char *in;                       /* Requests taken off the ring, last one partial */
+    size_t inlen, incap;
+    char *out;                      /* Replies that did not fit in the ring */
+    size_t outlen, outcap;
+} shmconn_t;
+
+/* State of one connected client, taken from a slab on accept */
+typedef struct conn {
+    int fd;
+    rioz_t rio;                     /* Read buffer (small at first, grows for long input) */
+    riow_t wio;                     /* Output queue */
+    int closing;                    /* exit received: close once output drains */
+    int binary;                     /* Speaks stockproto.h frames instead of lines */
+    dedup_t *dedup;                 /* Order ID window, taken once the client uses IDs */
+    struct shmconn *shm;            /* Shared-memory channel, after SHM_HELLO */
+    time_t last;                    /* Last activity, in monotonic seconds */
+    struct conn *prev, *next;       /* Activity list */
+} conn_t;
+
 typedef struct { /* Represents a pool of connected descriptors */
     int maxfd;                      /* Largest descriptor in read_set */
     fd_set read_set;                /* Set of all active descriptors */
     fd_set ready_set;               /* Subset of descriptors ready for reading */
+    fd_set write_set;               /* Descriptors with queued output */
+    fd_set wready_set;              /* Subset of descriptors ready for writing */
     int nready;                     /* Number of ready descriptors from select */
-    int maxi;                       /* High water index into client array */
-    int clientfd[FD_SETSIZE];       /* Set of active descriptors */
-    rio_t clientrio[FD_SETSIZE];    /* Set of active read buffers */
+    time_t now;                     /* Monotonic seconds at the last select */
+    conn_t *conn[FD_SETSIZE];       /* Active connections, by descriptor */
+    conn_t active;                  /* List head: untrimmed clients, least recently active first */
+    conn_t idle;                    /* List head: trimmed clients, least recently active first */
+    conn_t *shm[FD_SETSIZE];        /* Clients on shared-memory channels */
+    int nshm;
+    double shm_last;                /* Microseconds: last request seen on a ring */
+    int shm_burst;                  /* Ring-only passes since the last select */
 } pool;
 
+/* Reply to one request, gathered from static strings and pre-rendered rows */
+typedef struct {
+    struct iovec *iov;  /* Segments to send, in order */
+    int iovcnt;
+    struct iovec one;   /* Storage for single-line replies */
+    stock_frame_t frame; /* Storage for single-frame replies */
+    char text[64];      /* Storage for formatted single-line replies */
+} reply_t;
+
+#define REQ_REPLY  0    /* reply_t is filled in and must be sent */
+#define REQ_EXIT   1    /* Client asked to close the connection */
+#define REQ_BINARY 2    /* As REQ_REPLY, then switch the client to frames */
+#define REQ_SHM    3    /* Client now talks over a shared-memory channel */
+
+/* request handling, shared by every I/O backend */
+static int handle_request(char *buf, reply_t *r, dedup_t **dedup);
+static int handle_frame(const char *buf, size_t n, reply_t *r);
+static size_t request_len(const char *buf, size_t len, int binary);
+static void client_opened(void);
+static void client_closed(void);
+
 /* server pool operations */
+static void serve_select(int listenfd, FILE *handoff, int nadopt);
 static void init_pool(int listenfd, pool *p);
 static void add_client(int connfd, pool *p);
-static int all_closed(pool *p);
-static void close_client(pool *p, int i);
-static void handle_request(pool *p, int connfd, char *buf, int idx);
+static void close_client(pool *p, conn_t *c);
+static void serve_client(pool *p, conn_t *c);
+static void update_client(pool *p, conn_t *c);
 static void check_clients(pool *p);
+static void sweep_clients(pool *p);
+static void adopt_clients(pool *p, FILE *handoff, int n);
+static void drain_clients(pool *p, int listenfd, int reload);
+static void stop_select(pool *p, int listenfd, int reload);
+
+/* replication (select backend) */
+static int is_standby; /* Applying a primary's log: buy/sell are refused */
+static void repl_listen(char *port);
+static void repl_follow(char *hostport);
+static void repl_watch(pool *p);
+static void repl_poll(pool *p);
+static void repl_flush(pool *p);
+static void repl_log(char req, int id, int amt);
+static int repl_active(void);
+static size_t repl_pending(void);
+
+/* local transports: Unix-domain socket (both backends), shared memory (select) */
+static int local_listenfd = -1;         /* -u: co-located clients connect here */
+static char *local_path;
+static void local_accept(pool *p);
+static int shm_begin(pool *p, conn_t *c, reply_t *r);
+static void shm_end(pool *p, conn_t *c);
+static int shm_serve(pool *p, conn_t *c);
+static void shm_poll(pool *p);
+static int shm_spin(pool *p, struct timeval *tv);
+static void shm_awake(pool *p);
+
+#ifdef USE_URING
+/* io_uring backend: returns -1 with errno set if io_uring is unusable */
+static int serve_uring(int listenfd);
+#endif
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    char *repl_port = NULL, *primary = NULL;
+
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 < argc && !strcmp(argv[i], "-R"))
+            repl_port = argv[i + 1];
+        else if (i + 1 < argc && !strcmp(argv[i], "-f"))
+            primary = argv[i + 1];
+        else if (i + 1 < argc && !strcmp(argv[i], "-u"))
+            local_path = argv[i + 1];
+        else
+            argc = 0; /* Bad option */
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port> [-u <socket path>] [-R <replication port>] [-f <primary host>:<replication port>]\n", argv[0]);
+        fprintf(stderr, "  -u  also listen on this Unix-domain socket (shared-memory channels on request)\n");
+        fprintf(stderr, "  -R  stream the order log to standbys that connect to this port\n");
+        fprintf(stderr, "  -f  run as a read-only standby of that primary until it goes away\n");
         exit(0);
     }
 
+    server_argv = argv;
     Signal(SIGINT, sigint_handler);
+    Signal(SIGTERM, sigint_handler);
+    Signal(SIGHUP, sighup_handler);
+    Signal(SIGPIPE, SIG_IGN); /* Writes to a gone client fail with EPIPE */
     load_stock("stock.txt");
 
-    int listenfd = Open_listenfd(argv[1]);
+    int listenfd, nadopt = 0;
+    FILE *handoff = handoff_open(&listenfd, &nadopt); /* Started by a reload? */
+    if (!handoff) {
+        listenfd = Open_listenfd(argv[1]);
+    } else if (nadopt == 0) {
+        fclose(handoff);
+        handoff = NULL;
+    }
+    if (local_path && local_listenfd < 0)
+        local_listenfd = Open_listenfd_unix(local_path);
+    if (repl_port)
+        repl_listen(repl_port);
+    if (primary)
+        repl_follow(primary);
+#ifdef USE_URING
+    if (repl_port || primary) /* Replication runs in the select loop */
+        fprintf(stderr, "replication: using the select backend\n");
+    else if (nadopt > 0) /* Adopted connections live in the select loop */
+        fprintf(stderr, "reload: serving adopted clients with the select backend\n");
+    else if (serve_uring(listenfd) < 0)
+        fprintf(stderr, "io_uring unavailable (%s), falling back to select\n",
+                strerror(errno));
+#endif
+    serve_select(listenfd, handoff, nadopt);
+    return 0;
+}
+
+/* Event loop of the select backend */
+static void serve_select(int listenfd, FILE *handoff, int nadopt) {
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     char client_host[MAXLINE], client_port[MAXLINE];
     static pool pool;
+    struct timeval tv;
+    struct timespec ts;
 
     init_pool(listenfd, &pool);
+    repl_watch(&pool);
+    if (handoff) {
+        clock_gettime(CLOCK_MONOTONIC, &ts); /* Adopted clients start active */
+        pool.now = ts.tv_sec;
+        adopt_clients(&pool, handoff, nadopt);
+    }
 
     while (1) {
-        pool.ready_set = pool.read_set;
-        pool.nready    = Select(pool.maxfd+1,
-                                &pool.ready_set, NULL, NULL, NULL);
+        tv.tv_sec = 1; /* Wake up to sweep idle clients */
+        tv.tv_usec = 0;
+        if (shm_spin(&pool, &tv)) { /* Requests on the rings: sockets can wait */
+            shm_poll(&pool);
+            continue;
+        }
+        pool.ready_set  = pool.read_set;
+        pool.wready_set = pool.write_set;
+        pool.nready     = select(pool.maxfd+1,
+                                 &pool.ready_set, &pool.wready_set, NULL, &tv);
+        shm_awake(&pool);
+        if (pool.nready < 0) {
+            if (errno != EINTR)
+                unix_error("Select error");
+            pool.nready = 0; /* A signal: nothing is ready */
+            FD_ZERO(&pool.ready_set);
+            FD_ZERO(&pool.wready_set);
+        }
+        if (stop_requested || reload_requested)
+            stop_select(&pool, listenfd, !stop_requested);
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        pool.now = ts.tv_sec;
         if (FD_ISSET(listenfd, &pool.ready_set)) {
             clientlen = sizeof(clientaddr);
             int connfd = Accept(listenfd,
@@ -93,17 +296,97 @@ int main(int argc, char **argv) {
             printf("Connected to (%s, %s)\n", client_host, client_port);
             add_client(connfd, &pool);
         }
+        local_accept(&pool);
+        repl_poll(&pool);
         check_clients(&pool);
+        shm_poll(&pool);
+        repl_flush(&pool); /* Ship this pass's orders to the standbys */
+        sweep_clients(&pool);
     }
-    return 0;
 }
 
 /*-------------- Signal handler --------------*/
-/* SIGINT signal handler */
+/* SIGINT/SIGTERM handler: the event loop drains, snapshots and exits */
 static void sigint_handler(int sig) {
+    stop_requested = 1;
+}
+
+/* SIGHUP handler: the event loop drains, snapshots and re-executes */
+static void sighup_handler(int sig) {
+    reload_requested = 1;
+}
+
+/*-------------- Shutdown and hot reload --------------*/
+/*
+ * A stop (SIGINT, SIGTERM) or reload (SIGHUP) is handled by the event
+ * loop, never inside the handler: it stops accepting, answers what the
+ * clients have already sent, flushes the replies and snapshots the
+ * catalog to stock.txt. A stop then exits. A reload writes a handoff -
+ * the listening descriptor and, for the select backend, every open
+ * connection with its mode and any partial request - to an unlinked
+ * file, and executes argv[0] (which may be a new binary) with that
+ * file's descriptor in HANDOFF_ENV. Descriptors survive exec, so the
+ * new image keeps accepting from the same queue and serving the same
+ * connections after loading the snapshot.
+ *
+ * Handoff format: "listen <fd> <n> <local fd>\n" (local fd -1 without
+ * -u), then per connection "client <fd> <binary> <len> <windowed>\n",
+ * len bytes of buffered input and, if windowed, its order ID window
+ * (dedup_save). Shared-memory clients are not handed off: they are
+ * closed after the drain and reconnect.
+ */
+
+/* Read the header of the handoff left by a reload, or return NULL */
+static FILE *handoff_open(int *listenfd, int *nclients) {
+    char line[MAXLINE], *env = getenv(HANDOFF_ENV);
+    FILE *handoff;
+
+    if (!env)
+        return NULL;
+    handoff = Fdopen(atoi(env), "r");
+    unsetenv(HANDOFF_ENV);
+    if (!fgets(line, sizeof(line), handoff)
+        || sscanf(line, "listen %d %d %d", listenfd, nclients, &local_listenfd) < 2)
+        app_error("reload: bad handoff");
+    printf("reload: listening on fd %d, %d clients to adopt\n", *listenfd, *nclients);
+    return handoff;
+}
+
+/* Start a handoff for the listening socket and nclients connections */
+static FILE *handoff_begin(int listenfd, int nclients) {
+    FILE *handoff = tmpfile();
+
+    if (!handoff)
+        unix_error("tmpfile error");
+    fprintf(handoff, "listen %d %d %d\n", listenfd, nclients, local_listenfd);
+    return handoff;
+}
+
+/* 
+ * Snapshot the catalog and exit, or given a reload's handoff, execute
+ * the server again. Returns only if that exec fails; the caller then
+ * carries on serving.
+ */
+static void finish(FILE *handoff) {
+    char fd[16];
+
     dump_stock("stock.txt");
-    free_stockdb();
-    exit(0);
+    if (!handoff) {
+        if (local_listenfd >= 0)
+            unlink(local_path);
+        free_stockdb();
+        exit(0);
+    }
+    fflush(handoff);
+    rewind(handoff);
+    snprintf(fd, sizeof(fd), "%d", fileno(handoff));
+    setenv(HANDOFF_ENV, fd, 1);
+    printf("reload: executing %s\n", server_argv[0]);
+    fflush(stdout);
+    execvp(server_argv[0], server_argv);
+    fprintf(stderr, "reload: %s: %s; carrying on\n", server_argv[0], strerror(errno));
+    unsetenv(HANDOFF_ENV);
+    fclose(handoff);
 }
 
 /*-------------- Stock DB operations --------------*/
@@ -115,9 +398,10 @@ static void load_stock(const char *path) {
         exit(1); 
     }
     int id, st, pr;
+    objpool_init(&node_pool, sizeof(node_t), NODE_SLAB);
     while (fscanf(f, "%d %d %d", &id, &st, &pr) == 3) {
         node_t *n = node_create(id, st, pr);
-        node_insert(&db.root, n);
+        node_insert(n);
     }
     fclose(f);
 }
@@ -126,43 +410,63 @@ static void load_stock(const char *path) {
 static void dump_stock(const char *path) {
     FILE *f = fopen(path, "w");
     if (!f) { perror("fopen"); exit(1); }
-    if (!db.root) { fclose(f); return; }
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = db.root;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        fprintf(f, "%d %d %d\n", cur->ID, cur->left_stock, cur->price);
-        if (cur->left)  queue[tail++] = cur->left;
-        if (cur->right) queue[tail++] = cur->right;
-    }
+    for (int i = 0; i < db.cnt; i++) /* nodes[] is already in level order */
+        fputs(db.nodes[i]->row, f);
     fclose(f);
 }
 
-/* List all stocks */
-static size_t list_stock(void) {
-    size_t off = 0;
-    db.buf[0] = '\0';
-    if (!db.root) return 0;
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = db.root;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        int len = snprintf(db.buf + off, MAXLINE - off,
-                           "%d %d %d\n",
-                           cur->ID, cur->left_stock, cur->price);
-        if (len < 0 || (size_t)len >= MAXLINE - off) break; /* snprintf error or bufferoverflow */
-        off += len;
-        if (cur->left)  queue[tail++] = cur->left;
-        if (cur->right) queue[tail++] = cur->right;
+/* 
+ * Point the gather list at the pre-rendered rows of v[0..cnt-1] and the
+ * reply terminator, so a listing is written without copying or a size
+ * cap. end is NULL for text rows; otherwise the rows are BIN_ROW frames
+ * and end is the frame that closes the reply. Returns the iovec count.
+ */
+static int list_rows(node_t **v, int cnt, const stock_frame_t *end) {
+    for (int i = 0; i < cnt; i++) {
+        db.iov[i].iov_base = end ? (void *)&v[i]->frame : v[i]->row;
+        db.iov[i].iov_len  = end ? sizeof(stock_frame_t) : v[i]->rowlen;
     }
-    return off;
+    db.iov[cnt].iov_base = end ? (void *)end : END_OF_REPLY;
+    db.iov[cnt].iov_len  = end ? sizeof(*end) : sizeof(END_OF_REPLY) - 1;
+    return cnt + 1;
+}
+
+/* List all stocks (level order) */
+static int list_stock(const stock_frame_t *end) {
+    return list_rows(db.nodes, db.cnt, end);
+}
+
+/* 
+ * List the stocks with lo <= ID <= hi in ID order: O(log n + k) over the
+ * ID index. Returns -1 if a single ID (lo == hi) is no stock.
+ */
+static int list_range(unsigned lo, unsigned hi, const stock_frame_t *end) {
+    node_t **v = db.index[BY_ID];
+    int first = 0, last, mid, cnt = db.cnt;
+
+    while (first < cnt) { /* First ID >= lo */
+        mid = (first + cnt) / 2;
+        if ((unsigned)v[mid]->ID < lo)
+            first = mid + 1;
+        else
+            cnt = mid;
+    }
+    for (last = first; last < db.cnt && (unsigned)v[last]->ID <= hi; last++)
+        ;
+    if (lo == hi && last == first)
+        return -1;
+    return list_rows(v + first, last - first, end);
+}
+
+/* List the n stocks with the highest price or left stock (TOP_PRICE, TOP_VOLUME) */
+static int list_top(unsigned n, unsigned key, const stock_frame_t *end) {
+    node_t **v = db.index[key == TOP_PRICE ? BY_PRICE : BY_VOLUME];
+    return list_rows(v, n < (unsigned)db.cnt ? (int)n : db.cnt, end);
 }
 
 /* Change stock */
 static int change_stock(int id, char req, int amt) {
-    node_t *n = node_search(db.root, id);
+    node_t *n = node_search(id);
     if (!n) return -1; /* Invalid ID */
     if (req == 'b') {
         if (n->left_stock < amt) return 1; /* Not enough stock*/
@@ -170,141 +474,964 @@ static int change_stock(int id, char req, int amt) {
     } else if (req == 's') { /* sell is always success */
         n->left_stock += amt;
     }
+    node_render(n);
+    index_fix(n, BY_VOLUME);
+    repl_log(req, id, amt);
     return 0; /* Success */
 }
 
+/* Set a stock to a replicated snapshot row, adding it if it is new */
+static int apply_stock(int id, int stock, int price) {
+    node_t *n = node_search(id);
+    if (!n) {
+        node_insert(node_create(id, stock, price));
+        return 0;
+    }
+    n->left_stock = stock;
+    n->price = price;
+    node_render(n);
+    index_fix(n, BY_PRICE);
+    index_fix(n, BY_VOLUME);
+    return 0;
+}
+
 /* Free the stock database */
 static void free_stockdb(void) {
-    node_free(db.root);
+    objpool_destroy(&node_pool);
     db.root = NULL;
+    free(db.nodes);
+    free(db.iov);
+    for (int k = 0; k < NINDEX; k++) {
+        free(db.index[k]);
+        db.index[k] = NULL;
+    }
+    db.nodes = NULL;
+    db.iov = NULL;
+    db.cnt = db.cap = 0;
 }
 
 /*-------------- Binary Tree operations --------------*/
 /* Create a new node */
 static node_t *node_create(int id, int stock, int price) {
-    node_t *n = malloc(sizeof(*n));
-    if (!n) { 
-        perror("malloc"); 
-        exit(1); 
-    }
+    node_t *n = objpool_get(&node_pool); /* Neighbours in level order share cache lines */
     n->ID = id;
     n->left_stock = stock;
     n->price = price;
     n->left = n->right = NULL;
+    node_render(n);
     return n;
 }
 
-/* Insert a new node into the binary tree (level order insertion) */
-static void node_insert(node_t **proot, node_t *new_node) {
-    if (!*proot) { /* If the tree is empty */
-        *proot = new_node;
-        return;
+/* Re-render the node's show row and frame after its fields changed */
+static void node_render(node_t *n) {
+    n->rowlen = snprintf(n->row, ROW_LEN, "%d %d %d\n",
+                         n->ID, n->left_stock, n->price);
+    n->frame.op = BIN_SHOW;
+    n->frame.status = BIN_ROW;
+    n->frame.pad = 0;
+    n->frame.id = htonl(n->ID);
+    n->frame.qty = htonl(n->left_stock);
+    n->frame.price = htonl(n->price);
+}
+
+/* 
+ * Insert a new node into the binary tree (level order insertion).
+ * The tree is complete, so the parent of the n-th node is nodes[(n-1)/2].
+ */
+static void node_insert(node_t *new_node) {
+    if (db.cnt == db.cap) { /* Grow nodes[], index[] and iov[] (+1 for END_OF_REPLY) */
+        db.cap = db.cap ? 2 * db.cap : 64;
+        db.nodes = Realloc(db.nodes, db.cap * sizeof(node_t *));
+        for (int k = 0; k < NINDEX; k++)
+            db.index[k] = Realloc(db.index[k], db.cap * sizeof(node_t *));
+        db.iov = Realloc(db.iov, (db.cap + 1) * sizeof(struct iovec));
     }
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = *proot;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        if (!cur->left) {
-            cur->left = new_node;
-            return;
-        }
-        queue[tail++] = cur->left;
-        if (!cur->right) {
-            cur->right = new_node;
-            return;
-        }
-        queue[tail++] = cur->right;
+    int i = db.cnt;
+    db.nodes[db.cnt++] = new_node;
+    for (int k = 0; k < NINDEX; k++) { /* Append, then move into place */
+        db.index[k][i] = new_node;
+        new_node->pos[k] = i;
+        index_fix(new_node, k);
+    }
+    if (i == 0) { /* If the tree is empty */
+        db.root = new_node;
+        return;
     }
+    node_t *parent = db.nodes[(i - 1) / 2];
+    if (i % 2)
+        parent->left = new_node;
+    else
+        parent->right = new_node;
 }
 
-/* Search for a node by ID in the binary tree */
-static node_t *node_search(node_t *r, int id) {
-    if (!r) return NULL;
-    /* fixed-size queue */
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
+/* Search for a node by ID: binary search of the ID index */
+static node_t *node_search(int id) {
+    node_t **v = db.index[BY_ID];
+    int lo = 0, hi = db.cnt;
 
-    queue[tail++] = r;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (v[mid]->ID < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < db.cnt && v[lo]->ID == id ? v[lo] : NULL; /* NULL: not found */
+}
 
-    while(head < tail) {
-        node_t *cur = queue[head++];
+/* Does a sort before b in index k? */
+static int node_before(node_t *a, node_t *b, int k) {
+    if (k == BY_PRICE && a->price != b->price)
+        return a->price > b->price;
+    if (k == BY_VOLUME && a->left_stock != b->left_stock)
+        return a->left_stock > b->left_stock;
+    return a->ID < b->ID;
+}
 
-        if(cur->ID == id) return cur;
+/* 
+ * Move n to its place in index k after its key changed, shifting the
+ * nodes it passes. A buy/sell moves a stock past few others, so keeping
+ * the volume index sorted costs far less than sorting it for each top.
+ */
+static void index_fix(node_t *n, int k) {
+    node_t **v = db.index[k];
+    int i = n->pos[k];
 
-        if(cur->left) queue[tail++] = cur->left;
-        if(cur->right) queue[tail++] = cur->right;
+    while (i > 0 && node_before(n, v[i - 1], k)) {
+        v[i] = v[i - 1];
+        v[i]->pos[k] = i;
+        i--;
+    }
+    while (i + 1 < db.cnt && node_before(v[i + 1], n, k)) {
+        v[i] = v[i + 1];
+        v[i]->pos[k] = i;
+        i++;
     }
+    v[i] = n;
+    n->pos[k] = i;
+}
+
+/*-------------- Pool management --------------*/
+static objpool_t conn_pool; /* Every conn_t */
+static objpool_t dedup_pool; /* Order ID windows of every backend's clients */
 
-    return NULL; /* Not found */
+/* Circular doubly linked lists of connections, headed by a sentinel */
+static void list_init(conn_t *head) {
+    head->prev = head->next = head;
 }
 
-/* Free the binary tree recursively*/
-static void node_free(node_t *r) {
-    if (!r) return;
-    node_free(r->left);
-    node_free(r->right);
-    free(r);
+static void list_remove(conn_t *c) {
+    c->prev->next = c->next;
+    c->next->prev = c->prev;
+}
+
+static void list_append(conn_t *head, conn_t *c) {
+    c->prev = head->prev;
+    c->next = head;
+    head->prev->next = c;
+    head->prev = c;
+}
+
+/* Record activity: c becomes the most recently active client */
+static void touch_client(pool *p, conn_t *c) {
+    c->last = p->now;
+    list_remove(c);
+    list_append(&p->active, c);
 }
 
-/*-------------- Pool management --------------*/
 /* Initialize the pool of active clients */
 static void init_pool(int listenfd, pool *p) {
     /* Initially, there are no connected descriptors */
-    p->maxi = -1;
     for (int i = 0; i < FD_SETSIZE; i++) 
-        p->clientfd[i] = -1;
+        p->conn[i] = NULL;
+    list_init(&p->active);
+    list_init(&p->idle);
+    objpool_init(&conn_pool, sizeof(conn_t), CONN_SLAB);
+    objpool_init(&dedup_pool, sizeof(dedup_t), CONN_SLAB);
     
     /* Initially, listenfd is only member of select read set */
     p->maxfd = listenfd;
     FD_ZERO(&p->read_set);
+    FD_ZERO(&p->write_set);
     FD_SET(listenfd, &p->read_set);
+    if (local_listenfd >= 0) {
+        FD_SET(local_listenfd, &p->read_set);
+        if (local_listenfd > p->maxfd)
+            p->maxfd = local_listenfd;
+    }
+    p->nshm = 0;
 }
 
 /* Add a new client connection to the pool */
 static void add_client(int connfd, pool *p) {
-    int i;
     p->nready--;
-    for (i = 0; i < FD_SETSIZE; i++) { /* Find an available slot */
-        if (p->clientfd[i] < 0) {
-            /* Add connected descriptor to the pool */
-            p->clientfd[i] = connfd;
-            Rio_readinitb(&p->clientrio[i], connfd);
-
-            /* Add the descriptor to descriptor set */
-            FD_SET(connfd, &p->read_set);
-
-            /* Update max descriptor and pool high water mark */
-            if (connfd > p->maxfd)
-                p->maxfd = connfd;
-            if (i > p->maxi)
-                p->maxi = i;
-
-            clientcnt++;
-            if (clientcnt == 1 && first_connect.tv_sec == 0) {
-                clock_gettime(CLOCK_MONOTONIC, &first_connect);
+    if (connfd >= FD_SETSIZE) { /* select() cannot watch it */
+        fprintf(stderr, "add_client error: Too many clients\n");
+        Close(connfd);
+        return;
+    }
+
+    conn_t *c = objpool_get(&conn_pool);
+    c->fd = connfd;
+    Fcntl(connfd, F_SETFL, Fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+    /* Replies are batched by serve_client: don't let Nagle delay them
+       (fails harmlessly on a Unix-domain socket) */
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+    Rioz_readinitb(&c->rio, connfd); /* Buffers are allocated on first use */
+    riow_init(&c->wio, connfd);
+    c->closing = 0;
+    c->binary = 0;
+    c->dedup = NULL;
+    c->shm = NULL;
+    c->last = p->now;
+    list_append(&p->active, c);
+    p->conn[connfd] = c;
+
+    /* Add the descriptor to descriptor set */
+    FD_SET(connfd, &p->read_set);
+
+    /* Update max descriptor */
+    if (connfd > p->maxfd)
+        p->maxfd = connfd;
+
+    client_opened();
+}
+
+/* Close a client connection and removes it from the pool */
+static void close_client(pool *p, conn_t *c) {
+    if (c->shm)
+        shm_end(p, c);
+    Close(c->fd);
+    FD_CLR(c->fd, &p->read_set);
+    FD_CLR(c->fd, &p->write_set);
+    p->conn[c->fd] = NULL;
+    rioz_free(&c->rio);
+    riow_free(&c->wio);
+    if (c->dedup)
+        objpool_put(&dedup_pool, c->dedup);
+    list_remove(c);
+    objpool_put(&conn_pool, c);
+    client_closed();
+}
+
+/* Set TCP_CORK: hold partial segments until uncorked */
+static void set_cork(int connfd, int on) {
+    setsockopt(connfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* 
+ * Serve every complete request line the client has sent so far. Reads
+ * and writes never block: a partial line waits in c->rio for the next
+ * readiness event and unsent replies wait in c->wio. EOF is treated like
+ * exit: a client that half-closes still gets every reply, and
+ * update_client closes it once they are sent.
+ *
+ * Replies of one pass are coalesced: each reply is queued only when the
+ * next request arrives (before it can change the rows a show points at),
+ * and the pass ends with a single write. A lone reply is sent straight
+ * from its gather list with no copy. The deferred reply goes out even
+ * when the pass ends in exit or EOF: only then may the client close.
+ */
+static void serve_client(pool *p, conn_t *c) {
+    rioz_t *rio = &c->rio;
+    riow_t *wio = &c->wio;
+    char *line;
+    reply_t r[2], *last = NULL;
+    int n, rc, k = 0, err = 0;
+
+    if (c->shm) { /* The socket only rings the doorbell */
+        char bell[64];
+        while ((n = read(c->fd, bell, sizeof(bell))) > 0)
+            ;
+        if (n == 0 || errno != EAGAIN)
+            close_client(p, c);
+        else
+            shm_serve(p, c);
+        return;
+    }
+
+    while (!c->closing && riow_pending(wio) < OUT_HIGHWAT) {
+        if (c->binary)
+            n = rioz_getn(rio, &line, sizeof(stock_frame_t));
+        else
+            n = rioz_getline(rio, &line);
+        if (n == RIO_AGAIN) /* Need more data */
+            break;
+        if (n == 0) { /* EOF, after every buffered line: answer, then close */
+            c->closing = 1;
+            break;
+        }
+        if (n < 0) { /* Error: nobody to answer */
+            close_client(p, c);
+            return;
+        }
+        printf("server received %d bytes\n", n);
+        if (last && riow_queuev(wio, last->iov, last->iovcnt) < 0) {
+            err = 1;
+            break;
+        }
+        last = NULL;
+        if (c->binary)
+            rc = handle_frame(line, n, &r[k]);
+        else if (!strcmp(line, SHM_HELLO))
+            rc = shm_begin(p, c, &r[k]);
+        else
+            rc = handle_request(line, &r[k], &c->dedup);
+        if (rc == REQ_EXIT) {
+            c->closing = 1;
+            break;
+        }
+        if (rc == REQ_SHM) /* Replied and switched: serve the rings from now on */
+            return;
+        if (rc == REQ_BINARY)
+            c->binary = 1;
+        last = &r[k];
+        k ^= 1;
+    }
+
+    /* Send the deferred reply before update_client may close a closing client */
+    if (!err && last && riow_pending(wio) == 0) { /* Lone reply: no copy */
+        int cork = last->iovcnt > IOV_MAX; /* Needs several writev calls */
+        if (cork) set_cork(wio->rio_fd, 1);
+        err = riow_writev(wio, last->iov, last->iovcnt) < 0;
+        if (cork) set_cork(wio->rio_fd, 0);
+    } else if (!err) { /* One write for the whole batch */
+        if (last)
+            err = riow_queuev(wio, last->iov, last->iovcnt) < 0;
+        err = err || riow_flush(wio) < 0;
+    }
+    if (err) {
+        close_client(p, c);
+        return;
+    }
+    update_client(p, c);
+}
+
+/* 
+ * Match the client's select interest to its state: wait for writability
+ * while output is queued, pause reading above OUT_HIGHWAT, and close it
+ * once an exit (or EOF) has been fully answered.
+ */
+static void update_client(pool *p, conn_t *c) {
+    int connfd = c->fd;
+    size_t pending = riow_pending(&c->wio);
+
+    if (pending == 0 && c->closing) {
+        close_client(p, c);
+        return;
+    }
+    if (pending > 0)
+        FD_SET(connfd, &p->write_set);
+    else
+        FD_CLR(connfd, &p->write_set);
+    if (c->closing || pending >= OUT_HIGHWAT)
+        FD_CLR(connfd, &p->read_set);
+    else
+        FD_SET(connfd, &p->read_set);
+}
+
+/* Service ready client connections */
+static void check_clients(pool *p) {
+    int connfd;
+    conn_t *c;
+    for (connfd = 0; (connfd <= p->maxfd && p->nready > 0); connfd++) {
+        if ((c = p->conn[connfd]) == NULL)
+            continue;
+        if (FD_ISSET(connfd, &p->wready_set) || FD_ISSET(connfd, &p->ready_set))
+            touch_client(p, c);
+
+        /* Drain queued output; resume requests held back by OUT_HIGHWAT */
+        if (FD_ISSET(connfd, &p->wready_set)) {
+            p->nready--;
+            if (riow_flush(&c->wio) < 0) {
+                close_client(p, c);
+                continue;
             }
+            if (c->binary ? rioz_hasn(&c->rio, sizeof(stock_frame_t))
+                          : rioz_hasline(&c->rio))
+                serve_client(p, c);
+            else
+                update_client(p, c);
+            if (p->conn[connfd] == NULL)
+                continue;
+        }
+
+        /* If the descriptor is ready, serve its request lines */
+        if (FD_ISSET(connfd, &p->ready_set)) {
+            p->nready--;
+            serve_client(p, c);
+        }
+    }
+}
+
+/* 
+ * Garbage-collect idle clients. Both lists are ordered by last activity,
+ * so only expired clients are visited: after IDLE_TRIM seconds a client's
+ * buffers are released (it moves to the idle list), after IDLE_TIMEOUT
+ * seconds it is disconnected.
+ */
+static void sweep_clients(pool *p) {
+    conn_t *c;
+
+    while ((c = p->active.next) != &p->active && p->now - c->last >= IDLE_TRIM) {
+        rioz_trim(&c->rio);
+        riow_trim(&c->wio);
+        list_remove(c);
+        list_append(&p->idle, c);
+    }
+    while ((c = p->idle.next) != &p->idle && p->now - c->last >= IDLE_TIMEOUT) {
+        printf("Disconnecting idle client (fd %d)\n", c->fd);
+        close_client(p, c);
+    }
+}
 
+/* Take over the n connections of a reload's handoff */
+static void adopt_clients(pool *p, FILE *handoff, int n) {
+    char line[MAXLINE], *buf = NULL;
+    int fd, binary, windowed;
+    size_t len;
+    dedup_t dedup;
+
+    for (int i = 0; i < n; i++) {
+        windowed = 0;
+        if (!fgets(line, sizeof(line), handoff)
+            || sscanf(line, "client %d %d %zu %d", &fd, &binary, &len, &windowed) < 3)
+            app_error("reload: bad handoff");
+        buf = Realloc(buf, len + 1);
+        if (fread(buf, 1, len, handoff) != len
+            || (windowed && dedup_load(&dedup, handoff) < 0))
+            app_error("reload: bad handoff");
+        add_client(fd, p);
+        conn_t *c = p->conn[fd];
+        if (!c)
+            continue;
+        c->binary = binary;
+        if (windowed) { /* Its order IDs, as the last image saw them */
+            c->dedup = objpool_get(&dedup_pool);
+            *c->dedup = dedup;
+        }
+        if (rioz_unread(&c->rio, buf, len) < 0) /* The partial request */
+            close_client(p, c);
+    }
+    free(buf);
+    fclose(handoff);
+}
+
+/* 
+ * Drain before a stop or reload: stop accepting, answer every request
+ * already received and flush all replies (and the standbys' log), giving
+ * slow readers DRAIN_TIMEOUT seconds. Then close every connection - or
+ * on a reload, only those whose replies could not be flushed.
+ */
+static void drain_clients(pool *p, int listenfd, int reload) {
+    struct timeval tv;
+    struct timespec ts;
+    time_t deadline;
+    int fd, busy;
+
+    FD_CLR(listenfd, &p->read_set);
+    if (local_listenfd >= 0)
+        FD_CLR(local_listenfd, &p->read_set);
+    if (!reload)
+        Close(listenfd);
+    for (fd = 0; fd <= p->maxfd; fd++) /* What has arrived so far */
+        if (p->conn[fd])
+            serve_client(p, p->conn[fd]);
+    repl_flush(p);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    deadline = ts.tv_sec + DRAIN_TIMEOUT;
+    while (1) {
+        busy = repl_pending() > 0;
+        for (fd = 0; fd <= p->maxfd && !busy; fd++)
+            busy = p->conn[fd] && (riow_pending(&p->conn[fd]->wio) > 0
+                                   || (p->conn[fd]->shm && p->conn[fd]->shm->outlen > 0));
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        if (!busy || ts.tv_sec >= deadline)
             break;
+
+        FD_ZERO(&p->ready_set);
+        p->wready_set = p->write_set;
+        tv.tv_sec = 0;
+        tv.tv_usec = 100000;
+        if ((p->nready = select(p->maxfd + 1, NULL, &p->wready_set, NULL, &tv)) < 0) {
+            if (errno != EINTR)
+                unix_error("Select error");
+            continue;
         }
+        check_clients(p); /* Flush, then answer requests held back by OUT_HIGHWAT */
+        shm_poll(p);
+        repl_flush(p);
+    }
+
+    for (fd = 0; fd <= p->maxfd; fd++)
+        if (p->conn[fd] && (!reload || p->conn[fd]->shm
+                            || riow_pending(&p->conn[fd]->wio) > 0))
+            close_client(p, p->conn[fd]);
+}
+
+/* 
+ * Act on a stop or reload signal in the select loop. A reload hands the
+ * listening socket and every remaining connection, with its unread
+ * input and order ID window, to the new image; if the exec fails,
+ * serving simply resumes.
+ */
+static void stop_select(pool *p, int listenfd, int reload) {
+    int fd, n = 0;
+    char *buf;
+
+    reload_requested = 0;
+    if (reload && repl_active()) { /* A standby would take the reload for a failover */
+        fprintf(stderr, "reload: not supported with replication\n");
+        return;
+    }
+    printf("%s: draining %d clients\n", reload ? "reload" : "shutdown", clientcnt);
+    drain_clients(p, listenfd, reload);
+    if (!reload)
+        finish(NULL);
+
+    for (fd = 0; fd <= p->maxfd; fd++)
+        n += p->conn[fd] != NULL;
+    FILE *handoff = handoff_begin(listenfd, n);
+    for (fd = 0; fd <= p->maxfd; fd++) {
+        conn_t *c = p->conn[fd];
+        if (!c)
+            continue;
+        size_t len = rioz_buffered(&c->rio, &buf);
+        fprintf(handoff, "client %d %d %zu %d\n", fd, c->binary, len, c->dedup != NULL);
+        fwrite(buf, 1, len, handoff);
+        if (c->dedup) /* Resent orders stay answered, not executed twice */
+            dedup_save(c->dedup, handoff);
     }
-    if (i == FD_SETSIZE) /* Couldn't find an empty slot */
-        app_error("add_client error: Too many clients");
+    finish(handoff);
+    FD_SET(listenfd, &p->read_set); /* The exec failed: accept again */
+    if (local_listenfd >= 0)
+        FD_SET(local_listenfd, &p->read_set);
 }
 
-/* Check if all clients are close */
-static int all_closed(pool *p) {
-    for (int i = 0; i <= p->maxi; i++)
-        if (p->clientfd[i] >= 0) return 0; /* Not all close */
-    return 1; /* All clients are closed */
+/*-------------- Replication --------------*/
+/*
+ * A primary started with -R <port> accepts standbys on that port. Each
+ * one first gets a snapshot ("S <id> <left_stock> <price>" per stock,
+ * then "E") and then the order log: one "<b|s> <id> <amt>" line per
+ * executed buy/sell, in execution order. Replication is asynchronous:
+ * the log is written once per event-loop pass, after the replies.
+ *
+ * A standby started with -f <host>:<port> applies that stream and serves
+ * show, refusing buy/sell, until the stream ends; it then promotes
+ * itself and takes orders. A standby may itself run with -R.
+ */
+#define MAX_STANDBY  8
+#define REPL_HIGHWAT (16 << 20) /* Drop a standby that falls this far behind */
+
+static int repl_listenfd = -1;          /* -R: standbys connect here */
+static riow_t standby[MAX_STANDBY];     /* Log to each standby; rio_fd < 0 if unused */
+static int nstandby;
+static int primaryfd = -1;              /* -f: stream from our primary */
+static rioz_t primary_rio;
+
+/* Open the replication port (-R) */
+static void repl_listen(char *port) {
+    repl_listenfd = Open_listenfd(port);
+    Fcntl(repl_listenfd, F_SETFL, Fcntl(repl_listenfd, F_GETFL, 0) | O_NONBLOCK);
 }
 
-/* Close a client connection and removes it from the pool */
-static void close_client(pool *p, int i) {
-    Close(p->clientfd[i]);
-    FD_CLR(p->clientfd[i], &p->read_set);
-    p->clientfd[i] = -1;
+/* Connect to our primary (-f host:port) and start as a standby */
+static void repl_follow(char *hostport) {
+    char host[MAXLINE], *colon = strrchr(hostport, ':');
+
+    if (!colon || colon == hostport || colon - hostport >= MAXLINE)
+        app_error("-f wants <primary host>:<replication port>");
+    memcpy(host, hostport, colon - hostport);
+    host[colon - hostport] = '\0';
+    primaryfd = Open_clientfd(host, colon + 1);
+    Fcntl(primaryfd, F_SETFL, Fcntl(primaryfd, F_GETFL, 0) | O_NONBLOCK);
+    Rioz_readinitb(&primary_rio, primaryfd);
+    is_standby = 1;
+    printf("standby of %s\n", hostport);
+}
+
+/* Add the replication descriptors to the pool's read set; no standby yet */
+static void repl_watch(pool *p) {
+    int fds[2] = { repl_listenfd, primaryfd };
+
+    for (int i = 0; i < MAX_STANDBY; i++)
+        standby[i].rio_fd = -1;
+    for (int i = 0; i < 2; i++) {
+        if (fds[i] < 0)
+            continue;
+        FD_SET(fds[i], &p->read_set);
+        if (fds[i] > p->maxfd)
+            p->maxfd = fds[i];
+    }
+}
+
+/* Stop streaming to standby i */
+static void repl_drop(pool *p, int i) {
+    printf("standby (fd %d) dropped\n", standby[i].rio_fd);
+    FD_CLR(standby[i].rio_fd, &p->write_set);
+    Close(standby[i].rio_fd);
+    riow_free(&standby[i]);
+    standby[i].rio_fd = -1;
+    nstandby--;
+}
+
+/* A standby connected: queue the snapshot, the log follows */
+static void repl_accept(pool *p) {
+    struct iovec iov[2];
+    int i, fd = accept(repl_listenfd, NULL, NULL);
+
+    if (fd < 0)
+        return;
+    for (i = 0; i < MAX_STANDBY && standby[i].rio_fd >= 0; i++)
+        ;
+    if (i == MAX_STANDBY || fd >= FD_SETSIZE) {
+        fprintf(stderr, "repl_accept: too many standbys\n");
+        Close(fd);
+        return;
+    }
+    Fcntl(fd, F_SETFL, Fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    riow_init(&standby[i], fd);
+    nstandby++;
+    if (fd > p->maxfd)
+        p->maxfd = fd;
+
+    iov[0].iov_base = "S ";
+    iov[0].iov_len = 2;
+    for (int k = 0; k < db.cnt; k++) { /* Rows are "<id> <left_stock> <price>\n" */
+        iov[1].iov_base = db.nodes[k]->row;
+        iov[1].iov_len = db.nodes[k]->rowlen;
+        riow_queuev(&standby[i], iov, 2);
+    }
+    iov[0].iov_base = "E\n";
+    riow_queuev(&standby[i], iov, 1);
+    printf("standby (fd %d) connected, snapshot of %d stocks\n", fd, db.cnt);
+}
+
+/* Append an executed order to every standby's log */
+static void repl_log(char req, int id, int amt) {
+    char line[64];
+    struct iovec iov;
+
+    if (nstandby == 0)
+        return;
+    iov.iov_base = line;
+    iov.iov_len = snprintf(line, sizeof(line), "%c %d %d\n", req, id, amt);
+    for (int i = 0; i < MAX_STANDBY; i++)
+        if (standby[i].rio_fd >= 0)
+            riow_queuev(&standby[i], &iov, 1);
+}
+
+/* Apply everything the primary has sent; promote once it is gone */
+static void repl_apply(pool *p) {
+    char *line, op;
+    int n, id, stock, price;
+
+    while ((n = rioz_getline(&primary_rio, &line)) > 0) {
+        if (sscanf(line, "%c %d %d %d", &op, &id, &stock, &price) < 1)
+            continue;
+        if (op == 'S')
+            apply_stock(id, stock, price);
+        else if (op == 'E')
+            printf("standby: snapshot of %d stocks loaded\n", db.cnt);
+        else if (op == 'b' || op == 's')
+            change_stock(id, op, stock); /* Third field is the amount */
+    }
+    if (n == RIO_AGAIN)
+        return;
+
+    printf("primary lost: promoting this standby to primary\n");
+    FD_CLR(primaryfd, &p->read_set);
+    Close(primaryfd);
+    rioz_free(&primary_rio);
+    primaryfd = -1;
+    is_standby = 0;
+}
 
+/* Handle readiness of the replication descriptors */
+static void repl_poll(pool *p) {
+    if (repl_listenfd >= 0 && FD_ISSET(repl_listenfd, &p->ready_set)) {
+        p->nready--;
+        repl_accept(p);
+    }
+    if (primaryfd >= 0 && FD_ISSET(primaryfd, &p->ready_set)) {
+        p->nready--;
+        repl_apply(p);
+    }
+    for (int i = 0; i < MAX_STANDBY; i++)
+        if (standby[i].rio_fd >= 0 && FD_ISSET(standby[i].rio_fd, &p->wready_set))
+            p->nready--; /* Flushed by repl_flush */
+}
+
+/* Write the standbys' logs; wait for writability while they lag */
+static void repl_flush(pool *p) {
+    for (int i = 0; i < MAX_STANDBY; i++) {
+        riow_t *w = &standby[i];
+        if (w->rio_fd < 0)
+            continue;
+        if (riow_flush(w) < 0 || riow_pending(w) > REPL_HIGHWAT) {
+            repl_drop(p, i);
+            continue;
+        }
+        if (riow_pending(w))
+            FD_SET(w->rio_fd, &p->write_set);
+        else
+            FD_CLR(w->rio_fd, &p->write_set);
+    }
+}
+
+/* Is this server a primary with -R or a standby with -f? */
+static int repl_active(void) {
+    return repl_listenfd >= 0 || primaryfd >= 0;
+}
+
+/* Bytes of order log not yet written to the standbys */
+static size_t repl_pending(void) {
+    size_t n = 0;
+    for (int i = 0; i < MAX_STANDBY; i++)
+        if (standby[i].rio_fd >= 0)
+            n += riow_pending(&standby[i]);
+    return n;
+}
+
+/*-------------- Local transports --------------*/
+/*
+ * With -u <path> the server also listens on a Unix-domain socket; the
+ * protocol is the same as over TCP. A client on that socket may switch
+ * to a shared-memory channel (see shmring.h) by sending SHM_HELLO; the
+ * io_uring backend does not serve channels and answers it as an
+ * unknown command.
+ *
+ * Channels are served by the select loop. After a request arrives on
+ * any ring, the loop polls the rings for SHM_SPIN_US without sleeping,
+ * and while they have requests it serves them without calling select
+ * (at most SHM_BURST passes in a row, so sockets still get their turn).
+ * Then it sets every request ring's sleeping flag and blocks in select;
+ * a client that finds the flag set rings the doorbell (one byte on its
+ * socket). Replies that do not fit in a full reply ring wait in the
+ * channel and are retried every SHM_RETRY_US.
+ */
+#define SHM_BURST     64
+#define SHM_RETRY_US  1000
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Accept a connection on the Unix-domain socket, if one is pending */
+static void local_accept(pool *p) {
+    if (local_listenfd < 0 || !FD_ISSET(local_listenfd, &p->ready_set))
+        return;
+    int connfd = Accept(local_listenfd, NULL, NULL);
+    printf("Connected to (%s)\n", local_path);
+    add_client(connfd, p);
+}
+
+/* 
+ * Answer SHM_HELLO: send "[shm] ok" with a new channel's memfd and
+ * return REQ_SHM, or fill in r with a refusal (not a Unix-domain socket,
+ * replies still queued, no memory) and return REQ_REPLY.
+ */
+static int shm_begin(pool *p, conn_t *c, reply_t *r) {
+    static const char ok[] = "[shm] ok\n" END_OF_REPLY;
+    static const char no[] = "[shm] unavailable\n" END_OF_REPLY;
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    shm_chan_t *ch = NULL;
+    int fd;
+
+    if (getsockname(c->fd, (SA *)&addr, &len) == 0 && addr.ss_family == AF_UNIX
+        && riow_flush(&c->wio) >= 0 && riow_pending(&c->wio) == 0)
+        ch = shm_create(&fd);
+    if (!ch) {
+        r->one.iov_base = (char *)no;
+        r->one.iov_len = strlen(no);
+        r->iov = &r->one;
+        r->iovcnt = 1;
+        return REQ_REPLY;
+    }
+    if (send_fd(c->fd, ok, strlen(ok), fd) < 0) {
+        Close(fd);
+        shm_detach(ch);
+        close_client(p, c);
+        return REQ_SHM;
+    }
+    Close(fd); /* The mapping keeps the memory */
+
+    shmconn_t *s = Calloc(1, sizeof(shmconn_t));
+    s->ch = ch;
+    s->slot = p->nshm;
+    p->shm[p->nshm++] = c;
+    c->shm = s;
+    rioz_trim(&c->rio);
+    riow_trim(&c->wio);
+    FD_CLR(c->fd, &p->write_set);
+    return REQ_SHM;
+}
+
+/* Tear down c's channel (close_client) */
+static void shm_end(pool *p, conn_t *c) {
+    shmconn_t *s = c->shm;
+
+    p->shm[s->slot] = p->shm[--p->nshm];
+    p->shm[s->slot]->shm->slot = s->slot;
+    shm_detach(s->ch);
+    free(s->in);
+    free(s->out);
+    Free(s);
+    c->shm = NULL;
+}
+
+/* Copy replies into the reply ring; what does not fit waits in s->out */
+static void shm_append(shmconn_t *s, const void *buf, size_t n) {
+    size_t k = s->outlen == 0 ? shm_write(&s->ch->resp, buf, n) : 0;
+
+    if (k == n)
+        return;
+    if (s->outlen + n - k > s->outcap) {
+        s->outcap = 2 * s->outcap > s->outlen + n - k ? 2 * s->outcap : s->outlen + n - k;
+        s->out = Realloc(s->out, s->outcap);
+    }
+    memcpy(s->out + s->outlen, (const char *)buf + k, n - k);
+    s->outlen += n - k;
+}
+
+/* 
+ * Serve the requests on c's ring, like serve_client does for a socket.
+ * Each reply is copied into the ring at once, before the next request
+ * can change the rows it points at. Input stays on the ring while
+ * replies are waiting for space. A client whose rings are corrupt is
+ * closed. Returns 1 if there was anything to do.
+ */
+static int shm_serve(pool *p, conn_t *c) {
+    shmconn_t *s = c->shm;
+    char line[MAXLINE];
+    reply_t r;
+    size_t n, off = 0;
+    int rc, busy = 0;
+
+    if (shm_corrupt(&s->ch->req) || shm_corrupt(&s->ch->resp)) {
+        fprintf(stderr, "shm: client %d corrupted its channel, closing it\n", c->fd);
+        close_client(p, c);
+        return 0;
+    }
+    if (s->outlen > 0) { /* Replies from an earlier pass first */
+        n = shm_write(&s->ch->resp, s->out, s->outlen);
+        memmove(s->out, s->out + n, s->outlen - n);
+        s->outlen -= n;
+        busy = n > 0;
+    }
+    if (s->outlen == 0 && !c->closing && (n = shm_readable(&s->ch->req)) > 0) {
+        if (s->inlen + n > s->incap) {
+            s->incap = 2 * s->incap > s->inlen + n ? 2 * s->incap : s->inlen + n;
+            s->in = Realloc(s->in, s->incap);
+        }
+        s->inlen += shm_read(&s->ch->req, s->in + s->inlen, n);
+        busy = 1;
+    }
+
+    while (!c->closing && s->outlen == 0
+           && (n = request_len(s->in + off, s->inlen - off, c->binary)) > 0) {
+        printf("server received %d bytes\n", (int)n);
+        if (c->binary) {
+            rc = handle_frame(s->in + off, n, &r);
+        } else {
+            memcpy(line, s->in + off, n);
+            line[n] = '\0';
+            rc = handle_request(line, &r, &c->dedup);
+        }
+        off += n;
+        if (rc == REQ_EXIT) {
+            c->closing = 1;
+            break;
+        }
+        if (rc == REQ_BINARY)
+            c->binary = 1;
+        for (int i = 0; i < r.iovcnt; i++)
+            shm_append(s, r.iov[i].iov_base, r.iov[i].iov_len);
+    }
+    memmove(s->in, s->in + off, s->inlen - off);
+    s->inlen -= off;
+
+    if (busy)
+        touch_client(p, c);
+    if (shm_need_wake(&s->ch->resp))
+        write(c->fd, "", 1); /* Full socket buffer: the client is awake anyway */
+    if (c->closing && s->outlen == 0)
+        close_client(p, c);
+    return busy;
+}
+
+/* Serve every channel once */
+static void shm_poll(pool *p) {
+    for (int i = p->nshm - 1; i >= 0; i--) /* close_client moves the last one here */
+        if (shm_serve(p, p->shm[i]))
+            p->shm_last = now_us();
+}
+
+/* 
+ * Before select: returns 1 if a request ring is readable and the pass
+ * should skip select, polling the rings for up to SHM_SPIN_US since the
+ * last request. Otherwise lowers *tv as needed and, if select may block,
+ * arms the doorbells.
+ */
+static int shm_spin(pool *p, struct timeval *tv) {
+    int i, spins = 0;
+
+    if (p->nshm == 0)
+        return 0;
+    while (p->shm_burst < SHM_BURST) {
+        for (i = 0; i < p->nshm; i++)
+            if (shm_readable(&p->shm[i]->shm->ch->req) > 0) {
+                p->shm_burst++;
+                return 1;
+            }
+        if (now_us() - p->shm_last >= SHM_SPIN_US || stop_requested || reload_requested)
+            break;
+        if (++spins % 64 == 0)
+            sched_yield(); /* Let a client on the same core run */
+    }
+    p->shm_burst = 0;
+
+    for (i = 0; i < p->nshm; i++) {
+        if (p->shm[i]->shm->outlen > 0) {
+            tv->tv_sec = 0;
+            tv->tv_usec = SHM_RETRY_US;
+        }
+    }
+    if (now_us() - p->shm_last < SHM_SPIN_US) { /* Burst over: just peek at the sockets */
+        tv->tv_sec = tv->tv_usec = 0;
+        return 0;
+    }
+    for (i = 0; i < p->nshm; i++) {
+        if (!shm_sleep(&p->shm[i]->shm->ch->req)) { /* A request slipped in */
+            tv->tv_sec = tv->tv_usec = 0;
+            p->shm_last = now_us();
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* After select: the loop is polling the rings again */
+static void shm_awake(pool *p) {
+    for (int i = 0; i < p->nshm; i++)
+        shm_wake(&p->shm[i]->shm->ch->req);
+}
+
+/*-------------- Request handling --------------*/
+/* A client connected (any backend) */
+static void client_opened(void) {
+    clientcnt++;
+    if (clientcnt == 1 && first_connect.tv_sec == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &first_connect);
+    }
+}
+
+/* A client disconnected (any backend): dump the stocks once all are gone */
+static void client_closed(void) {
     clock_gettime(CLOCK_MONOTONIC, &last_disconnect);
     clientcnt--;
 
@@ -313,73 +1440,592 @@ static void close_client(pool *p, int i) {
             double elapsed = (last_disconnect.tv_sec - first_connect.tv_sec) + (last_disconnect.tv_nsec - first_connect.tv_nsec) / 1e9;
             printf(">> elapsed time: %.6f\n", elapsed);
         }
+        dump_stock("stock.txt"); /* All clients are closed */
     }
+}
+
+/* 
+ * Execute a buy/sell at most once per order ID (oid 0: no ID) on this
+ * connection. Returns change_stock's result, or -2 if oid is too old to
+ * check; *dup tells whether it was a resend answered from the window.
+ */
+static int order_once(dedup_t **dedup, unsigned long oid, int id, char req, int amt, int *dup) {
+    int rc;
 
-    if (all_closed(p)) /* All clients are closed */
-        dump_stock("stock.txt");
+    *dup = 0;
+    if (oid == 0)
+        return change_stock(id, req, amt);
+    if (!*dedup) { /* First order ID on this connection */
+        *dedup = objpool_get(&dedup_pool);
+        dedup_init(*dedup);
+    }
+    switch (dedup_check(*dedup, oid, &rc)) {
+    case DEDUP_STALE:
+        return -2;
+    case DEDUP_DUP:
+        *dup = 1;
+        return rc;
+    }
+    rc = change_stock(id, req, amt);
+    dedup_record(*dedup, oid, rc);
+    return rc;
 }
 
-/* Handle a clients' request */
-static void handle_request(pool *p, int connfd, char *buf, int idx) {
+/* 
+ * Handle a client's request line. The reply only references static
+ * strings, the db's pre-rendered rows or r's own storage, so the caller
+ * decides how and when to send it.
+ *
+ * show takes an ID or ID range ("show 3", "show 2-5"), and "top 5 price"
+ * or "top 5 volume" lists the five highest stocks by that key. buy and
+ * sell take an optional order ID ("buy 3 10 42"); its reply carries the
+ * ID ("[buy] success #42"), and a resent ID is answered again, marked
+ * "(duplicate)", without executing twice.
+ */
+static int handle_request(char *buf, reply_t *r, dedup_t **dedup) {
     char cmd[16];
-    int id, amt;
+    int id, amt, dup;
+    unsigned long oid = 0;
+    const char *msg;
+    int ret = REQ_REPLY;
     buf[strcspn(buf, "\n")] = '\0';
-    char response[MAXLINE]; /* server's response to client */
-    memset(response, '\0', sizeof(char) * MAXLINE);
-    int nargs = sscanf(buf, "%15s %d %d", cmd, &id, &amt);
-
-    if (nargs >= 1 && strcmp(cmd, "show") == 0) {
-        size_t n = list_stock();
-        Rio_writen(connfd, db.buf, MAXLINE);
-    } else if (nargs == 3 && strcmp(cmd, "buy") == 0) {
-        int r = change_stock(id, 'b', amt);
-
-        if (r == 0) {
-            sprintf(response, "[buy] success\n");
-        } else if (r == 1) {
-            sprintf(response, "Not enough stock\n");
-        } else if (r == -1) {
-            sprintf(response, "Invalid ID\n");
+    int nargs = sscanf(buf, "%15s %d %d %lu", cmd, &id, &amt, &oid);
+
+    if (nargs >= 1 && (strcmp(cmd, "show") == 0 || strcmp(cmd, "top") == 0)) {
+        char *args = strstr(buf, cmd) + strlen(cmd);
+        unsigned lo, hi;
+        int cnt = -2;
+
+        if (cmd[0] == 's' && parse_show(args, &lo, &hi) == 0)
+            cnt = lo || hi ? list_range(lo, hi, NULL) : list_stock(NULL);
+        else if (cmd[0] == 't' && parse_top(args, &lo, &hi) == 0)
+            cnt = list_top(lo, hi, NULL);
+        if (cnt > 0) {
+            r->iov = db.iov;
+            r->iovcnt = cnt;
+            return REQ_REPLY;
         }
+        msg = cnt == -1 ? "Invalid ID\n" END_OF_REPLY : "Unknow command\n" END_OF_REPLY;
+    } else if (nargs >= 3 && is_standby && (strcmp(cmd, "buy") == 0 || strcmp(cmd, "sell") == 0)) {
+        msg = "Read-only standby\n" END_OF_REPLY;
+    } else if (nargs >= 3 && (strcmp(cmd, "buy") == 0 || strcmp(cmd, "sell") == 0)) {
+        int rc = order_once(dedup, oid, id, cmd[0], amt, &dup);
 
-        Rio_writen(connfd, response, MAXLINE);
-    } else if (nargs == 3 && strcmp(cmd, "sell") == 0) {
-        int r = change_stock(id, 's', amt);
-        
-        if (r == 0) {
-            sprintf(response, "[sell] success\n");
+        if (rc == 0) {
+            msg = cmd[0] == 'b' ? "[buy] success\n" END_OF_REPLY : "[sell] success\n" END_OF_REPLY;
+        } else if (rc == 1) {
+            msg = "Not enough stock\n" END_OF_REPLY;
+        } else if (rc == -2) {
+            msg = "Order ID too old\n" END_OF_REPLY;
         } else {
-            sprintf(response, "Invalid ID\n");
+            msg = "Invalid ID\n" END_OF_REPLY;
+        }
+        if (oid) { /* Echo the order ID: "<msg> #<oid>[ (duplicate)]" */
+            int len = snprintf(r->text, sizeof(r->text), "%.*s #%lu%s\n" END_OF_REPLY,
+                               (int)(strlen(msg) - 2), msg, oid, dup ? " (duplicate)" : "");
+            r->one.iov_base = r->text;
+            r->one.iov_len = len;
+            r->iov = &r->one;
+            r->iovcnt = 1;
+            return REQ_REPLY;
         }
-        
-        Rio_writen(connfd, response, MAXLINE);
     } else if (nargs >= 1 && strcmp(cmd, "exit") == 0) {
-        close_client(p, idx);
+        return REQ_EXIT;
+    } else if (strcmp(buf, "binary") == 0) { /* BIN_HELLO, '\n' already cut */
+        ret = REQ_BINARY;
+        msg = "[binary] ok\n" END_OF_REPLY;
     } else {
-        sprintf(response, "Unknow command\n");
-        Rio_writen(connfd, response, MAXLINE);
+        msg = "Unknow command\n" END_OF_REPLY;
     }
+
+    r->one.iov_base = (char *)msg;
+    r->one.iov_len = strlen(msg);
+    r->iov = &r->one;
+    r->iovcnt = 1;
+    return ret;
 }
 
-/* Service ready client connections */
-static void check_clients(pool *p) {
-    int i, connfd, n;
-    char buf[MAXLINE];
-    rio_t rio;
-    for (i = 0; (i <= p->maxi && p->nready > 0); i++) {
-        connfd = p->clientfd[i];
-        rio = p->clientrio[i];
-
-        /* If the descriptor is ready, echo a text line from it */
-        if ((connfd > 0) && FD_ISSET(connfd, &p->ready_set)) {
-            p->nready--;
-            n = Rio_readlineb(&rio, buf, MAXLINE);
-            if (n > 0) { /* Read a line from the client */
-                printf("server received %d bytes\n", n);
-                handle_request(p, connfd, buf, i);
-            } else { /* EOF detached */
-                close_client(p, i);
+/* 
+ * Handle one request frame of a binary client (see stockproto.h). Like
+ * handle_request, the reply only references the db or r's own storage.
+ */
+static int handle_frame(const char *buf, size_t n, reply_t *r) {
+    stock_frame_t req, *res = &r->frame;
+    unsigned lo, hi;
+    int rc;
+
+    memset(&req, 0, sizeof(req));
+    memcpy(&req, buf, n); /* n < sizeof(req) only if EOF cut the frame */
+    *res = req;
+    res->pad = 0;
+    switch (req.op) {
+    case BIN_SHOW:
+    case BIN_TOP:
+        res->status = BIN_OK; /* Closes the listing */
+        lo = ntohl(req.id);
+        hi = ntohl(req.qty);
+        if (req.op == BIN_TOP)
+            rc = lo && hi <= TOP_VOLUME ? list_top(lo, hi, res) : -2;
+        else
+            rc = lo || hi ? list_range(lo, hi, res) : list_stock(res);
+        if (rc > 0) {
+            r->iov = db.iov;
+            r->iovcnt = rc;
+            return REQ_REPLY;
+        }
+        res->status = rc == -1 ? BIN_BADID : BIN_BADOP;
+        break;
+    case BIN_BUY:
+    case BIN_SELL:
+        if (is_standby) {
+            res->status = BIN_READONLY;
+            break;
+        }
+        rc = change_stock(ntohl(req.id), req.op == BIN_BUY ? 'b' : 's',
+                          ntohl(req.qty));
+        res->status = rc == 0 ? BIN_OK : rc == 1 ? BIN_NOSTOCK : BIN_BADID;
+        break;
+    case BIN_EXIT:
+        return REQ_EXIT;
+    default:
+        res->status = BIN_BADOP;
+    }
+
+    r->one.iov_base = res;
+    r->one.iov_len = sizeof(*res);
+    r->iov = &r->one;
+    r->iovcnt = 1;
+    return REQ_REPLY;
+}
+
+/* 
+ * Length of the first complete request (line or frame) of the len bytes
+ * at buf, or 0 if it is still partial. Backends that buffer their own
+ * input use it; an overlong line is split like rio_readlineb.
+ */
+static size_t request_len(const char *buf, size_t len, int binary) {
+    if (binary)
+        return len >= sizeof(stock_frame_t) ? sizeof(stock_frame_t) : 0;
+    char *nl = memchr(buf, '\n', len);
+    size_t n = nl ? (size_t)(nl - buf) + 1 : len;
+    if (!nl && n < MAXLINE - 1)
+        return 0;
+    return n > MAXLINE - 1 ? MAXLINE - 1 : n;
+}
+
+#ifdef USE_URING
+/*-------------- io_uring backend --------------*/
+/*
+ * One multishot accept feeds one multishot recv per connection, whose
+ * data lands in a shared provided-buffer ring. Replies are appended to a
+ * per-connection output buffer and sent with at most one send in flight;
+ * "exit" links a shutdown behind the final send so the client still gets
+ * every reply. Needs Linux 6.0+; otherwise main() falls back to select.
+ */
+#include "uring.h"
+
+#define URING_ENTRIES 256
+#define URING_BGID    0
+#define URING_NBUFS   256   /* Provided recv buffers (power of two) */
+#define URING_BUFSZ   4096
+
+#define MAX(x, y)   ((x) > (y) ? (x) : (y))
+
+/* user_data of an SQE: descriptor in the upper bits, operation in the low byte */
+enum { UOP_ACCEPT, UOP_RECV, UOP_SEND, UOP_SHUTDOWN, UOP_CANCEL, UOP_TIMEOUT };
+#define UD(op, fd)  (((__u64)(fd) << 8) | (op))
+#define UD_OP(ud)   ((int)((ud) & 0xff))
+#define UD_FD(ud)   ((int)((ud) >> 8))
+
+/* Per-connection state of the io_uring backend */
+typedef struct {
+    int fd;
+    char *in;               /* Received bytes not yet parsed into lines */
+    size_t inlen, incap;
+    char *out;              /* Replies not yet acknowledged by a send */
+    size_t outlen, outcap;
+    size_t sending;         /* Leading bytes of out owned by the in-flight send */
+    char *sent_from;        /* Old out the in-flight send still reads, if out grew */
+    int recv_armed;         /* Multishot recv still outstanding */
+    int shutdowns;          /* Shutdowns in flight */
+    int shut;               /* A shutdown has succeeded */
+    int closing;            /* exit, EOF or error: stop parsing requests */
+    int binary;             /* Speaks stockproto.h frames instead of lines */
+    dedup_t *dedup;         /* Order ID window, taken once the client uses IDs */
+} uconn_t;
+
+static uring_t ring;
+static uring_bufring_t bufring;
+static uconn_t **uconns;    /* Indexed by descriptor */
+static objpool_t uconn_pool; /* Every uconn_t */
+static int uconn_cap;
+static int uring_stopping;  /* Draining: accept is cancelled, not re-armed */
+static int uring_expired;   /* The drain's timeout fired */
+
+/* Get an SQE, flushing the submission queue first if it is full */
+static struct io_uring_sqe *uring_sqe(void) {
+    struct io_uring_sqe *sqe;
+    while ((sqe = uring_get_sqe(&ring)) == NULL)
+        uring_submit_and_wait(&ring, 0);
+    return sqe;
+}
+
+static void uring_arm_accept(int listenfd) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UD(UOP_ACCEPT, listenfd);
+}
+
+static void uring_arm_recv(uconn_t *c) {
+    struct io_uring_sqe *sqe = uring_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD(UOP_RECV, c->fd);
+    c->recv_armed = 1;
+}
+
+/* 
+ * Start sending the pending output if no send is in flight. Once the
+ * connection is closing, a shutdown is linked behind the last send.
+ */
+static void uring_flush(uconn_t *c) {
+    struct io_uring_sqe *sqe;
+    if (c->sending)
+        return;
+    if (c->outlen > 0) {
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        sqe->addr = (unsigned long)c->out;
+        sqe->len = c->outlen;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = UD(UOP_SEND, c->fd);
+        c->sending = c->outlen;
+        if (!c->closing)
+            return;
+        /* Only a failed send breaks the link: MSG_WAITALL makes a short
+           one retry instead of letting the shutdown cut off the rest */
+        sqe->msg_flags |= MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+    } else if (!c->closing || c->shut || c->shutdowns) {
+        return;
+    }
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_SHUTDOWN;
+    sqe->fd = c->fd;
+    sqe->len = SHUT_RDWR;   /* Ends the multishot recv with EOF */
+    sqe->user_data = UD(UOP_SHUTDOWN, c->fd);
+    c->shutdowns++;
+}
+
+/* 
+ * Append a reply to the connection's output buffer. While a send is in
+ * flight, growing the buffer must not free the one the kernel reads:
+ * it is kept in sent_from until the send completes.
+ */
+static void uconn_append(uconn_t *c, reply_t *r) {
+    for (int i = 0; i < r->iovcnt; i++) {
+        size_t len = r->iov[i].iov_len;
+        if (c->outlen + len > c->outcap) {
+            c->outcap = MAX(2 * c->outcap, c->outlen + len);
+            if (c->sending) {
+                char *out = Malloc(c->outcap);
+                memcpy(out, c->out, c->outlen);
+                if (c->sent_from)
+                    free(c->out);   /* An earlier copy: nothing reads it */
+                else
+                    c->sent_from = c->out;
+                c->out = out;
+            } else {
+                c->out = Realloc(c->out, c->outcap);
+            }
+        }
+        memcpy(c->out + c->outlen, r->iov[i].iov_base, len);
+        c->outlen += len;
+    }
+}
+
+/* Release the connection once no in-flight operation refers to it */
+static void uconn_release(uconn_t *c) {
+    if (!c->closing || c->recv_armed || c->sending || c->shutdowns)
+        return;
+    uconns[c->fd] = NULL;
+    Close(c->fd);
+    free(c->in);
+    free(c->out);
+    if (c->dedup)
+        objpool_put(&dedup_pool, c->dedup);
+    objpool_put(&uconn_pool, c);
+    client_closed();
+}
+
+/* Serve every complete request line (or frame) buffered in c->in */
+static void uconn_serve(uconn_t *c) {
+    char line[MAXLINE];
+    reply_t r;
+    size_t n, off = 0;
+    int rc;
+
+    while (!c->closing && (n = request_len(c->in + off, c->inlen - off, c->binary)) > 0) {
+        char *start = c->in + off;
+        if (c->binary) {
+            off += n;
+            printf("server received %d bytes\n", (int)n);
+            if (handle_frame(start, n, &r) == REQ_EXIT)
+                c->closing = 1;
+            else
+                uconn_append(c, &r);
+            continue;
+        }
+        memcpy(line, start, n);
+        line[n] = '\0';
+        off += n;
+
+        printf("server received %d bytes\n", (int)n);
+        if ((rc = handle_request(line, &r, &c->dedup)) == REQ_EXIT) {
+            c->closing = 1;
+        } else {
+            c->binary = rc == REQ_BINARY;
+            uconn_append(c, &r);
+        }
+    }
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+    uring_flush(c);
+}
+
+static void uring_on_accept(int listenfd, int res, unsigned flags) {
+    if (!(flags & IORING_CQE_F_MORE) && !uring_stopping)
+        uring_arm_accept(listenfd); /* Multishot accept was terminated */
+    if (res == -ECANCELED)
+        return;
+    if (res < 0) {
+        fprintf(stderr, "accept error: %s\n", strerror(-res));
+        return;
+    }
+
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen = sizeof(clientaddr);
+    char client_host[MAXLINE], client_port[MAXLINE];
+    if (listenfd == local_listenfd) {
+        printf("Connected to (%s)\n", local_path);
+    } else if (getpeername(res, (SA *)&clientaddr, &clientlen) == 0) {
+        Getnameinfo((SA*)&clientaddr, clientlen,
+                    client_host, sizeof(client_host),
+                    client_port, sizeof(client_port), 0);
+        printf("Connected to (%s, %s)\n", client_host, client_port);
+    }
+
+    if (res >= uconn_cap) {
+        int old = uconn_cap;
+        uconn_cap = MAX(2 * uconn_cap, res + 1);
+        uconns = Realloc(uconns, uconn_cap * sizeof(uconn_t *));
+        memset(uconns + old, 0, (uconn_cap - old) * sizeof(uconn_t *));
+    }
+    setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)); /* Not on AF_UNIX */
+    uconn_t *c = objpool_get(&uconn_pool);
+    memset(c, 0, sizeof(*c));
+    c->fd = res;
+    uconns[res] = c;
+    client_opened();
+    uring_arm_recv(c);
+}
+
+static void uring_on_recv(uconn_t *c, int res, unsigned flags) {
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (res > 0 && !c->closing) {
+            if (c->inlen + res > c->incap) {
+                c->incap = MAX(2 * c->incap, c->inlen + res);
+                c->in = Realloc(c->in, c->incap);
             }
+            memcpy(c->in + c->inlen, uring_bufring_buf(&bufring, bid), res);
+            c->inlen += res;
+        }
+        uring_bufring_recycle(&bufring, bid);
+    }
+
+    if (res > 0 && !c->closing)
+        uconn_serve(c);
+
+    if (!(flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        if (res == -ENOBUFS && !c->closing) {
+            uring_arm_recv(c); /* Buffers ran out: re-arm */
+        } else if (res > 0 && !c->closing) {
+            uring_arm_recv(c);
+        } else if (!c->closing) { /* EOF or error */
+            c->closing = 1;
+            uring_flush(c); /* A half-closed client still reads: send, then shut down */
+        }
+        uconn_release(c);
+    }
+}
+
+static void uring_on_send(uconn_t *c, int res) {
+    size_t sent = res > 0 ? (size_t)res : 0;
+    if (res < 0) { /* Peer is gone: drop the rest, make recv see EOF */
+        sent = c->outlen;
+        if (!c->closing) {
+            c->closing = 1;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+    }
+    memmove(c->out, c->out + sent, c->outlen - sent);
+    c->outlen -= sent;
+    c->sending = 0;
+    free(c->sent_from);
+    c->sent_from = NULL;
+    uring_flush(c); /* Short send or replies queued meanwhile */
+    uconn_release(c);
+}
+
+static void uring_on_shutdown(uconn_t *c, int res) {
+    c->shutdowns--;
+    if (res != -ECANCELED) /* Done, or failed because the peer is gone */
+        c->shut = 1;
+    uring_flush(c); /* Re-queue if it was cancelled and nothing else will */
+    uconn_release(c);
+}
+
+/* Dispatch every completion that has arrived */
+static void uring_reap(void) {
+    struct io_uring_cqe *cqe;
+
+    while ((cqe = uring_peek_cqe(&ring)) != NULL) {
+        __u64 ud = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        uring_cqe_seen(&ring);
+
+        uconn_t *c = UD_FD(ud) < uconn_cap ? uconns[UD_FD(ud)] : NULL;
+        switch (UD_OP(ud)) {
+        case UOP_ACCEPT: /* TCP or Unix-domain listener */
+            uring_on_accept(UD_FD(ud), res, flags);
+            break;
+        case UOP_RECV:
+            if (c) uring_on_recv(c, res, flags);
+            break;
+        case UOP_SEND:
+            if (c) uring_on_send(c, res);
+            break;
+        case UOP_SHUTDOWN:
+            if (c) uring_on_shutdown(c, res);
+            break;
+        case UOP_TIMEOUT:
+            uring_expired = res == -ETIME;
+            break;
+        }
+    }
+}
+
+/* 
+ * Act on a stop or reload signal: cancel the accept, let every client
+ * send its queued replies and shut down (input arriving meanwhile is
+ * dropped), and wait for them at most DRAIN_TIMEOUT seconds. Unlike the
+ * select backend, a reload here still drops its clients: it passes on
+ * only the listening socket, so they reconnect to the new image, whose
+ * accept queue never went away. Clients that outlive the drain are
+ * closed by the exec, as is the ring. If the exec fails, accepting
+ * resumes.
+ */
+static void uring_stop(int listenfd, int reload) {
+    struct __kernel_timespec ts = { .tv_sec = DRAIN_TIMEOUT };
+    struct io_uring_sqe *sqe;
+
+    reload_requested = 0;
+    printf("%s: draining %d clients\n", reload ? "reload" : "shutdown", clientcnt);
+    uring_stopping = 1;
+    uring_expired = 0;
+    for (int i = 0; i < 2; i++) {
+        int fd = i == 0 ? listenfd : local_listenfd;
+        if (fd < 0)
+            continue;
+        sqe = uring_sqe();
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UD(UOP_ACCEPT, fd);
+        sqe->user_data = UD(UOP_CANCEL, fd);
+    }
+    sqe = uring_sqe();
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&ts;
+    sqe->len = 1;
+    sqe->off = 0;               /* Pure timeout: no completion count */
+    sqe->user_data = UD(UOP_TIMEOUT, 0);
+
+    for (int fd = 0; fd < uconn_cap; fd++) {
+        uconn_t *c = uconns[fd];
+        if (c && !c->closing) {
+            c->closing = 1;
+            uring_flush(c);     /* Send the rest, then shut down */
         }
     }
-}
\ No newline at end of file
+    while (clientcnt > 0 && !uring_expired) {
+        uring_submit_and_wait(&ring, 1);
+        uring_reap();
+    }
+
+    sqe = uring_sqe();          /* Drop the timeout if it has not fired */
+    sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+    sqe->addr = UD(UOP_TIMEOUT, 0);
+    sqe->user_data = UD(UOP_CANCEL, 0);
+    uring_submit_and_wait(&ring, 0);
+
+    if (!reload) {
+        Close(listenfd);
+        finish(NULL);
+    }
+    for (int fd = 0; fd < uconn_cap; fd++) /* Timed out: not passed on */
+        if (uconns[fd])
+            Fcntl(fd, F_SETFD, FD_CLOEXEC);
+    Fcntl(ring.ring_fd, F_SETFD, FD_CLOEXEC); /* Its fds and buffers die with it */
+    finish(handoff_begin(listenfd, 0));
+    uring_stopping = 0;
+    uring_arm_accept(listenfd);
+    if (local_listenfd >= 0)
+        uring_arm_accept(local_listenfd);
+}
+
+/* Event loop of the io_uring backend */
+static int serve_uring(int listenfd) {
+    struct io_uring_cqe *cqe;
+
+    objpool_init(&uconn_pool, sizeof(uconn_t), CONN_SLAB);
+    objpool_init(&dedup_pool, sizeof(dedup_t), CONN_SLAB);
+    if (uring_init(&ring, URING_ENTRIES) < 0)
+        return -1;
+    if (uring_bufring_init(&ring, &bufring, URING_BGID,
+                           URING_NBUFS, URING_BUFSZ) < 0) {
+        int saved = errno;
+        uring_exit(&ring);
+        errno = saved;
+        return -1;
+    }
+
+    /* Kernels without multishot accept reject it at submission */
+    uring_arm_accept(listenfd);
+    uring_submit_and_wait(&ring, 0);
+    if ((cqe = uring_peek_cqe(&ring)) != NULL && cqe->res == -EINVAL) {
+        uring_bufring_free(&ring, &bufring);
+        uring_exit(&ring);
+        errno = EINVAL;
+        return -1;
+    }
+    if (local_listenfd >= 0)
+        uring_arm_accept(local_listenfd);
+    printf("serving with io_uring\n");
+
+    while (1) {
+        if (stop_requested || reload_requested)
+            uring_stop(listenfd, !stop_requested);
+        uring_submit_and_wait(&ring, 1); /* A signal interrupts the wait */
+        uring_reap();
+    }
+    return 0;
+}
+#endif /* USE_URING */
@@ -0,0 +1,73 @@
+/*
+ * tracegen.c - Write a deterministic order trace for replay
+ *
+ * usage: tracegen <client#> <orders per client> <seed> [mean gap us] > trace
+ *
+ * Trace format, one order per line, sorted by time:
+ *
+ *     <time us> <client id> <request line>
+ *
+ * e.g. "15230 3 buy 4 7". Lines starting with '#' are comments. Each
+ * client sends multiclient's mix (show, buy, sell with equal odds) with
+ * gaps drawn uniformly from [0, 2 * mean gap], so one seed always gives
+ * the same trace.
+ */
+#include "csapp.h"
+
+#define STOCK_NUM 10
+#define BUY_SELL_MAX 10
+
+typedef struct {
+    long t;                 /* Send time, microseconds from trace start */
+    int client;
+    char cmd[32];
+} order_t;
+
+static int cmp_order(const void *a, const void *b) {
+    const order_t *x = a, *y = b;
+    if (x->t != y->t)
+        return (x->t > y->t) - (x->t < y->t);
+    return x->client - y->client;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: %s <client#> <orders per client> <seed> [mean gap us]\n", argv[0]);
+        exit(0);
+    }
+    int num_client = atoi(argv[1]);
+    int num_orders = atoi(argv[2]);
+    unsigned int seed = strtoul(argv[3], NULL, 10);
+    long gap = argc == 5 ? atol(argv[4]) : 1000;
+    long total = (long)num_client * num_orders;
+    order_t *orders = Malloc(total * sizeof(order_t));
+
+    for (int c = 0; c < num_client; c++) {
+        unsigned int cseed = seed * 7919 + c; /* Independent stream per client */
+        long t = 0;
+        for (int i = 0; i < num_orders; i++) {
+            order_t *o = &orders[(long)c * num_orders + i];
+            int option = rand_r(&cseed) % 3;
+            int id = rand_r(&cseed) % STOCK_NUM + 1;
+            int amt = rand_r(&cseed) % BUY_SELL_MAX + 1;
+
+            t += gap ? rand_r(&cseed) % (2 * gap + 1) : 0;
+            o->t = t;
+            o->client = c;
+            if (option == 0)
+                sprintf(o->cmd, "show");
+            else
+                sprintf(o->cmd, "%s %d %d", option == 1 ? "buy" : "sell", id, amt);
+        }
+    }
+    qsort(orders, total, sizeof(order_t), cmp_order);
+
+    printf("# stock order trace: %d clients, %d orders each, seed %u, mean gap %ld us\n",
+           num_client, num_orders, seed, gap);
+    printf("# <time us> <client id> <request line>\n");
+    for (long i = 0; i < total; i++)
+        printf("%ld %d %s\n", orders[i].t, orders[i].client, orders[i].cmd);
+
+    Free(orders);
+    return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * uring.c - a minimal io_uring wrapper (raw syscalls, no liburing)
+ *
+ * The kernel shares the rings with us through mmap. The SQ tail and CQ
+ * head are ours to publish (store-release); the SQ head and CQ tail are
+ * the kernel's (load-acquire).
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * uring_init - Create a ring with at least `entries` SQEs and map the
+ *     SQ ring, CQ ring and SQE array into our address space.
+ */
+int uring_init(uring_t *u, unsigned entries)
+{
+    struct io_uring_params p;
+    int fd;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    if ((fd = sys_io_uring_setup(entries, &p)) < 0)
+        return -1;
+    u->ring_fd = fd;
+
+    u->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {  /* One mapping for both rings */
+        if (u->cq_ring_sz > u->sq_ring_sz)
+            u->sq_ring_sz = u->cq_ring_sz;
+        u->cq_ring_sz = u->sq_ring_sz;
+    }
+
+    u->sq_ring = mmap(NULL, u->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+    u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        goto fail;
+
+    u->sq_entries = p.sq_entries;
+    u->sq_head  = (unsigned *)((char *)u->sq_ring + p.sq_off.head);
+    u->sq_tail  = (unsigned *)((char *)u->sq_ring + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)((char *)u->sq_ring + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ring + p.sq_off.array);
+    u->sqe_tail = *u->sq_tail;
+    u->cq_head  = (unsigned *)((char *)u->cq_ring + p.cq_off.head);
+    u->cq_tail  = (unsigned *)((char *)u->cq_ring + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)((char *)u->cq_ring + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)((char *)u->cq_ring + p.cq_off.cqes);
+    return 0;
+
+ fail:
+    {
+        int saved = errno;
+        uring_exit(u);
+        errno = saved;
+    }
+    return -1;
+}
+
+/*
+ * uring_exit - Unmap the rings and close the ring descriptor
+ */
+void uring_exit(uring_t *u)
+{
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_sz);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_sz);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_sz);
+    if (u->ring_fd > 0)
+        close(u->ring_fd);
+    memset(u, 0, sizeof(*u));
+}
+
+/*
+ * uring_get_sqe - Return a zeroed SQE to fill in, or NULL if the
+ *     submission queue is full (submit first, then retry).
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (u->sqe_tail - head >= u->sq_entries)
+        return NULL;
+    sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    u->sq_array[u->sqe_tail & *u->sq_mask] = u->sqe_tail & *u->sq_mask;
+    u->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * uring_submit_and_wait - Publish every SQE obtained since the last
+ *     call and wait for at least wait_nr completions, in one syscall.
+ */
+int uring_submit_and_wait(uring_t *u, unsigned wait_nr)
+{
+    unsigned to_submit;
+    int rc;
+
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    /* Anything the kernel has not consumed yet, including leftovers */
+    to_submit = u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    rc = sys_io_uring_enter(u->ring_fd, to_submit, wait_nr,
+                            wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    if (rc < 0 && errno == EINTR)   /* Interrupted: caller just reaps and retries */
+        return 0;
+    return rc;
+}
+
+/*
+ * uring_peek_cqe - Return the oldest unreaped completion, or NULL
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u)
+{
+    unsigned head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &u->cqes[head & *u->cq_mask];
+}
+
+/*
+ * uring_cqe_seen - Hand the completion returned by uring_peek_cqe back
+ */
+void uring_cqe_seen(uring_t *u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uring_bufring_init - Register a ring of nbufs provided buffers of
+ *     bufsz bytes as buffer group bgid and hand all of them to the kernel.
+ */
+int uring_bufring_init(uring_t *u, uring_bufring_t *b, unsigned short bgid,
+                       unsigned nbufs, unsigned bufsz)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(b, 0, sizeof(*b));
+    b->ring_sz = nbufs * sizeof(struct io_uring_buf);
+    b->br = mmap(NULL, b->ring_sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->br == MAP_FAILED)
+        return -1;
+    b->bufs = mmap(NULL, (size_t)nbufs * bufsz, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->bufs == MAP_FAILED) {
+        munmap(b->br, b->ring_sz);
+        return -1;
+    }
+    b->nbufs = nbufs;
+    b->bufsz = bufsz;
+    b->bgid = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)b->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = bgid;
+    if (sys_io_uring_register(u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        munmap(b->bufs, (size_t)nbufs * bufsz);
+        munmap(b->br, b->ring_sz);
+        errno = saved;
+        return -1;
+    }
+
+    for (unsigned i = 0; i < nbufs; i++)
+        uring_bufring_recycle(b, i);
+    return 0;
+}
+
+/*
+ * uring_bufring_free - Unregister the buffer group and release its memory
+ */
+void uring_bufring_free(uring_t *u, uring_bufring_t *b)
+{
+    struct io_uring_buf_reg reg;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = b->bgid;
+    sys_io_uring_register(u->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    munmap(b->bufs, (size_t)b->nbufs * b->bufsz);
+    munmap(b->br, b->ring_sz);
+}
+
+/*
+ * uring_bufring_buf - Address of provided buffer bid
+ */
+char *uring_bufring_buf(uring_bufring_t *b, unsigned short bid)
+{
+    return b->bufs + (size_t)bid * b->bufsz;
+}
+
+/*
+ * uring_bufring_recycle - Give buffer bid back to the kernel once its
+ *     contents have been consumed.
+ */
+void uring_bufring_recycle(uring_bufring_t *b, unsigned short bid)
+{
+    unsigned short tail = b->br->tail;
+    struct io_uring_buf *buf = &b->br->bufs[tail & (b->nbufs - 1)];
+
+    buf->addr = (unsigned long)uring_bufring_buf(b, bid);
+    buf->len = b->bufsz;
+    buf->bid = bid;
+    __atomic_store_n(&b->br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
@@ -0,0 +1,54 @@
+/*
+ * uring.h - a minimal io_uring wrapper (raw syscalls, no liburing)
+ *
+ * Only what the stock server's io_uring backend needs: one SQ/CQ ring
+ * pair and provided buffer rings for multishot recv.
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+
+/* Submission/completion ring pair */
+typedef struct {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sqe_tail;              /* Local tail, published on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;        /* mmap'd rings */
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+} uring_t;
+
+/* Provided buffer ring: nbufs buffers of bufsz bytes in group bgid */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned nbufs;                 /* Power of two */
+    unsigned bufsz;
+    unsigned short bgid;
+    size_t ring_sz;
+} uring_bufring_t;
+
+/* Ring setup and teardown (return -1 and set errno on failure) */
+int uring_init(uring_t *u, unsigned entries);
+void uring_exit(uring_t *u);
+
+/* Submission side */
+struct io_uring_sqe *uring_get_sqe(uring_t *u);
+int uring_submit_and_wait(uring_t *u, unsigned wait_nr);
+
+/* Completion side */
+struct io_uring_cqe *uring_peek_cqe(uring_t *u);
+void uring_cqe_seen(uring_t *u);
+
+/* Provided buffer rings */
+int uring_bufring_init(uring_t *u, uring_bufring_t *b, unsigned short bgid,
+                       unsigned nbufs, unsigned bufsz);
+void uring_bufring_free(uring_t *u, uring_bufring_t *b);
+char *uring_bufring_buf(uring_bufring_t *b, unsigned short bid);
+void uring_bufring_recycle(uring_bufring_t *b, unsigned short bid);
+
+#endif /* __URING_H__ */
@@ -0,0 +1,91 @@
+/*
+ * dedup.c - per-connection window of executed order IDs (see dedup.h)
+ */
+#include <string.h>
+
+#include "dedup.h"
+
+#define BIT(id)     ((uint64_t)1 << ((id) % 64))
+#define WORD(id)    (((id) % DEDUP_WINDOW) / 64)
+
+/*
+ * dedup_init - Start with an empty window
+ */
+void dedup_init(dedup_t *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+/*
+ * dedup_check - Has order id (>= 1) been executed on this connection?
+ */
+int dedup_check(dedup_t *d, unsigned long id, int *result)
+{
+    if (id > d->top)
+        return DEDUP_NEW;
+    if (d->top - id >= DEDUP_WINDOW)
+        return DEDUP_STALE;
+    if (!(d->seen[WORD(id)] & BIT(id)))
+        return DEDUP_NEW;
+    *result = d->result[id % DEDUP_WINDOW];
+    return DEDUP_DUP;
+}
+
+/*
+ * dedup_record - Remember that order id was executed with this result,
+ *     sliding the window forward if id is the new highest.
+ */
+void dedup_record(dedup_t *d, unsigned long id, int result)
+{
+    if (id > d->top) {
+        if (id - d->top >= DEDUP_WINDOW) {  /* Everything falls out */
+            memset(d->seen, 0, sizeof(d->seen));
+        } else {
+            for (unsigned long i = d->top + 1; i < id; i++)
+                d->seen[WORD(i)] &= ~BIT(i);    /* Skipped IDs: not executed */
+        }
+        d->top = id;
+    }
+    d->seen[WORD(id)] |= BIT(id);
+    d->result[id % DEDUP_WINDOW] = result;
+}
+
+/*
+ * dedup_save - Write the window as text, for a reload's handoff: a line
+ *     "dedup <top> <n>" and the n executed IDs in it with their results.
+ *     Text rather than the struct, so a rebuilt image with another
+ *     DEDUP_WINDOW can still read it.
+ */
+void dedup_save(dedup_t *d, FILE *f)
+{
+    unsigned long id, lo = d->top >= DEDUP_WINDOW ? d->top - DEDUP_WINDOW + 1 : 1;
+    int n = 0, result;
+
+    for (id = lo; id <= d->top; id++)
+        n += dedup_check(d, id, &result) == DEDUP_DUP;
+    fprintf(f, "dedup %lu %d\n", d->top, n);
+    for (id = lo; id <= d->top; id++)
+        if (dedup_check(d, id, &result) == DEDUP_DUP)
+            fprintf(f, "%lu %d\n", id, result);
+}
+
+/*
+ * dedup_load - Read a window written by dedup_save, up to and including
+ *     its last newline. Returns 0, or -1 if it is malformed.
+ */
+int dedup_load(dedup_t *d, FILE *f)
+{
+    unsigned long top, id;
+    int n, result;
+
+    dedup_init(d);
+    if (fscanf(f, "dedup %lu %d", &top, &n) != 2)
+        return -1;
+    while (n-- > 0) {   /* In increasing order: the window slides as saved */
+        if (fscanf(f, "%lu %d", &id, &result) != 2 || id == 0 || id > top)
+            return -1;
+        dedup_record(d, id, result);
+    }
+    d->top = top;
+    return fgetc(f) == '\n' ? 0 : -1;
+}
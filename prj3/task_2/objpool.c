@@ -0,0 +1,78 @@
+/*
+ * objpool.c - a fixed-size object pool (see objpool.h)
+ */
+#include <stdlib.h>
+
+#include "csapp.h"
+#include "objpool.h"
+
+/* Slab header; objects follow it at max_align_t alignment */
+typedef union slab {
+    union slab *next;
+    max_align_t align;
+} slab_t;
+
+/*
+ * objpool_init - Make an empty pool of objects of size bytes. Nothing is
+ *     allocated until the first objpool_get.
+ */
+void objpool_init(objpool_t *op, size_t size, int per_slab)
+{
+    size_t align = sizeof(max_align_t);
+
+    if (size < sizeof(void *))
+        size = sizeof(void *);
+    op->size = (size + align - 1) / align * align;
+    op->per_slab = per_slab;
+    op->free = NULL;
+    op->slabs = NULL;
+    op->nfree = 0;
+}
+
+/*
+ * objpool_get - Take an object off the free list, carving a new slab
+ *     when it is empty. The object's contents are undefined.
+ */
+void *objpool_get(objpool_t *op)
+{
+    void *obj;
+
+    if (!op->free) {
+        slab_t *slab = Malloc(sizeof(slab_t) + op->per_slab * op->size);
+        char *p = (char *)(slab + 1);
+
+        slab->next = op->slabs;
+        op->slabs = slab;
+        for (int i = op->per_slab - 1; i >= 0; i--) /* Hand out in address order */
+            objpool_put(op, p + i * op->size);
+    }
+    obj = op->free;
+    op->free = *(void **)obj;
+    op->nfree--;
+    return obj;
+}
+
+/*
+ * objpool_put - Give an object back for reuse
+ */
+void objpool_put(objpool_t *op, void *obj)
+{
+    *(void **)obj = op->free;
+    op->free = obj;
+    op->nfree++;
+}
+
+/*
+ * objpool_destroy - Free every slab at once, whether or not its objects
+ *     were given back. The pool is left empty and reusable.
+ */
+void objpool_destroy(objpool_t *op)
+{
+    slab_t *slab = op->slabs, *next;
+
+    for (; slab; slab = next) {
+        next = slab->next;
+        free(slab);
+    }
+    objpool_init(op, op->size, op->per_slab);
+}
@@ -0,0 +1,27 @@
+/*
+ * objpool.h - a fixed-size object pool
+ *
+ * Objects are carved out of slabs of per_slab objects and recycled
+ * through a free list, so a steady stream of allocations and frees of
+ * one type never reaches malloc. A pool is not thread safe: share it
+ * under a lock or give each thread its own.
+ */
+#ifndef __OBJPOOL_H__
+#define __OBJPOOL_H__
+
+#include <stddef.h>
+
+typedef struct {
+    size_t size;            /* Object size, rounded up for alignment */
+    int per_slab;           /* Objects carved per slab */
+    void *free;             /* Free objects, linked through their first word */
+    void *slabs;            /* Every slab, linked through its header */
+    int nfree;              /* Objects on the free list */
+} objpool_t;
+
+void objpool_init(objpool_t *op, size_t size, int per_slab);
+void *objpool_get(objpool_t *op);
+void objpool_put(objpool_t *op, void *obj);
+void objpool_destroy(objpool_t *op);
+
+#endif /* __OBJPOOL_H__ */
@@ -3,27 +3,58 @@
  */
 /* $begin echoclientmain */
 #include "csapp.h"
+#include "stockproto.h"
+
+/* Send one request frame and print its reply as the text protocol would */
+static void frame_request(int clientfd, rioz_t *rp, const char *buf)
+{
+    stock_frame_t req, res;
+    char out[MAXLINE], *p;
+    int more = 1;
+
+    frame_encode(buf, &req); /* An invalid line goes out as op 0: BIN_BADOP */
+    Rio_writen(clientfd, &req, sizeof(req));
+    if (req.op == BIN_EXIT)
+	return;
+    while (more && Rioz_getn(rp, &p, sizeof(res)) == sizeof(res)) {
+	memcpy(&res, p, sizeof(res));
+	more = frame_format(&res, req.op, out, sizeof(out));
+	Fputs(out, stdout);
+    }
+}
 
 int main(int argc, char **argv) 
 {
     int clientfd;
-    char *host, *port, buf[MAXLINE];
-    rio_t rio;
+    char *host, *port, buf[MAXLINE], *line;
+    rioz_t rio;
+    int binary;
 
-    if (argc != 3) {
-	fprintf(stderr, "usage: %s <host> <port>\n", argv[0]);
+    if (argc != 3 && !(argc == 4 && !strcmp(argv[3], "-b"))) {
+	fprintf(stderr, "usage: %s <host> <port> [-b]\n", argv[0]);
 	exit(0);
     }
     host = argv[1];
     port = argv[2];
+    binary = argc == 4; /* -b: binary frames (stockproto.h) */
 
     clientfd = Open_clientfd(host, port);
-    Rio_readinitb(&rio, clientfd);
+    Rioz_readinitb(&rio, clientfd);
+    if (binary) { /* Negotiate, then drop the text acknowledgement */
+	Rio_writen(clientfd, BIN_HELLO, strlen(BIN_HELLO));
+	while (Rioz_getline(&rio, &line) > 1)
+	    ;
+    }
 
     while (Fgets(buf, MAXLINE, stdin) != NULL) {
+	if (binary) {
+	    frame_request(clientfd, &rio, buf);
+	    continue;
+	}
 	Rio_writen(clientfd, buf, strlen(buf));
-	Rio_readnb(&rio, buf, MAXLINE);
-	Fputs(buf, stdout);
+	/* Print the reply up to its terminating empty line */
+	while (Rioz_getline(&rio, &line) > 1)
+	    Fputs(line, stdout);
     }
     Close(clientfd); //line:netp:echoclient:close
     exit(0);
@@ -5,20 +5,36 @@
  * port: 60029
  */
 #include "csapp.h"
+#include "stockproto.h"
+#include "objpool.h"
+#include "dedup.h"
 #include <time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <netinet/tcp.h>
 
 static struct timespec first_connect = {0}, last_disconnect = {0};
 
 #define NTHREADS 20
-#define MAX_STOCK_NUM 1024
 #define SBUFSIZE 1024
+#define ROW_LEN 40 /* "ID left_stock price\n" always fits */
+#define NODE_SLAB 1024 /* Nodes carved per slab */
+#define CONN_SLAB 64   /* Shard connection states carved per slab */
 
-/* thread routine */
+/* Every reply is a block of lines terminated by an empty line */
+#define END_OF_REPLY "\n"
+
+#define OUT_HIGHWAT (1 << 20) /* Stop reading a client with this much unsent output */
+
+/* thread routines */
 void *thread(void *vargp);
+static void *shard_thread(void *vargp);
 
 static int clientcnt = 0;
 sem_t f; /* semaphore for clientcnt */
 
+static char *listen_port; /* Port every shard's SO_REUSEPORT listener binds */
+
 /* sbuf_t: Bounded buffer used by the SBUF package */
 typedef struct {
     int *buf;               /* Buffer array */
@@ -38,6 +54,13 @@ static void sbuf_deinit(sbuf_t *sp);
 static void sbuf_insert(sbuf_t *sp, int item);
 static int sbuf_remove(sbuf_t *sp);
 
+/*
+ * Ordered indexes over the stocks, built at load: by ID ascending and by
+ * price descending. Prices never change here; left stock changes under
+ * per-node locks, so "top volume" is selected per request instead.
+ */
+enum { BY_ID, BY_PRICE, NINDEX };
+
 /* Stock databse encapsulation */
 typedef struct node {
     int ID;
@@ -45,104 +68,438 @@ typedef struct node {
     int price;
     struct node *left, *right;
     sem_t mutex; /* write 위한 semaphore */
+    int rowlen;         /* Length of row */
+    char row[ROW_LEN];  /* Pre-rendered "ID left_stock price\n" line for show */
+    stock_frame_t frame; /* ... and its BIN_ROW frame for binary clients */
 } node_t;
 
 typedef struct {
     node_t *root;
-    char buf[MAXLINE];
+    node_t **nodes;     /* Nodes in level order: children of nodes[i] are nodes[2i+1], nodes[2i+2] */
+    int cnt;            /* Number of stocks */
+    int cap;            /* Capacity of nodes and index[] */
+    node_t **index[NINDEX]; /* Nodes sorted by each key, ties broken by ID */
 } stockdb_t;
 
 static stockdb_t db;
+static objpool_t node_pool; /* Every node_t (filled by the main thread at load) */
 
-/* signal handler */
-static void sigint_handler(int sig);
+/* 
+ * shutdown and hot reload: SIGINT/SIGTERM/SIGHUP are blocked in every
+ * thread and taken by signal_thread with sigwait, so nothing runs in
+ * signal context
+ */
+#define DRAIN_TIMEOUT 5                    /* Seconds to answer in-flight requests */
+#define HANDOFF_ENV "STOCKSERVER_HANDOFF"  /* Descriptor of the state a reload passes on */
+#define MAX_LISTEN 1024                    /* Listeners a handoff can carry */
+static volatile int stopping;      /* Set once: stop accepting, drain */
+static volatile int reloading;     /* ... and pass the connections on */
+static int stop_pipe[2];           /* Readable once stopping: wakes the accept loops */
+static int listenfds[MAX_LISTEN];  /* Ours (shard i's at i), handed on by a reload */
+static int nlisten;
+static int inherited[MAX_LISTEN];  /* Passed on by the reload that started us */
+static int ninherited;
+static int local_listenfd = -1;    /* -u: Unix-domain listener for co-located clients */
+static char *local_path;
+static char **server_argv;         /* What a reload executes */
+static unsigned char *conn_open;   /* conn_open[fd]: fd is a client connection (under f) */
+static int conn_open_cap;
+
+/* A connection passed from one image to the next, with its unread input */
+typedef struct {
+    int fd;
+    int binary;
+    size_t len;
+    char *buf;
+    dedup_t dedup;                 /* Its order IDs: resent orders stay answered */
+} handoff_t;
+static handoff_t *handoffs;        /* Handed off so far by this image (under f) */
+static int nhandoffs;
+static handoff_t **adopted;        /* adopted[fd]: passed on to us, not yet served */
+static int adopted_cap;
+
+static void *signal_thread(void *vargp);
+static void stop_server(int reload);
+static void handoff_open(void);
+static int reload_pending(int connfd);
+static void hand_off(int connfd, int binary, rioz_t *rio, dedup_t *dedup);
+static int listen_fd(int i, char *port, int reuseport);
 
 /* stock operations */
 static void load_stock(const char *path);
 static void dump_stock(const char *path);
-static size_t list_stock(void);
+static void list_rows(riow_t *wio, node_t **v, int cnt, const stock_frame_t *end);
+static void list_stock(riow_t *wio, const stock_frame_t *end);
+static int list_range(riow_t *wio, unsigned lo, unsigned hi, const stock_frame_t *end);
+static void list_top(riow_t *wio, unsigned n, unsigned key, const stock_frame_t *end);
 static int change_stock(int id, char req, int amt);
 static void free_stockdb(void);
 
 /* binary tree operations */
 static node_t *node_create(int id, int stock, int price);
-static void node_insert(node_t **proot, node_t *new_node);
-static node_t *node_search(node_t *r, int id);
-static void node_free(node_t *r);
+static void node_render(node_t *n);
+static void node_insert(node_t *new_node);
+static node_t *node_search(int id);
+
 
+/* request handling */
+#define REQ_REPLY  0 /* Replied, keep reading */
+#define REQ_EXIT   1 /* Client said exit */
+#define REQ_BINARY 2 /* Replied; the client speaks frames from now on */
+static int serve_line(char *line, riow_t *wio, dedup_t *dedup);
+static int serve_frame(const char *buf, size_t n, riow_t *wio);
+static int has_request(rioz_t *rp, int binary);
+static void reply(riow_t *wio, const char *msg);
 
 /* server pool operations */
-static void handle_request(int connfd);
+static int handle_request(int connfd, rioz_t *rio, riow_t *wio, dedup_t *dedup);
+static void client_opened(int connfd);
+static void client_closed(int connfd);
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    int sharded = 0;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-r"))
+            sharded = 1;
+        else if (i + 1 < argc && !strcmp(argv[i], "-u"))
+            local_path = argv[++i];
+        else
+            argc = 0; /* Bad option */
+    }
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port> [-r] [-u <socket path>]\n", argv[0]);
+        fprintf(stderr, "  -r  one pinned thread per CPU, each with its own SO_REUSEPORT listener\n");
+        fprintf(stderr, "  -u  also listen on this Unix-domain socket (served by shard 0 with -r)\n");
         exit(0);
     }
 
-    Signal(SIGINT, sigint_handler);
+    sigset_t mask; /* Blocked here, so in every thread: only signal_thread takes them */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGHUP);
+    Sigprocmask(SIG_BLOCK, &mask, NULL);
+    Signal(SIGPIPE, SIG_IGN); /* Writes to a gone client fail with EPIPE */
+    server_argv = argv;
     load_stock("stock.txt"); /* load stock data from file to memory */
+    Sem_init(&f, 0, 1); /* initialize f semaphore */
+    handoff_open();
+    if (pipe(stop_pipe) < 0)
+        unix_error("pipe error");
+    Fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC); /* Not passed on by a reload */
+    Fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+    if (local_path && local_listenfd < 0)
+        local_listenfd = Open_listenfd_unix(local_path);
 
     int i, listenfd, connfd;
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
     char client_host[MAXLINE], client_port[MAXLINE];
     pthread_t tid;
+    struct pollfd pfd[3];
+
+    Pthread_create(&tid, NULL, signal_thread, NULL);
+    if (sharded) { /* Thread-per-core: the kernel spreads connections over the shards */
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        listen_port = argv[1];
+        nlisten = ncpu < MAX_LISTEN ? ncpu : MAX_LISTEN;
+        for (i = nlisten; i < ninherited; i++) /* Fewer CPUs than before the reload */
+            Close(inherited[i]);
+        for (long cpu = 1; cpu < nlisten; cpu++)
+            Pthread_create(&tid, NULL, shard_thread, (void *)cpu);
+        shard_thread((void *)0); /* main thread is shard 0 */
+        Pthread_exit(NULL);      /* Drained: signal_thread ends the process */
+    }
     
-    listenfd = Open_listenfd(argv[1]);
+    nlisten = 1;
+    for (i = nlisten; i < ninherited; i++) /* Shards' listeners before the reload */
+        Close(inherited[i]);
+    listenfd = listen_fd(0, argv[1], 0);
 
     sbuf_init(&sbuf, SBUFSIZE);
     for (i = 0; i < NTHREADS; i++) { /* Create worker threads */
         Pthread_create(&tid, NULL, thread, NULL);
     }
+    for (i = 0; i < adopted_cap; i++) { /* Connections a reload passed on */
+        if (adopted[i]) {
+            client_opened(i);
+            sbuf_insert(&sbuf, i);
+        }
+    }
 
-    Sem_init(&f, 0, 1); /* initialize f semaphore */
-
-    while (1) {
-        clientlen = sizeof(struct sockaddr_storage);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-
-        P(&f);
-        clientcnt++;
-        V(&f);
+    pfd[0].fd = stop_pipe[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = listenfd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = local_listenfd; /* -1 without -u: ignored by poll */
+    pfd[2].events = POLLIN;
+    while (!stopping) {
+        if (poll(pfd, 3, -1) < 0 && errno != EINTR)
+            unix_error("poll error");
+        for (i = 1; i < 3 && !stopping; i++) {
+            if (pfd[i].fd < 0 || !(pfd[i].revents & POLLIN))
+                continue;
+            clientlen = sizeof(struct sockaddr_storage);
+            if ((connfd = accept(pfd[i].fd, (SA *)&clientaddr, &clientlen)) < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK
+                    || errno == ECONNABORTED)
+                    continue;
+                unix_error("Accept error");
+            }
+            /* Replies are batched by handle_request: don't let Nagle delay
+               them (fails harmlessly on a Unix-domain socket) */
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+            client_opened(connfd);
 
-        if (clientcnt == 1 && first_connect.tv_sec == 0) {
-            /* first client just arrived */
-            clock_gettime(CLOCK_MONOTONIC, &first_connect);
-            printf("start timer!!\n");
+            if (pfd[i].fd == local_listenfd) {
+                printf("Conncected to (%s)\n", local_path);
+            } else {
+                Getnameinfo((SA*)&clientaddr, clientlen, client_host, MAXLINE, client_port, MAXLINE, 0);
+                printf("Conncected to (%s, %s)\n", client_host, client_port);
+            }
+            sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
         }
-        
-        Getnameinfo((SA*)&clientaddr, clientlen, client_host, MAXLINE, client_port, MAXLINE, 0);
-        printf("Conncected to (%s, %s)\n", client_host, client_port);
-        sbuf_insert(&sbuf, connfd); /* Insert connfd in buffer */
     }
 
+    Pthread_exit(NULL); /* Stop accepting; signal_thread drains and ends the process */
     return 0;
 }
 
 /* thread routing function */
 void *thread(void *vargp) {
+    rioz_t rio; /* This worker's buffers, reused by every client it serves */
+    riow_t wio;
+    dedup_t dedup;
+
     Pthread_detach(pthread_self());
+    Rioz_readinitb(&rio, -1);
+    riow_init(&wio, -1);
     while(1) {
         int connfd = sbuf_remove(&sbuf); /* Remove connfd from buffer */
-        handle_request(connfd); /* Service client */
+        if (handle_request(connfd, &rio, &wio, &dedup)) /* Service client */
+            continue; /* Handed on to the next image: stays open */
+        client_closed(connfd); /* Before Close: the fd number may be reused */
         Close(connfd);
+    }
+}
 
-        clock_gettime(CLOCK_MONOTONIC, &last_disconnect);
+/* Count and register a new client; the first one starts the timer */
+static void client_opened(int connfd) {
+    P(&f);
+    if (connfd >= conn_open_cap) {
+        int old = conn_open_cap;
+        conn_open_cap = 2 * connfd + 64;
+        conn_open = Realloc(conn_open, conn_open_cap);
+        memset(conn_open + old, 0, conn_open_cap - old);
+    }
+    conn_open[connfd] = 1;
+    if (clientcnt++ == 0 && first_connect.tv_sec == 0) {
+        /* first client just arrived */
+        clock_gettime(CLOCK_MONOTONIC, &first_connect);
+        printf("start timer!!\n");
+    }
+    V(&f);
+}
 
-        P(&f);
-        clientcnt--;
-        V(&f);
+/* Count a closed client; when none is left, dump the stock data */
+static void client_closed(int connfd) {
+    P(&f);
+    conn_open[connfd] = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_disconnect);
+    if (--clientcnt == 0) { /* 연결된 client 없으면 메모리에 있는 주식 정보를 파일에 기록*/
+        printf("no client!!\n");
+        if (first_connect.tv_sec != 0) {
+            double elapsed = (last_disconnect.tv_sec - first_connect.tv_sec) + (last_disconnect.tv_nsec - first_connect.tv_nsec) / 1e9;
+            printf(">> elapsed time: %.3f\n", elapsed);
+        }
+        dump_stock("stock.txt");
+    }
+    V(&f);
+}
+
+/*-------------- Thread-per-core shards (-r) --------------*/
+/* One connection owned by a shard */
+typedef struct {
+    int fd;
+    rioz_t rio;
+    riow_t wio;
+    int closing;            /* Client said exit: flush, then close */
+    int dead;               /* Peer gone or I/O error: close now */
+    int binary;             /* Speaks stockproto.h frames instead of lines */
+    dedup_t dedup;          /* Order ID window */
+} sconn_t;
+
+/* Answer every complete line buffered for c, then try to send the replies */
+static void shard_serve(sconn_t *c) {
+    char *line;
+    int n, rc;
+
+    while (!c->closing && riow_pending(&c->wio) < OUT_HIGHWAT) {
+        if (c->binary)
+            n = rioz_getn(&c->rio, &line, sizeof(stock_frame_t));
+        else
+            n = rioz_getline(&c->rio, &line);
+        if (n == RIO_AGAIN)
+            break;
+        if (n < 0) { /* Error */
+            c->dead = 1;
+            return;
+        }
+        if (n == 0) { /* EOF (or a drain): send what is queued, then close */
+            c->closing = 1;
+            break;
+        }
+        printf("server received %d bytes\n", n);
+        rc = c->binary ? serve_frame(line, n, &c->wio) : serve_line(line, &c->wio, &c->dedup);
+        if (rc == REQ_EXIT)
+            c->closing = 1;
+        else if (rc == REQ_BINARY)
+            c->binary = 1;
+    }
+    if (riow_flush(&c->wio) < 0)
+        c->dead = 1;
+}
+
+/* 
+ * Shard thread: pinned to one CPU, it opens its own SO_REUSEPORT
+ * listener on the shared port and serves the connections the kernel
+ * hands to that listener with a non-blocking poll() loop. A connection
+ * never leaves its shard, so there is no accept thread and no sbuf.
+ * Shard 0 also accepts on the Unix-domain socket, if there is one.
+ * Once stopping, the shard stops accepting and returns when its last
+ * connection has been drained.
+ */
+#define SHARD_FIXED 3 /* pfd[]: stop pipe, TCP listener, Unix-domain listener */
+static void *shard_thread(void *vargp) {
+    int cpu = (int)(long)vargp;
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+    int listenfd, connfd;
+    int n = 0, cap = 16;                        /* Connections, slots */
+    objpool_t conn_pool;                        /* This shard's sconn_t cache */
+    struct pollfd *pfd = Malloc((cap + SHARD_FIXED) * sizeof(struct pollfd));
+    sconn_t **conns = Malloc(cap * sizeof(sconn_t *));
+
+    /* Pin the calling thread (raw syscall: csapp.h clashes with _GNU_SOURCE) */
+    mask[cpu / (8 * sizeof(unsigned long))] |= 1UL << (cpu % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask) < 0)
+        fprintf(stderr, "shard %d: sched_setaffinity: %s\n", cpu, strerror(errno));
+
+    objpool_init(&conn_pool, sizeof(sconn_t), CONN_SLAB);
+    listenfd = listen_fd(cpu, listen_port, 1);
+    Fcntl(listenfd, F_SETFL, Fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+    pfd[0].fd = stop_pipe[0];       /* pfd[i + SHARD_FIXED] belongs to conns[i] */
+    pfd[0].events = POLLIN;
+    pfd[1].fd = listenfd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = cpu == 0 ? local_listenfd : -1;
+    pfd[2].events = POLLIN;
+    if (pfd[2].fd >= 0)
+        Fcntl(pfd[2].fd, F_SETFL, Fcntl(pfd[2].fd, F_GETFL, 0) | O_NONBLOCK);
+    for (connfd = cpu; connfd < adopted_cap; connfd += nlisten) { /* Our share of a reload's */
+        handoff_t *h = adopted[connfd];
+        if (!h)
+            continue;
+        if (n == cap) {
+            cap *= 2;
+            pfd = Realloc(pfd, (cap + SHARD_FIXED) * sizeof(struct pollfd));
+            conns = Realloc(conns, cap * sizeof(sconn_t *));
+        }
+        Fcntl(connfd, F_SETFL, Fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+        sconn_t *c = objpool_get(&conn_pool);
+        memset(c, 0, sizeof(*c));
+        c->fd = connfd;
+        c->binary = h->binary;
+        c->dedup = h->dedup;
+        Rioz_readinitb(&c->rio, connfd);
+        riow_init(&c->wio, connfd);
+        if (rioz_unread(&c->rio, h->buf, h->len) < 0) /* The unread requests */
+            unix_error("rioz_unread error");
+        adopted[connfd] = NULL;
+        Free(h->buf);
+        Free(h);
+        conns[n] = c;
+        pfd[n + SHARD_FIXED].fd = connfd;
+        pfd[n + SHARD_FIXED].events = POLLIN;
+        pfd[n + SHARD_FIXED].revents = 0;
+        n++;
+        client_opened(connfd);
+    }
 
-        if(clientcnt == 0) { /* 연결된 client 없으면 메모리에 있는 주식 정보를 파일에 기록*/
-            printf("no client!!\n");
-            if (first_connect.tv_sec != 0) {
-                double elapsed = (last_disconnect.tv_sec - first_connect.tv_sec) + (last_disconnect.tv_nsec - first_connect.tv_nsec) / 1e9;
-                printf(">> elapsed time: %.3f\n", elapsed);
+    while (pfd[1].fd >= 0 || n > 0) {
+        if (poll(pfd, n + SHARD_FIXED, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        if (stopping) /* Negative fds are ignored by poll */
+            pfd[0].fd = pfd[1].fd = pfd[2].fd = -1;
+
+        for (int l = 1; l < SHARD_FIXED; l++) {
+            if (pfd[l].fd < 0 || !(pfd[l].revents & POLLIN))
+                continue;
+            while ((connfd = accept(pfd[l].fd, NULL, NULL)) >= 0) {
+                if (n == cap) {
+                    cap *= 2;
+                    pfd = Realloc(pfd, (cap + SHARD_FIXED) * sizeof(struct pollfd));
+                    conns = Realloc(conns, cap * sizeof(sconn_t *));
+                }
+                Fcntl(connfd, F_SETFL, Fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+                setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)); /* Not on AF_UNIX */
+                sconn_t *c = objpool_get(&conn_pool);
+                memset(c, 0, sizeof(*c)); /* Also an empty dedup window */
+                c->fd = connfd;
+                Rioz_readinitb(&c->rio, connfd);
+                riow_init(&c->wio, connfd);
+                conns[n] = c;
+                pfd[n + SHARD_FIXED].fd = connfd;
+                pfd[n + SHARD_FIXED].events = POLLIN;
+                pfd[n + SHARD_FIXED].revents = 0;
+                n++;
+                client_opened(connfd);
+                printf("shard %d: connected fd %d\n", cpu, connfd);
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED
+                && errno != EINTR)
+                unix_error("accept error");
+        }
+
+        for (int i = 0; i < n; ) {
+            sconn_t *c = conns[i];
+            short re = pfd[i + SHARD_FIXED].revents;
+
+            if ((re & POLLOUT) && riow_flush(&c->wio) < 0)
+                c->dead = 1;
+            if (!c->dead && !reloading && ((re & (POLLIN | POLLHUP | POLLERR))
+                             || ((re & POLLOUT) && has_request(&c->rio, c->binary))))
+                shard_serve(c);
+
+            int gone = c->dead || (c->closing && !riow_pending(&c->wio));
+            if (gone || (reloading && !riow_pending(&c->wio))) {
+                if (gone) {
+                    client_closed(c->fd); /* Before Close: the fd number may be reused */
+                    Close(c->fd);
+                } else { /* Replies sent: the next image reads the rest */
+                    hand_off(c->fd, c->binary, &c->rio, &c->dedup);
+                }
+                rioz_free(&c->rio);
+                riow_free(&c->wio);
+                objpool_put(&conn_pool, c);
+                conns[i] = conns[--n];      /* Not yet visited: handle it next */
+                pfd[i + SHARD_FIXED] = pfd[n + SHARD_FIXED];
+                continue;
             }
-            dump_stock("stock.txt");
+            pfd[i + SHARD_FIXED].events = (c->closing || reloading ? 0 : POLLIN)
+                                | (riow_pending(&c->wio) ? POLLOUT : 0);
+            if (riow_pending(&c->wio) >= OUT_HIGHWAT)
+                pfd[i + SHARD_FIXED].events &= ~POLLIN;  /* Backpressure until it drains */
+            i++;
         }
     }
+    objpool_destroy(&conn_pool);
+    Free(pfd);
+    Free(conns);
+    return NULL;
 }
 
 /*-------------- sbuf manipulating functions --------------*/
@@ -182,13 +539,206 @@ static int sbuf_remove(sbuf_t *sp) {
 }
 
 /*-------------- Signal handler --------------*/
-/* SIGINT signal handler */
-static void sigint_handler(int sig) {
+/* 
+ * Take SIGINT/SIGTERM (stop) and SIGHUP (reload) with sigwait: a normal
+ * thread, so draining and snapshotting need not be async-signal-safe.
+ */
+static void *signal_thread(void *vargp) {
+    sigset_t mask;
+    int sig;
+
+    Pthread_detach(pthread_self());
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGHUP);
+    if ((errno = sigwait(&mask, &sig)) != 0)
+        unix_error("sigwait error");
+    stop_server(sig == SIGHUP);
+    return NULL;
+}
+
+/*-------------- Shutdown and hot reload --------------*/
+/* 
+ * Stop (SIGINT, SIGTERM) or reload (SIGHUP): the accept loops stop
+ * accepting. On a stop, every connection's read side is shut down so
+ * its thread answers what the client already sent, flushes and closes
+ * it, and after at most DRAIN_TIMEOUT seconds the catalog is
+ * snapshotted and the server exits.
+ *
+ * On a reload, each connection is handed off instead, at a request
+ * boundary once its replies are sent (hand_off): a pool worker does
+ * it when it would next block reading, a shard as soon as the
+ * connection's output is flushed. Then argv[0] (possibly a new binary)
+ * is executed with the listening sockets and those connections, which
+ * the new image serves from sbuf or its shards, its unread input
+ * first; clients see no disconnect. A connection still busy after
+ * DRAIN_TIMEOUT is closed. The handoff is an unlinked file whose
+ * descriptor is in HANDOFF_ENV: "listen <fd> 0" lines, "local <fd>" for
+ * -u, and per connection "client <fd> <binary> <len> 1\n" followed by
+ * len bytes of unread input and its order ID window (dedup_save). If
+ * the exec fails, the server exits with the snapshot written.
+ */
+static void stop_server(int reload) {
+    struct timespec now, deadline;
+    int n;
+
+    printf("%s: draining %d clients\n", reload ? "reload" : "shutdown", clientcnt);
+    reloading = reload; /* Before stopping: the workers check it once woken */
+    stopping = 1;
+    if (write(stop_pipe[1], "", 1) < 0) /* Never read: stays readable */
+        unix_error("write error");
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += DRAIN_TIMEOUT;
+    while (1) {
+        P(&f); /* Also catches clients accepted just before stopping */
+        for (int fd = 0; fd < conn_open_cap && !reload; fd++)
+            if (conn_open[fd])
+                shutdown(fd, SHUT_RD);
+        n = clientcnt;
+        V(&f);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (n == 0 || now.tv_sec >= deadline.tv_sec)
+            break;
+        usleep(10000);
+    }
+
+    P(&f);
     dump_stock("stock.txt");
-    free_stockdb();
+    if (reload) {
+        FILE *handoff = tmpfile();
+        char fd[16];
+
+        if (!handoff)
+            unix_error("tmpfile error");
+        for (int i = 0; i < nlisten; i++)
+            fprintf(handoff, "listen %d 0\n", listenfds[i]);
+        if (local_listenfd >= 0)
+            fprintf(handoff, "local %d\n", local_listenfd);
+        for (int i = 0; i < nhandoffs; i++) {
+            handoff_t *h = &handoffs[i];
+            fprintf(handoff, "client %d %d %zu 1\n", h->fd, h->binary, h->len);
+            fwrite(h->buf, 1, h->len, handoff);
+            dedup_save(&h->dedup, handoff);
+        }
+        for (int fd = 0; fd < conn_open_cap; fd++) /* Timed out: not passed on */
+            if (conn_open[fd])
+                Fcntl(fd, F_SETFD, FD_CLOEXEC);
+        printf("reload: handing off %d clients\n", nhandoffs);
+        fflush(handoff);
+        rewind(handoff);
+        snprintf(fd, sizeof(fd), "%d", fileno(handoff));
+        setenv(HANDOFF_ENV, fd, 1);
+        printf("reload: executing %s\n", server_argv[0]);
+        fflush(stdout);
+        execvp(server_argv[0], server_argv);
+        fprintf(stderr, "reload: %s: %s\n", server_argv[0], strerror(errno));
+    } else if (n == 0) {
+        free_stockdb(); /* Drained: no thread is left to touch it */
+        sbuf_deinit(&sbuf); /* Nor the pool's (never filled with -r) */
+    }
+    if (local_listenfd >= 0)
+        unlink(local_path);
     exit(0);
 }
 
+/* 
+ * Collect the listening descriptors and connections passed on by a
+ * reload, if any. Connections go to adopted[], in blocking mode (the
+ * shards set their own back to non-blocking).
+ */
+static void handoff_open(void) {
+    char line[MAXLINE], *env = getenv(HANDOFF_ENV);
+    int fd, n, binary, windowed, nclients = 0;
+    size_t len;
+    FILE *handoff;
+
+    if (!env)
+        return;
+    handoff = Fdopen(atoi(env), "r");
+    unsetenv(HANDOFF_ENV);
+    while (fgets(line, sizeof(line), handoff)) {
+        windowed = 0;
+        if (sscanf(line, "listen %d %d", &fd, &n) == 2 && ninherited < MAX_LISTEN) {
+            inherited[ninherited++] = fd;
+        } else if (sscanf(line, "local %d", &fd) == 1) {
+            local_listenfd = fd;
+        } else if (sscanf(line, "client %d %d %zu %d", &fd, &binary, &len, &windowed) >= 3
+                   && fd >= 0) {
+            handoff_t *h = Malloc(sizeof(handoff_t));
+            h->fd = fd;
+            h->binary = binary;
+            h->len = len;
+            h->buf = Malloc(len + 1);
+            if (fread(h->buf, 1, len, handoff) != len)
+                app_error("reload: bad handoff");
+            if (!windowed)
+                dedup_init(&h->dedup); /* From an image that did not pass it on */
+            else if (dedup_load(&h->dedup, handoff) < 0)
+                app_error("reload: bad handoff");
+            if (fd >= adopted_cap) {
+                int old = adopted_cap;
+                adopted_cap = 2 * fd + 64;
+                adopted = Realloc(adopted, adopted_cap * sizeof(handoff_t *));
+                memset(adopted + old, 0, (adopted_cap - old) * sizeof(handoff_t *));
+            }
+            adopted[fd] = h;
+            Fcntl(fd, F_SETFL, Fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+            nclients++;
+        }
+    }
+    Fclose(handoff);
+    printf("reload: %d listening sockets, %d clients inherited\n", ninherited, nclients);
+}
+
+/* 
+ * Pool worker, with no request buffered: block until connfd is
+ * readable, or return 1 if a reload started first (the connection is
+ * then handed off unread). A stop reads on: shutdown brings the EOF.
+ */
+static int reload_pending(int connfd) {
+    struct pollfd pfd[2] = { { connfd, POLLIN, 0 }, { stop_pipe[0], POLLIN, 0 } };
+
+    if (stopping && !reloading)
+        return 0;
+    while (poll(pfd, 2, -1) < 0)
+        if (errno != EINTR)
+            unix_error("poll error");
+    return (pfd[1].revents & POLLIN) && reloading;
+}
+
+/* 
+ * Record connfd, its mode, unread input and order ID window for the
+ * next image; it stays open
+ */
+static void hand_off(int connfd, int binary, rioz_t *rio, dedup_t *dedup) {
+    handoff_t *h;
+    char *buf;
+    size_t len = rioz_buffered(rio, &buf);
+
+    P(&f);
+    handoffs = Realloc(handoffs, (nhandoffs + 1) * sizeof(handoff_t));
+    h = &handoffs[nhandoffs++];
+    h->fd = connfd;
+    h->binary = binary;
+    h->len = len;
+    h->buf = Malloc(len + 1);
+    memcpy(h->buf, buf, len);
+    h->dedup = *dedup;
+    conn_open[connfd] = 0;
+    clientcnt--;
+    V(&f);
+}
+
+/* Listener i: the one passed on by a reload, or a new one */
+static int listen_fd(int i, char *port, int reuseport) {
+    if (i < ninherited)
+        listenfds[i] = inherited[i];
+    else
+        listenfds[i] = reuseport ? Open_listenfd_reuseport(port) : Open_listenfd(port);
+    return listenfds[i];
+}
+
 /*-------------- Stock DB operations --------------*/
 /* Load stock data from a file */
 static void load_stock(const char *path) {
@@ -198,9 +748,10 @@ static void load_stock(const char *path) {
         exit(1); 
     }
     int id, st, pr;
+    objpool_init(&node_pool, sizeof(node_t), NODE_SLAB);
     while (fscanf(f, "%d %d %d", &id, &st, &pr) == 3) {
         node_t *n = node_create(id, st, pr);
-        node_insert(&db.root, n);
+        node_insert(n);
     }
     fclose(f);
 }
@@ -212,52 +763,116 @@ static void dump_stock(const char *path) {
         perror("fopen");
         exit(1); 
     }
-    if (!db.root) { fclose(f); return; }
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = db.root;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        fprintf(f, "%d %d %d\n", cur->ID, cur->left_stock, cur->price);
-        if (cur->left)  queue[tail++] = cur->left;
-        if (cur->right) queue[tail++] = cur->right;
-    }
+    for (int i = 0; i < db.cnt; i++) /* nodes[] is already in level order */
+        fputs(db.nodes[i]->row, f);
     fclose(f);
 }
 
-/* List all stocks */
-static size_t list_stock(void) {
-    size_t off = 0;
-    db.buf[0] = '\0';
-    if (!db.root) return 0;
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = db.root;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        int len = snprintf(db.buf + off, MAXLINE - off,
-                           "%d %d %d\n",
-                           cur->ID, cur->left_stock, cur->price);
-        if (len < 0 || (size_t)len >= MAXLINE - off) break; /* snprintf error or bufferoverflow */
-        off += len;
-        if (cur->left)  queue[tail++] = cur->left;
-        if (cur->right) queue[tail++] = cur->right;
+/* 
+ * Queue the rows of v[0..cnt-1] and the reply terminator on the
+ * connection's output. end is NULL for text rows; otherwise the rows are
+ * BIN_ROW frames and end is the frame that closes the reply. Each row is
+ * copied under its node's mutex so a concurrent buy/sell can never tear it.
+ */
+static void list_rows(riow_t *wio, node_t **v, int cnt, const stock_frame_t *end) {
+    struct iovec iov;
+    for (int i = 0; i < cnt; i++) {
+        node_t *cur = v[i];
+        P(&cur->mutex);
+        iov.iov_base = end ? (void *)&cur->frame : cur->row;
+        iov.iov_len = end ? sizeof(stock_frame_t) : cur->rowlen;
+        riow_queuev(wio, &iov, 1);
+        V(&cur->mutex);
+    }
+    if (end) {
+        iov.iov_base = (void *)end;
+        iov.iov_len = sizeof(*end);
+        riow_queuev(wio, &iov, 1);
+    } else {
+        reply(wio, END_OF_REPLY);
+    }
+}
+
+/* Queue all stocks (level order) */
+static void list_stock(riow_t *wio, const stock_frame_t *end) {
+    list_rows(wio, db.nodes, db.cnt, end);
+}
+
+/* 
+ * Queue the stocks with lo <= ID <= hi in ID order: O(log n + k) over the
+ * ID index. Returns -1, queueing nothing, if a single ID (lo == hi) is
+ * no stock.
+ */
+static int list_range(riow_t *wio, unsigned lo, unsigned hi, const stock_frame_t *end) {
+    node_t **v = db.index[BY_ID];
+    int first = 0, last, mid, cnt = db.cnt;
+
+    while (first < cnt) { /* First ID >= lo */
+        mid = (first + cnt) / 2;
+        if ((unsigned)v[mid]->ID < lo)
+            first = mid + 1;
+        else
+            cnt = mid;
+    }
+    for (last = first; last < db.cnt && (unsigned)v[last]->ID <= hi; last++)
+        ;
+    if (lo == hi && last == first)
+        return -1;
+    list_rows(wio, v + first, last - first, end);
+    return 0;
+}
+
+/* 
+ * Queue the n stocks with the highest price (from the price index) or
+ * left stock (TOP_VOLUME: kept in a sorted array of n while scanning
+ * every stock, each read under its mutex).
+ */
+static void list_top(riow_t *wio, unsigned n, unsigned key, const stock_frame_t *end) {
+    int cnt = n < (unsigned)db.cnt ? (int)n : db.cnt;
+
+    if (key == TOP_PRICE) {
+        list_rows(wio, db.index[BY_PRICE], cnt, end);
+        return;
+    }
+
+    node_t **top = Malloc((cnt + 1) * sizeof(node_t *));
+    int *vol = Malloc((cnt + 1) * sizeof(int));
+    int ntop = 0;
+    for (int i = 0; i < db.cnt; i++) { /* ID order breaks ties toward low IDs */
+        node_t *cur = db.index[BY_ID][i];
+        P(&cur->mutex);
+        int v = cur->left_stock;
+        V(&cur->mutex);
+
+        int j = ntop < cnt ? ntop++ : cnt;
+        for (; j > 0 && vol[j - 1] < v; j--) {
+            top[j] = top[j - 1];
+            vol[j] = vol[j - 1];
+        }
+        top[j] = cur;
+        vol[j] = v;
     }
-    return off;
+    list_rows(wio, top, ntop, end);
+    Free(vol);
+    Free(top);
 }
 
 /* Change stock */
 static int change_stock(int id, char req, int amt) {
-    node_t *n = node_search(db.root, id);
+    node_t *n = node_search(id);
     if (!n) return -1; /* Invalid ID */
 
     P(&(n->mutex));
     if (req == 'b') {
-        if (n->left_stock < amt) return 1; /* Not enough stock*/        
+        if (n->left_stock < amt) {
+            V(&(n->mutex));
+            return 1; /* Not enough stock*/
+        }
         n->left_stock -= amt;
     } else if (req == 's') {
         n->left_stock += amt;
     }
+    node_render(n);
     V(&(n->mutex));
 
     return 0; /* Success */
@@ -265,131 +880,305 @@ static int change_stock(int id, char req, int amt) {
 
 /* Free the stock database */
 static void free_stockdb(void) {
-    node_free(db.root);
+    objpool_destroy(&node_pool);
     db.root = NULL;
+    free(db.nodes);
+    db.nodes = NULL;
+    for (int k = 0; k < NINDEX; k++) {
+        free(db.index[k]);
+        db.index[k] = NULL;
+    }
+    db.cnt = db.cap = 0;
 }
 
 /*-------------- Binary Tree operations --------------*/
 /* Create a new node */
 static node_t *node_create(int id, int stock, int price) {
-    node_t *n = malloc(sizeof(*n));
-    if (!n) { 
-        perror("malloc"); 
-        exit(1); 
-    }
+    node_t *n = objpool_get(&node_pool); /* Neighbours in level order share cache lines */
     n->ID = id;
     n->left_stock = stock;
     n->price = price;
     n->left = n->right = NULL;
     Sem_init(&n->mutex, 0, 1);
+    node_render(n);
     return n;
 }
 
-/* Insert a new node into the binary tree (level order insertion) */
-static void node_insert(node_t **proot, node_t *new_node) {
-    if (!*proot) { /* If the tree is empty */
-        *proot = new_node;
-        return;
+/* Re-render the node's show row and frame (callers hold n->mutex once it is shared) */
+static void node_render(node_t *n) {
+    n->rowlen = snprintf(n->row, ROW_LEN, "%d %d %d\n",
+                         n->ID, n->left_stock, n->price);
+    n->frame.op = BIN_SHOW;
+    n->frame.status = BIN_ROW;
+    n->frame.pad = 0;
+    n->frame.id = htonl(n->ID);
+    n->frame.qty = htonl(n->left_stock);
+    n->frame.price = htonl(n->price);
+}
+
+/* Does a sort before b in index k? (Only called at load, before sharing) */
+static int node_before(node_t *a, node_t *b, int k) {
+    if (k == BY_PRICE && a->price != b->price)
+        return a->price > b->price;
+    return a->ID < b->ID;
+}
+
+/* 
+ * Insert a new node into the binary tree (level order insertion).
+ * The tree is complete, so the parent of the n-th node is nodes[(n-1)/2].
+ */
+static void node_insert(node_t *new_node) {
+    if (db.cnt == db.cap) { /* Grow nodes[] and index[] */
+        db.cap = db.cap ? 2 * db.cap : 64;
+        db.nodes = Realloc(db.nodes, db.cap * sizeof(node_t *));
+        for (int k = 0; k < NINDEX; k++)
+            db.index[k] = Realloc(db.index[k], db.cap * sizeof(node_t *));
     }
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
-    queue[tail++] = *proot;
-    while (head < tail) {
-        node_t *cur = queue[head++];
-        if (!cur->left) {
-            cur->left = new_node;
-            return;
-        }
-        queue[tail++] = cur->left;
-        if (!cur->right) {
-            cur->right = new_node;
-            return;
-        }
-        queue[tail++] = cur->right;
+    int i = db.cnt;
+    db.nodes[db.cnt++] = new_node;
+    for (int k = 0; k < NINDEX; k++) { /* Insertion sort into each index */
+        node_t **v = db.index[k];
+        int j = i;
+        for (; j > 0 && node_before(new_node, v[j - 1], k); j--)
+            v[j] = v[j - 1];
+        v[j] = new_node;
+    }
+    if (i == 0) { /* If the tree is empty */
+        db.root = new_node;
+        return;
     }
+    node_t *parent = db.nodes[(i - 1) / 2];
+    if (i % 2)
+        parent->left = new_node;
+    else
+        parent->right = new_node;
 }
 
-/* Search for a node by ID in the binary tree */
-static node_t *node_search(node_t *r, int id) {
-    if (!r) return NULL;
-    /* fixed-size queue */
-    node_t *queue[MAX_STOCK_NUM];
-    int head = 0, tail = 0;
+/* Search for a node by ID: binary search of the ID index */
+static node_t *node_search(int id) {
+    node_t **v = db.index[BY_ID];
+    int lo = 0, hi = db.cnt;
 
-    queue[tail++] = r;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (v[mid]->ID < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < db.cnt && v[lo]->ID == id ? v[lo] : NULL; /* NULL: not found */
+}
 
-    while(head < tail) {
-        node_t *cur = queue[head++];
+/* Queue a static reply string on the connection's output */
+static void reply(riow_t *wio, const char *msg) {
+    struct iovec iov;
+    iov.iov_base = (char *)msg;
+    iov.iov_len = strlen(msg);
+    riow_queuev(wio, &iov, 1);
+}
 
-        if(cur->ID == id) return cur;
+/* 
+ * Execute a buy/sell at most once per order ID (oid 0: no ID) on this
+ * connection. Returns change_stock's result, or -2 if oid is too old to
+ * check; *dup tells whether it was a resend answered from the window.
+ */
+static int order_once(dedup_t *dedup, unsigned long oid, int id, char req, int amt, int *dup) {
+    int rc;
 
-        if(cur->left) queue[tail++] = cur->left;
-        if(cur->right) queue[tail++] = cur->right;
+    *dup = 0;
+    if (oid == 0)
+        return change_stock(id, req, amt);
+    switch (dedup_check(dedup, oid, &rc)) {
+    case DEDUP_STALE:
+        return -2;
+    case DEDUP_DUP:
+        *dup = 1;
+        return rc;
     }
-
-    return NULL; /* Not found */
+    rc = change_stock(id, req, amt);
+    dedup_record(dedup, oid, rc);
+    return rc;
 }
 
-/* Free the binary tree recursively*/
-static void node_free(node_t *r) {
-    if (!r) return;
-    node_free(r->left);
-    node_free(r->right);
-    free(r);
+/* Queue a buy/sell reply; with an order ID it reads "<msg> #<oid>[ (duplicate)]" */
+static void reply_order(riow_t *wio, const char *msg, unsigned long oid, int dup) {
+    char buf[64];
+    struct iovec iov;
+
+    if (oid == 0) {
+        reply(wio, msg);
+        return;
+    }
+    iov.iov_base = buf;
+    iov.iov_len = snprintf(buf, sizeof(buf), "%.*s #%lu%s\n" END_OF_REPLY,
+                           (int)(strlen(msg) - 2), msg, oid, dup ? " (duplicate)" : "");
+    riow_queuev(wio, &iov, 1);
 }
 
-/* Handle a clients' request */
-static void handle_request(int connfd) {
-    int n;
-    char buf[MAXLINE];
-    char response[MAXLINE];
+/* 
+ * Answer one request line (a view that strtok_r may cut up) by queueing
+ * its reply in wio. Returns REQ_EXIT when the client asked to leave.
+ *
+ * show takes an ID or ID range ("show 3", "show 2-5"), and "top 5 price"
+ * or "top 5 volume" lists the five highest stocks by that key. buy and
+ * sell take an optional order ID ("buy 3 10 42"): a resent ID is answered
+ * again from dedup, marked "(duplicate)", without executing twice.
+ */
+static int serve_line(char *line, riow_t *wio, dedup_t *dedup) {
     const char delim[] = " ";
-    rio_t rio;
+    char *save;
+    char *token = strtok_r(line, delim, &save);
 
-    Rio_readinitb(&rio, connfd); /* Initialize connfd's rio */
+    if (!token) {
+        reply(wio, "Unknown command\n" END_OF_REPLY);
+    } else if (!strcmp(token, "show\n") || !strcmp(token, "show")
+               || !strcmp(token, "top")) {
+        unsigned lo, hi;
+        int rc = -2;
 
-    while ((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0) {
-        printf("server received %d bytes\n", n);
+        if (token[0] == 's' && parse_show(save, &lo, &hi) == 0) {
+            rc = 0;
+            if (lo || hi)
+                rc = list_range(wio, lo, hi, NULL);
+            else
+                list_stock(wio, NULL);
+        } else if (token[0] == 't' && parse_top(save, &lo, &hi) == 0) {
+            rc = 0;
+            list_top(wio, lo, hi, NULL);
+        }
+        if (rc < 0)
+            reply(wio, rc == -1 ? "Invalid ID\n" END_OF_REPLY : "Unknown command\n" END_OF_REPLY);
+    } else if (!strcmp(token, "buy") || !strcmp(token, "sell")) {
+        char req = token[0];
+        char *id = strtok_r(NULL, delim, &save), *amt = strtok_r(NULL, delim, &save);
+        char *oidp = strtok_r(NULL, delim, &save);
+        unsigned long oid = oidp ? strtoul(oidp, NULL, 10) : 0;
+        int dup = 0;
+        int r = (id && amt) ? order_once(dedup, oid, atoi(id), req, atoi(amt), &dup) : -1;
+
+        if (r == 0) {
+            reply_order(wio, req == 'b' ? "[buy] success\n" END_OF_REPLY
+                                        : "[sell] success\n" END_OF_REPLY, oid, dup);
+        } else if (r == 1) {
+            reply_order(wio, "Not enough stock\n" END_OF_REPLY, oid, dup);
+        } else if (r == -2) {
+            reply_order(wio, "Order ID too old\n" END_OF_REPLY, oid, dup);
+        } else {
+            reply_order(wio, "Invalid ID\n" END_OF_REPLY, oid, dup);
+        }
+    } else if (!strcmp(token, "exit\n")) {    
+        /* clinet connection 종료시켜야 함*/   
+        return REQ_EXIT;
+    } else if (!strcmp(token, BIN_HELLO)) {
+        reply(wio, "[binary] ok\n" END_OF_REPLY);
+        return REQ_BINARY;
+    } else {
+        reply(wio, "Unknown command\n" END_OF_REPLY);
+    }
+    return REQ_REPLY;
+}
 
-        response[0] = '\0';
+/* 
+ * Answer one request frame of a binary client (see stockproto.h) by
+ * queueing its reply frames in wio. Returns REQ_EXIT on BIN_EXIT.
+ */
+static int serve_frame(const char *buf, size_t n, riow_t *wio) {
+    stock_frame_t req;
+    struct iovec iov;
+    unsigned lo, hi;
+    int rc;
 
-        char *token = strtok(buf, delim);
+    memset(&req, 0, sizeof(req));
+    memcpy(&req, buf, n); /* n < sizeof(req) only if EOF cut the frame */
+    req.pad = 0;
+    switch (req.op) {
+    case BIN_SHOW:
+    case BIN_TOP:
+        req.status = BIN_OK; /* Closes the listing */
+        lo = ntohl(req.id);
+        hi = ntohl(req.qty);
+        rc = 0;
+        if (req.op == BIN_TOP && lo && hi <= TOP_VOLUME)
+            list_top(wio, lo, hi, &req);
+        else if (req.op == BIN_TOP)
+            rc = -2;
+        else if (lo || hi)
+            rc = list_range(wio, lo, hi, &req);
+        else
+            list_stock(wio, &req);
+        if (rc == 0)
+            return REQ_REPLY;
+        req.status = rc == -1 ? BIN_BADID : BIN_BADOP;
+        break;
+    case BIN_BUY:
+    case BIN_SELL:
+        rc = change_stock(ntohl(req.id), req.op == BIN_BUY ? 'b' : 's',
+                          ntohl(req.qty));
+        req.status = rc == 0 ? BIN_OK : rc == 1 ? BIN_NOSTOCK : BIN_BADID;
+        break;
+    case BIN_EXIT:
+        return REQ_EXIT;
+    default:
+        req.status = BIN_BADOP;
+    }
+    iov.iov_base = &req;
+    iov.iov_len = sizeof(req);
+    riow_queuev(wio, &iov, 1);
+    return REQ_REPLY;
+}
 
-        if (!strcmp(token, "show\n")) {
-            size_t n = list_stock();
-            Rio_writen(connfd, db.buf, MAXLINE);
-        } else if (!strcmp(token, "buy")) {
-            int buy_id = atoi(strtok(NULL, delim));
-            int buy_amount = atoi(strtok(NULL, delim));
-            int r = change_stock(buy_id, 'b', buy_amount);
+/* Is the next request (a line, or a frame for binary clients) buffered? */
+static int has_request(rioz_t *rp, int binary) {
+    return binary ? rioz_hasn(rp, sizeof(stock_frame_t)) : rioz_hasline(rp);
+}
 
-            if (r == 0) {
-                sprintf(response, "[buy] success\n");
-            } else if (r == 1) {
-                sprintf(response, "Not enough stock\n");
-            } else if (r == -1) {
-                sprintf(response, "Invalid ID\n");
-            }
-            Rio_writen(connfd, response, MAXLINE);
-        } else if (!strcmp(token, "sell")) {
-            int sell_id = atoi(strtok(NULL, delim));
-            int sell_amount = atoi(strtok(NULL, delim));
-            int r = change_stock(sell_id, 's', sell_amount);
-
-            if (r == 0) {
-                sprintf(response, "[sell] success\n");
-            } else if (r == -1) {
-                sprintf(response, "Invalid ID\n");
-            }
-            Rio_writen(connfd, response, MAXLINE);
-        } else if (!strcmp(token, "exit\n")) {    
-            /* clinet connection 종료시켜야 함*/   
-            //printf("received [exit] command\n");
-            //Rio_writen(connfd, "[exit]", MAXLINE);
-            break;
-        } else {
-            sprintf(response, "Unknown command\n");
-            Rio_writen(connfd, response, MAXLINE);
+/* 
+ * Handle a clients' request. Replies are queued in wio and written with
+ * one write once no further request line is already buffered, so a
+ * pipelined batch costs one syscall. rio and wio are the calling
+ * worker's; their buffers outlive the connection. Before blocking for
+ * more input, it checks for a reload (reload_pending). Returns 1 if the
+ * connection was handed off to the next image, 0 when it is done.
+ */
+static int handle_request(int connfd, rioz_t *rio, riow_t *wio, dedup_t *dedup) {
+    int n, rc, binary = 0;
+    char *line;
+    handoff_t *h = connfd < adopted_cap ? adopted[connfd] : NULL;
+
+    dedup_init(dedup);       /* Order IDs are per connection */
+    rioz_reset(rio, connfd); /* Point the worker's rio at connfd */
+    riow_reset(wio, connfd); /* ... and its (blocking) output queue */
+    if (h) { /* Passed on by a reload: its mode, unread requests and order IDs */
+        adopted[connfd] = NULL;
+        binary = h->binary;
+        *dedup = h->dedup;
+        if (rioz_unread(rio, h->buf, h->len) < 0)
+            unix_error("rioz_unread error");
+        Free(h->buf);
+        Free(h);
+    }
+
+    while (1) { /* line is a view into rio */
+        if (!has_request(rio, binary) && reload_pending(connfd)) {
+            hand_off(connfd, binary, rio, dedup);
+            return 1;
         }
+        if (binary)
+            n = Rioz_getn(rio, &line, sizeof(stock_frame_t));
+        else
+            n = Rioz_getline(rio, &line);
+        if (n == 0)
+            break;
+        printf("server received %d bytes\n", n);
+
+        rc = binary ? serve_frame(line, n, wio) : serve_line(line, wio, dedup);
+        if (rc == REQ_EXIT)
+            break;
+        if (rc == REQ_BINARY)
+            binary = 1;
+        if (!has_request(rio, binary) && riow_flush(wio) < 0) /* End of batch */
+            break;
     }
+    riow_flush(wio); /* Replies queued before exit */
+    return 0;
 }
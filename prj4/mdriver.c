@@ -0,0 +1,518 @@
+/*
+ * mdriver.c - Trace-driven benchmark for the allocator in mm.c
+ *
+ * usage: ./mdriver [-v] [-n] [-c ops] [-f tracefile]... [-t tracedir] [-s secs]
+ *
+ * Every trace (by default each *.rep file in ./traces) is replayed
+ * against mm.c three times:
+ *   - checked: each payload must be 8-byte aligned, and keeps a
+ *     pattern written over all of it until it is freed or resized, so
+ *     overlapping blocks and bad realloc copies are caught;
+ *   - for space: after every operation the footprint (memlib heap plus
+ *     mm_mapped()) is compared with the live payload bytes. util is
+ *     peak live bytes over peak footprint; frag is the footprint not
+ *     holding live data, averaged over the operations;
+ *   - timed: the whole trace, mm_init included, repeated for at least
+ *     secs seconds (0.2 by default).
+ * The timed run is repeated on the C library's malloc. The performance
+ * index weighs utilization 60 and throughput relative to libc 40, as
+ * in the CS:APP malloc lab. -n skips libc (its throughput is then
+ * taken as 1). -v prints each failure and each trace's name as it runs.
+ *
+ * -c ops runs mm_checkheap every ops operations of the checked run, and
+ * after the last; a trace whose heap breaks an invariant fails. Below
+ * its row goes the profile of the check that saw the most live bytes:
+ * internal fragmentation (handed-out bytes not asked for, headers and
+ * rounding, over bytes handed out), external (free bytes outside the
+ * largest free block, over free bytes), free blocks by power of two,
+ * and slab runs and objects in use by class.
+ *
+ * Trace format (the CS:APP malloc lab's):
+ *
+ *     <suggested heap size>   ignored
+ *     <number of ids>
+ *     <number of operations>
+ *     <weight>                ignored
+ *     a <id> <bytes>          id = malloc(bytes)
+ *     r <id> <bytes>          id = realloc(id, bytes)
+ *     f <id>                  free(id)
+ *
+ * An id may be allocated again once it has been freed.
+ */
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAX_TRACES  64
+#define ALIGNMENT   8
+
+typedef struct {
+    char type;                          /* 'a', 'r' or 'f' */
+    int id;
+    size_t size;
+} op_t;
+
+typedef struct {
+    char *name;
+    int num_ids;
+    int num_ops;
+    op_t *ops;
+} trace_t;
+
+typedef struct {
+    int valid;
+    double util;                        /* Peak live / peak footprint */
+    double frag;                        /* Mean share of footprint not live */
+    double kops;                        /* mm.c, thousands of ops per second */
+    double libc_kops;
+    size_t peak_live;                   /* Live bytes at the profile (-c) */
+    mm_profile_t prof;
+} stats_t;
+
+static int verbose;
+static int check_every;                 /* -c: ops between mm_checkheap calls */
+static double min_secs = 0.2;
+
+static void unix_error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+        unix_error("malloc");
+    return p;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* read_trace - Parse a trace file; exits on a malformed one */
+static trace_t *read_trace(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    trace_t *t = xmalloc(sizeof(trace_t));
+    int heap_size, weight;
+    char type[2];
+
+    if (fp == NULL)
+        unix_error(path);
+    if (fscanf(fp, "%d %d %d %d", &heap_size, &t->num_ids, &t->num_ops, &weight) != 4
+        || t->num_ids < 0 || t->num_ops < 0) {
+        fprintf(stderr, "mdriver: %s: bad header\n", path);
+        exit(1);
+    }
+    t->name = strdup(strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    t->ops = xmalloc((t->num_ops + 1) * sizeof(op_t));
+    for (int i = 0; i < t->num_ops; i++) {
+        op_t *op = &t->ops[i];
+        if (fscanf(fp, "%1s %d", type, &op->id) != 2
+            || op->id < 0 || op->id >= t->num_ids
+            || (type[0] != 'f' && fscanf(fp, "%zu", &op->size) != 1)
+            || strchr("arf", type[0]) == NULL) {
+            fprintf(stderr, "mdriver: %s: bad operation %d\n", path, i);
+            exit(1);
+        }
+        op->type = type[0];
+    }
+    fclose(fp);
+    return t;
+}
+
+static void free_trace(trace_t *t)
+{
+    free(t->name);
+    free(t->ops);
+    free(t);
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* list_traces - Add every *.rep file in dir to paths, sorted */
+static int list_traces(const char *dir, char **paths, int n)
+{
+    DIR *dp = opendir(dir);
+    struct dirent *de;
+    int first = n;
+
+    if (dp == NULL)
+        unix_error(dir);
+    while ((de = readdir(dp)) != NULL && n < MAX_TRACES) {
+        size_t len = strlen(de->d_name);
+        if (len > 4 && strcmp(de->d_name + len - 4, ".rep") == 0) {
+            paths[n] = xmalloc(strlen(dir) + len + 2);
+            sprintf(paths[n++], "%s/%s", dir, de->d_name);
+        }
+    }
+    closedir(dp);
+    qsort(paths + first, n - first, sizeof(char *), cmp_name);
+    return n;
+}
+
+/* The pattern byte k of block id holds while the block is live */
+static void fill(char *p, int id, size_t size)
+{
+    for (size_t k = 0; k < size; k++)
+        p[k] = (char)(id * 131 + k);
+}
+
+static int intact(const char *p, int id, size_t size)
+{
+    for (size_t k = 0; k < size; k++)
+        if (p[k] != (char)(id * 131 + k))
+            return 0;
+    return 1;
+}
+
+static int fail(trace_t *t, int i, const char *msg)
+{
+    if (verbose)
+        printf("%s: op %d (%c %d): %s\n", t->name, i, t->ops[i].type, t->ops[i].id, msg);
+    return 0;
+}
+
+static void start_heap(void)
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+        fprintf(stderr, "mdriver: mm_init failed\n");
+        exit(1);
+    }
+}
+
+/*
+ * check_trace - The checked run; returns 1 if mm.c got everything right.
+ *     With -c, also checks the heap and keeps its peak profile in st.
+ */
+static int check_trace(trace_t *t, stats_t *st)
+{
+    char **p = calloc(t->num_ids, sizeof(char *));
+    size_t *size = calloc(t->num_ids, sizeof(size_t));
+    size_t live = 0;
+    mm_profile_t prof;
+    int ok = 1;
+
+    start_heap();
+    for (int i = 0; i < t->num_ops && ok; i++) {
+        op_t *op = &t->ops[i];
+        char *q;
+
+        if (check_every && i % check_every == 0) {
+            if (mm_checkheap(&prof) != 0) {
+                ok = fail(t, i, "mm_checkheap found the heap broken");
+                break;
+            }
+            if (live >= st->peak_live) {
+                st->peak_live = live;
+                st->prof = prof;
+            }
+        }
+
+        switch (op->type) {
+        case 'a':
+            if (p[op->id] != NULL) {
+                ok = fail(t, i, "id already allocated (bad trace)");
+                break;
+            }
+            q = mm_malloc(op->size);
+            if (q == NULL && op->size > 0) {
+                ok = fail(t, i, "mm_malloc failed");
+                break;
+            }
+            if ((uintptr_t)q % ALIGNMENT != 0) {
+                ok = fail(t, i, "payload not aligned");
+                break;
+            }
+            fill(q, op->id, op->size);
+            p[op->id] = q;
+            size[op->id] = op->size;
+            live += op->size;
+            break;
+        case 'r':
+            if (p[op->id] != NULL && !intact(p[op->id], op->id, size[op->id])) {
+                ok = fail(t, i, "payload overwritten while allocated");
+                break;
+            }
+            q = mm_realloc(p[op->id], op->size);
+            if (q == NULL && op->size > 0) {
+                ok = fail(t, i, "mm_realloc failed");
+                break;
+            }
+            if ((uintptr_t)q % ALIGNMENT != 0) {
+                ok = fail(t, i, "payload not aligned");
+                break;
+            }
+            if (!intact(q, op->id, size[op->id] < op->size ? size[op->id] : op->size)) {
+                ok = fail(t, i, "mm_realloc did not keep the payload");
+                break;
+            }
+            fill(q, op->id, op->size);
+            p[op->id] = q;
+            live += op->size - size[op->id];
+            size[op->id] = op->size;
+            break;
+        case 'f':
+            if (p[op->id] != NULL && !intact(p[op->id], op->id, size[op->id])) {
+                ok = fail(t, i, "payload overwritten while allocated");
+                break;
+            }
+            mm_free(p[op->id]);
+            p[op->id] = NULL;
+            live -= size[op->id];
+            size[op->id] = 0;
+            break;
+        }
+    }
+    if (ok && check_every && mm_checkheap(&prof) != 0)
+        ok = fail(t, t->num_ops - 1, "mm_checkheap found the heap broken");
+    else if (ok && check_every && live >= st->peak_live) {
+        st->peak_live = live;
+        st->prof = prof;
+    }
+    for (int id = 0; id < t->num_ids; id++)
+        if (ok && p[id] != NULL)
+            mm_free(p[id]);
+    free(p);
+    free(size);
+    return ok;
+}
+
+/* space_trace - Peak utilization and mean fragmentation of one run */
+static void space_trace(trace_t *t, stats_t *st)
+{
+    char **p = calloc(t->num_ids, sizeof(char *));
+    size_t *size = calloc(t->num_ids, sizeof(size_t));
+    size_t live = 0, peak_live = 0, peak_foot = 0;
+    double waste = 0;
+
+    start_heap();
+    for (int i = 0; i < t->num_ops; i++) {
+        op_t *op = &t->ops[i];
+        size_t foot;
+
+        switch (op->type) {
+        case 'a':
+            p[op->id] = mm_malloc(op->size);
+            live += op->size;
+            size[op->id] = op->size;
+            break;
+        case 'r':
+            p[op->id] = mm_realloc(p[op->id], op->size);
+            live += op->size - size[op->id];
+            size[op->id] = op->size;
+            break;
+        case 'f':
+            mm_free(p[op->id]);
+            p[op->id] = NULL;
+            live -= size[op->id];
+            size[op->id] = 0;
+            break;
+        }
+        foot = mem_heapsize() + mm_mapped();
+        if (live > peak_live)
+            peak_live = live;
+        if (foot > peak_foot)
+            peak_foot = foot;
+        if (foot > 0)
+            waste += (double)(foot - (live < foot ? live : foot)) / foot;
+    }
+    for (int id = 0; id < t->num_ids; id++)
+        mm_free(p[id]);
+    st->util = peak_foot ? (double)peak_live / peak_foot : 0;
+    st->frag = t->num_ops ? waste / t->num_ops : 0;
+    free(p);
+    free(size);
+}
+
+/*
+ * time_trace - Thousands of operations per second, replaying the trace
+ *     on mm.c or (libc set) the C library until min_secs have passed
+ */
+static double time_trace(trace_t *t, int libc)
+{
+    void **p = calloc(t->num_ids, sizeof(void *));
+    long reps = 0;
+    double start = now(), elapsed;
+
+    do {
+        if (!libc)
+            start_heap();
+        for (int i = 0; i < t->num_ops; i++) {
+            op_t *op = &t->ops[i];
+            switch (op->type) {
+            case 'a':
+                p[op->id] = libc ? malloc(op->size) : mm_malloc(op->size);
+                break;
+            case 'r':
+                p[op->id] = libc ? realloc(p[op->id], op->size) : mm_realloc(p[op->id], op->size);
+                break;
+            case 'f':
+                if (libc)
+                    free(p[op->id]);
+                else
+                    mm_free(p[op->id]);
+                p[op->id] = NULL;
+                break;
+            }
+        }
+        for (int id = 0; id < t->num_ids; id++) {
+            if (libc)
+                free(p[id]);
+            else
+                mm_free(p[id]);
+            p[id] = NULL;
+        }
+        reps++;
+    } while ((elapsed = now() - start) < min_secs);
+    free(p);
+    return reps * t->num_ops / elapsed / 1e3;
+}
+
+/* print_profile - The heap profile kept by check_trace (-c) */
+static void print_profile(stats_t *st)
+{
+    mm_profile_t *pr = &st->prof;
+
+    printf("    at peak: %zu live, %zu used, %zu free, %zu cached, %zu heap + %zu mapped\n",
+           st->peak_live, pr->used, pr->free, pr->cached, pr->heap, pr->mapped);
+    printf("    internal %.1f%%, external %.1f%%, %zu free blocks, largest %zu\n",
+           pr->used ? 100.0 * (pr->used - st->peak_live) / pr->used : 0,
+           pr->free ? 100.0 * (pr->free - pr->largest_free) / pr->free : 0,
+           pr->free_blocks, pr->largest_free);
+    printf("    free blocks by size:");
+    for (int k = 0; k < 32; k++)
+        if (pr->hist[k])
+            printf(" %zu+:%zu", (size_t)1 << k, pr->hist[k]);
+    printf("\n    slab runs/objects by class:");
+    for (int c = 0; c < MM_SLAB_CLASSES; c++)
+        if (pr->runs[c])
+            printf(" %zu:%zu/%zu", pr->slab_size[c], pr->runs[c], pr->objects[c]);
+    printf("\n");
+}
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "usage: %s [-v] [-n] [-c ops] [-f tracefile]... [-t tracedir] [-s secs]\n",
+            argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    char *paths[MAX_TRACES];
+    int ntraces = 0, use_libc = 1, opt;
+    stats_t st, sum = { 1, 0, 0, 0, 0 };
+    double ops = 0, mm_secs = 0, libc_secs = 0;
+
+    while ((opt = getopt(argc, argv, "vnc:f:t:s:")) != -1) {
+        switch (opt) {
+        case 'v':
+            verbose = 1;
+            break;
+        case 'n':
+            use_libc = 0;
+            break;
+        case 'c':
+            if ((check_every = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'f':
+            if (ntraces == MAX_TRACES)
+                usage(argv[0]);
+            paths[ntraces++] = strdup(optarg);
+            break;
+        case 't':
+            ntraces = list_traces(optarg, paths, ntraces);
+            break;
+        case 's':
+            min_secs = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (ntraces == 0)
+        ntraces = list_traces("traces", paths, 0);
+    if (ntraces == 0) {
+        fprintf(stderr, "mdriver: no traces\n");
+        exit(1);
+    }
+
+    mem_init();
+    printf("Team: %s (%s)\n", team.name, team.id);
+    printf("%-22s %5s %7s %7s %8s %10s %11s\n",
+           "trace", "valid", "util", "frag", "ops", "Kops/s", "libc Kops/s");
+    for (int i = 0; i < ntraces; i++) {
+        trace_t *t = read_trace(paths[i]);
+
+        if (verbose)
+            printf("%s: %d ids, %d ops\n", t->name, t->num_ids, t->num_ops);
+        memset(&st, 0, sizeof(st));
+        st.valid = check_trace(t, &st);
+        if (st.valid) {
+            space_trace(t, &st);
+            st.kops = time_trace(t, 0);
+            st.libc_kops = use_libc ? time_trace(t, 1) : 0;
+        }
+        printf("%-22s %5s", t->name, st.valid ? "yes" : "no");
+        if (st.valid) {
+            printf(" %6.1f%% %6.1f%% %8d %10.0f", 100 * st.util, 100 * st.frag, t->num_ops, st.kops);
+            if (use_libc)
+                printf(" %11.0f", st.libc_kops);
+            sum.util += st.util;
+            sum.frag += st.frag;
+            ops += t->num_ops;
+            mm_secs += t->num_ops / st.kops;
+            if (use_libc)
+                libc_secs += t->num_ops / st.libc_kops;
+        } else {
+            sum.valid = 0;
+        }
+        printf("\n");
+        if (st.valid && check_every)
+            print_profile(&st);
+        free_trace(t);
+        free(paths[i]);
+    }
+    if (!sum.valid) {
+        printf("Some traces failed: no performance index\n");
+        return 1;
+    }
+
+    /* Totals: mean space figures, throughput over all operations */
+    sum.util /= ntraces;
+    sum.frag /= ntraces;
+    sum.kops = ops / mm_secs;
+    printf("%-22s %5s %6.1f%% %6.1f%% %8.0f %10.0f", "Total", "", 100 * sum.util,
+           100 * sum.frag, ops, sum.kops);
+    if (use_libc) {
+        sum.libc_kops = ops / libc_secs;
+        printf(" %11.0f", sum.libc_kops);
+    }
+    printf("\n");
+
+    double tput = use_libc ? sum.kops / sum.libc_kops : 1;
+    if (tput > 1)
+        tput = 1;
+    printf("Perf index = %.0f (util) + %.0f (thru) = %.0f/100\n",
+           60 * sum.util, 40 * tput, 60 * sum.util + 40 * tput);
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * memlib.c - A simulated sbrk heap over one reserved mapping
+ *
+ * The whole MAX_HEAP region is mapped once with MAP_NORESERVE, so
+ * only the pages the allocator touches cost memory. mem_reset_brk
+ * keeps those pages: a timed run that starts over does not fault them
+ * in again, just as the C library reuses its own heap.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memlib.h"
+
+static char *mem_start_brk;     /* First byte of the heap */
+static char *mem_brk;           /* Last byte of the heap, plus one */
+static char *mem_max_addr;      /* Largest legal heap address, plus one */
+
+/* mem_init - Reserve the heap region */
+void mem_init(void)
+{
+    void *p = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mem_init: mmap");
+        exit(1);
+    }
+    mem_start_brk = p;
+    mem_brk = mem_start_brk;
+    mem_max_addr = mem_start_brk + MAX_HEAP;
+}
+
+/* mem_deinit - Give the heap region back */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MAX_HEAP);
+}
+
+/* mem_reset_brk - Empty the heap (its pages stay, for the next run) */
+void mem_reset_brk(void)
+{
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_sbrk - Grow the heap by incr bytes and return the start of the
+ *     new area, or (void *)-1 with errno ENOMEM. The heap never shrinks.
+ */
+void *mem_sbrk(int incr)
+{
+    char *old_brk = mem_brk;
+
+    if (incr < 0 || incr > mem_max_addr - mem_brk) {
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+        return (void *)-1;
+    }
+    mem_brk += incr;
+    return old_brk;
+}
+
+/* mem_heap_lo - First byte of the heap */
+void *mem_heap_lo(void)
+{
+    return mem_start_brk;
+}
+
+/* mem_heap_hi - Last byte of the heap */
+void *mem_heap_hi(void)
+{
+    return mem_brk - 1;
+}
+
+/* mem_heapsize - Heap size in bytes */
+size_t mem_heapsize(void)
+{
+    return mem_brk - mem_start_brk;
+}
+
+/* mem_pagesize - The system's page size in bytes */
+size_t mem_pagesize(void)
+{
+    return sysconf(_SC_PAGESIZE);
+}
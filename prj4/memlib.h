@@ -0,0 +1,23 @@
+/*
+ * memlib.h - The heap mm.c grows with mem_sbrk
+ *
+ * One MAX_HEAP region is reserved up front and never moves; the break
+ * starts at its bottom and only goes up, until mem_reset_brk.
+ */
+#ifndef __MEMLIB_H__
+#define __MEMLIB_H__
+
+#include <stddef.h>
+
+#define MAX_HEAP (1UL << 30)    /* Reserved address space (bytes) */
+
+void mem_init(void);
+void mem_deinit(void);
+void *mem_sbrk(int incr);
+void mem_reset_brk(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+
+#endif /* __MEMLIB_H__ */
@@ -1,8 +1,12 @@
+#define _GNU_SOURCE /* mremap */
 #include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
@@ -24,40 +28,235 @@ team_t team = {
 #define WSIZE               4                   /* Word and header/footer size (bytes) */
 #define DSIZE               8                   /* Double word size (bytes) */
 #define CHUNKSIZE           (1 << 10)           /* Extend heap by this amount (bytes) */
-#define SEGLIST_CNT         20
+#define MIN_BLOCK           (2 * DSIZE)         /* Free: header, two links and footer */
+
+/*
+ * Free lists are indexed in two levels, as in TLSF. The first level is
+ * the power of two below the size, the second splits each power of two
+ * into SL_CNT equal ranges; the first SMALL_BINS lists hold one exact
+ * size each (16, 24, ...). Every list is LIFO. seg_fl_bitmap has bit f
+ * set while some list of first level f is non-empty, and seg_sl_bitmap[f]
+ * has bit s set while list (f, s) is. Build with -DSL_SHIFT=n to trade
+ * list heads for finer classes.
+ */
+#ifndef SL_SHIFT
+#define SL_SHIFT            4                   /* log2 of lists per power of two */
+#endif
+#if SL_SHIFT < 1 || SL_SHIFT > 5
+#error "SL_SHIFT must be between 1 and 5"
+#endif
+#define SL_CNT              (1 << SL_SHIFT)
+#define FL_CNT              (30 - SL_SHIFT)     /* Sizes below 2^32 */
+#define SEGLIST_CNT         (FL_CNT * SL_CNT)
+#define SMALL_BINS          (2 * SL_CNT)        /* Exact sizes below 2 * SL_CNT * DSIZE */
+#define FIT_SCAN            8                   /* Blocks compared in a large bin */
 
 #define MAX(x, y)           ((x) > (y) ? (x) : (y))
 #define ALIGNMENT           8
 #define ALIGN(size)         (((size) + (ALIGNMENT - 1)) & ~0x7)
 
-/* Pack a size and allocated bit into a word */
+/*
+ * Slabs. Requests of at most SLAB_MAX bytes are rounded up to one of
+ * SLAB_CLASSES object sizes (steps of 8 bytes) and served from runs:
+ * RUN_SIZE-aligned slices of the heap carved as one allocated block,
+ * holding a run_t and then objects of one size with no header. Free
+ * objects are a LIFO list inside the run; objects never handed out
+ * yet sit past `bump`. run_map has a byte per RUN_SIZE of heap, set
+ * on the slices that are runs, so a free finds its run from the
+ * address. A run's block is exactly RUN_SIZE bytes, its header in the
+ * last word of the slice before, so runs carved one after another sit
+ * back to back. Each owner (the central heap, or a thread cache once
+ * the heap is shared) keeps a list per class of the runs with room; a
+ * run left empty goes back to the heap unless it is the last one in
+ * its list.
+ *
+ * Only the smallest requests are worth it: an 8-byte object takes 8
+ * bytes in a run and 16 as a block, but from 9 bytes up a block
+ * wastes 4 bytes more on average, less than a class's partly used
+ * runs and the free space they split off around them cost whenever a
+ * class has only a few hundred objects live. Runs are 1 KB so that a
+ * class holding few objects costs little.
+ */
+#define SLAB_CLASSES        MM_SLAB_CLASSES     /* In mm.h, for mm_profile_t */
+#define SLAB_MAX            (SLAB_CLASSES * ALIGNMENT)
+#define SLAB_SIZE(cls)      (((cls) + 1) * ALIGNMENT)     /* Object size */
+#define RUN_SHIFT           10
+#define RUN_SIZE            (1 << RUN_SHIFT)
+#define RUN_BLOCK           RUN_SIZE            /* Block holding one run */
+#define RUN_END             (RUN_SIZE - WSIZE)  /* Next block's header after it */
+#define RUN_MAP_SIZE        ((1UL << (32 - RUN_SHIFT)) + 1) /* Slices of a 4 GB heap */
+
+/*
+ * Large blocks. Requests of mmap_min bytes or more get a mapping of
+ * their own, its length in the word before the payload, and free
+ * unmaps it, so they never grow the heap. A pointer outside the heap
+ * is one of these. As in glibc, freeing a mapped block raises
+ * mmap_min to its size (up to MMAP_MAX_MIN), so a program that keeps
+ * allocating blocks of that size reuses heap memory instead of
+ * faulting in fresh pages every time.
+ *
+ * The heap itself cannot shrink (mem_sbrk only grows it). Instead,
+ * after every TRIM_EVERY bytes freed, trim_heap drops the whole pages
+ * inside free blocks of at least TRIM_MIN bytes with MADV_DONTNEED;
+ * they fault back in as zeroes when reused. The first TRIM_KEEP bytes
+ * of each block stay, since place() cuts allocations from the front.
+ */
+#define MMAP_MIN            (1 << 17)           /* Initial mmap_min */
+#define MMAP_MAX_MIN        (1 << 25)
+#define TRIM_EVERY          (1 << 22)
+#define TRIM_MIN            (1 << 16)
+#define TRIM_KEEP           (1 << 15)
+
+/*
+ * Thread caches. A thread's first small malloc gives it a tcache_t,
+ * carved from the heap, and an owner id: its slot in tcache_table.
+ * Blocks of at most TCACHE_MAX bytes come from the central heap
+ * TCACHE_REFILL at a time under heap_lock, and stay allocated there
+ * while cached. Their header has OWNED set and the owner id in the
+ * top 16 bits (the size fits in the low 16). The owner pops and
+ * pushes them with no lock. Another thread freeing one pushes it on
+ * the owner's remote list with a CAS, and the owner takes the whole
+ * list in one exchange when a bin runs dry. A bin holding more than
+ * TCACHE_COUNT blocks gives half back to the central heap at once.
+ * Caches only serve mallocs once a second thread has used the heap:
+ * a single-threaded program keeps the central heap's utilization.
+ * Threads read a cached block's header without the lock; the central
+ * heap may be flipping its PREV_ALLOC bit meanwhile, but the size and
+ * owner bits they look at never change while the block is cached.
+ */
+#define TCACHE_MIN          ASIZE(SLAB_MAX + 1) /* Smaller ones are slab objects */
+#define TCACHE_MAX          512                 /* Largest cached block */
+#define TCACHE_BINS         ((TCACHE_MAX - TCACHE_MIN) / DSIZE + 1)
+#define TCACHE_COUNT        16                  /* Blocks kept per bin */
+#define TCACHE_REFILL       8                   /* Blocks carved per refill */
+#define MAX_THREADS         256                 /* Owner ids; 0 is no owner */
+
+/* List heads, second-level bitmaps, tcache_table and slab_lists at the
+ * start of the heap */
+#define LISTS_SIZE          ALIGN((SEGLIST_CNT + FL_CNT + MAX_THREADS + SLAB_CLASSES) * WSIZE)
+
+/* Largest request whose block size still fits a 32-bit header */
+#define MAX_REQUEST         (0xFFFFFFF8UL - WSIZE)
+
+/*
+ * Pack a size and allocated bits into a word. Only free blocks have a
+ * footer; bit 1 of every header (PREV_ALLOC) tells whether the block
+ * before it is allocated, so its footer is never needed.
+ */
+#define PREV_ALLOC          0x2
 #define PACK(size, alloc)   ((size) | (alloc))
 
-/* Read and write a word at address p (4 bytes) */
-#define GET(p)              (*(unsigned int *)(p))
-#define PUT(p, val)         (*(unsigned int *)(p) = (val))
+/* Read and write a word at address p (4 bytes on every build) */
+#define GET(p)              (*(uint32_t *)(p))
+#define PUT(p, val)         (*(uint32_t *)(p) = (uint32_t)(val))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)         (GET(p) & ~0x7)
 #define GET_ALLOC(p)        (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p)   (GET(p) & PREV_ALLOC)
+
+/* A cached block's owner and size (header at p has OWNED set) */
+#define OWNED               0x4
+#define OWNER_SHIFT         16
+#define GET_OWNER(p)        (GET(p) >> OWNER_SHIFT)
+#define GET_CACHED_SIZE(p)  (GET(p) & 0xFFF8)
+#define TCACHE_BIN(size)    (((size) - TCACHE_MIN) / DSIZE)
+
+/* Whether p is in the heap (else a mapped block), and a mapped block's length */
+#define IN_HEAP(p)          ((uintptr_t)((char *)(p) - heap_base) \
+                             < __atomic_load_n(&heap_size, __ATOMIC_RELAXED))
+#define MAP_LEN(p)          (*(size_t *)((char *)(p) - DSIZE))
+#define PAGE_UP(p)          ((char *)(((uintptr_t)(p) + page_size - 1) & ~(uintptr_t)(page_size - 1)))
+#define PAGE_DOWN(p)        ((char *)((uintptr_t)(p) & ~(uintptr_t)(page_size - 1)))
+
+/*
+ * The run holding slab object p, if p is in one. Runs are aligned by
+ * address, so run_map counts aligned slices too, from the one holding
+ * heap_base: the heap itself need not start on a slice.
+ */
+#define RUN_INDEX(p)        (((uintptr_t)(p) >> RUN_SHIFT) - ((uintptr_t)heap_base >> RUN_SHIFT))
+#define IS_RUN(p)           run_map[RUN_INDEX(p)]
+#define RUN_OF(p)           ((run_t *)((uintptr_t)(p) & ~(uintptr_t)(RUN_SIZE - 1)))
+#define RUN_HDR             ALIGN(sizeof(run_t))
+
+/* Update the prev-allocated bit at address p (a header) */
+#define SET_PREV_ALLOC(p)   PUT(p, GET(p) | PREV_ALLOC)
+#define CLR_PREV_ALLOC(p)   PUT(p, GET(p) & ~PREV_ALLOC)
+
+/* Adjusted block size for a request: payload plus header, aligned */
+#define ASIZE(size)         MAX(MIN_BLOCK, ALIGN((size) + WSIZE))
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)            ((char *)(bp) - WSIZE)
 #define FTRP(bp)            ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
 
-/* Given block ptr bp, compute address of next and previous blocks */
+/* Given block ptr bp, compute address of next and previous blocks
+ * (PREV_BLKP reads the previous footer: only when that block is free) */
 #define NEXT_BLKP(bp)       ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
 #define PREV_BLKP(bp)       ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
 /* In a free block, we use the first two words of payload to hold
- * pointers to the previous and next free blocks, respectively. */
+ * the previous and next free blocks, respectively, as 32-bit offsets
+ * from heap_base. Offset 0 (the list heads) stands for NULL, so the
+ * links take 8 bytes and a free block 16 on 32- and 64-bit builds. */
+#define OFFSET(bp)          ((bp) ? (uint32_t)((char *)(bp) - heap_base) : 0)
+#define BLOCK(off)          ((off) ? heap_base + (off) : NULL)
+
 #define PREV_PTR(bp)        ((char *)(bp))
 #define NEXT_PTR(bp)        ((char *)(bp) + WSIZE)
-#define PREV(bp)            (*(char **)(PREV_PTR(bp)))
-#define NEXT(bp)            (*(char **)(NEXT_PTR(bp)))
+#define PREV(bp)            BLOCK(GET(PREV_PTR(bp)))
+#define NEXT(bp)            BLOCK(GET(NEXT_PTR(bp)))
+#define SET_PREV(bp, p)     PUT(PREV_PTR(bp), OFFSET(p))
+#define SET_NEXT(bp, p)     PUT(NEXT_PTR(bp), OFFSET(p))
+#define LIST_HEAD(idx)      BLOCK(seg_free_lists[idx])
+
+/* The start of a run; links are heap offsets */
+typedef struct {
+    uint32_t next, prev;                /* Runs of this class and owner with room */
+    uint32_t free;                      /* Freed objects, LIFO */
+    uint16_t bump;                      /* First never-used object (run offset) */
+    uint16_t size;                      /* Object size */
+    uint16_t used;                      /* Objects handed out */
+    uint16_t cls;
+    uint32_t owner;                     /* Owner id, 0 for the central heap */
+} run_t;
+
+/* A thread cache: bins and the remote list hold block offsets, linked
+ * through the first payload word (the remote list takes slab objects
+ * too) */
+typedef struct {
+    uint32_t bins[TCACHE_BINS];         /* Cached blocks per size, LIFO */
+    uint16_t counts[TCACHE_BINS];
+    uint32_t runs[SLAB_CLASSES];        /* This thread's runs with room */
+    uint32_t remote;                    /* Blocks freed by other threads */
+    uint32_t id;                        /* Slot in tcache_table */
+    int in_use;                         /* Held by a live thread */
+} tcache_t;
 
 /* Global variables */
-static char **seg_free_lists; /* Array of pointers to segregated free lists */
+static char *heap_base; /* Start of the heap: offsets count from here */
+static size_t heap_size; /* Bytes from heap_base to past the epilogue */
+static size_t page_size;
+static size_t mmap_min; /* Smallest request given its own mapping */
+static size_t mapped_bytes; /* Total length of the large blocks' mappings */
+static size_t trim_pending; /* Bytes freed since the last trim_heap */
+static uint32_t *seg_free_lists; /* Offsets of the segregated free list heads */
+static uint32_t *seg_sl_bitmap; /* Per first level: non-empty lists */
+static uint32_t seg_fl_bitmap; /* First levels with a non-empty list */
+static uint32_t *tcache_table; /* Offsets of the thread caches, by owner id */
+static uint32_t *slab_lists; /* The central heap's runs with room, by class */
+static unsigned char *run_map; /* Per RUN_SIZE of heap: part of a run */
+static int check_errors; /* Found by the current mm_checkheap */
+
+/* The central heap (everything above except tcache_t contents) is
+ * only touched under heap_lock */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key; /* Releases a thread's cache at exit */
+static unsigned int heap_gen; /* Bumped by mm_init: older caches are gone */
+static int heap_shared; /* Set once two threads have attached caches */
+static __thread tcache_t *tcache_self;
+static __thread unsigned int tcache_gen;
 
 /* Function prototypes for internal helper routines */
 static void insert_node(void *bp, size_t size);
@@ -65,61 +264,75 @@ static void delete_node(void *bp);
 static void *extend_heap(size_t words);
 static void *coalesce(void *bp);
 static void *find_fit(size_t asize);
+static void *best_fit(char *bp, size_t asize);
+static int next_list(int idx);
 static void *place(void *bp, size_t asize);
 static inline int get_list_index(size_t size);
+static void *alloc_block(size_t asize);
+static void free_block(void *bp);
+static tcache_t *tcache_get(void);
+static tcache_t *tcache_attach(void);
+static void tcache_key_init(void);
+static void tcache_release(void *arg);
+static void *tcache_alloc(tcache_t *tc, size_t asize);
+static void *tcache_refill(tcache_t *tc, size_t asize);
+static void tcache_free(tcache_t *tc, void *bp);
+static void tcache_flush(tcache_t *tc, int bin, int keep);
+static void tcache_drain(tcache_t *tc);
+static void remote_free(tcache_t *tc, void *bp);
+static void uncache(void *bp);
+static inline int slab_class(size_t size);
+static void *slab_alloc(uint32_t *lists, int cls, uint32_t owner);
+static void slab_free(run_t *run, void *p);
+static run_t *new_run(int cls, uint32_t owner);
+static char *run_start(char *bp);
+static void *run_fit(void);
+static void unlink_run(uint32_t *lists, run_t *run);
+static uint32_t *run_lists(run_t *run);
+static void *mmap_alloc(size_t size);
+static void mmap_free(void *bp);
+static void *mmap_realloc(void *bp, size_t size);
+static void *resize_block(char *bp, size_t asize, size_t copy);
+static void trim_heap(void);
+static void check_fail(const void *p, const char *msg);
+static int check_run(run_t *run, size_t size, mm_profile_t *prof);
+static size_t check_run_lists(uint32_t *lists, uint32_t owner, size_t nruns);
 
 /*================================================================
  * get_list_index
  *
- * Determine the index of the segregated free list
+ *  Determine the index of the segregated free list without a loop
+ *  or branch. In double words w = size / DSIZE with top bit f, the
+ *  list is (f - SL_SHIFT) * SL_CNT plus the SL_SHIFT + 1 leading
+ *  bits of w. Or-ing SL_CNT into w makes every w < SMALL_BINS
+ *  its own list. The first level of list i is i >> SL_SHIFT.
  *================================================================*/
 static inline int get_list_index(size_t size) {
-    int idx = 0;
-    while (idx < (SEGLIST_CNT - 1) && (size > 1)) {
-        size >>= 1;
-        idx++;
-    }
-    return idx;
+    uint32_t w = size / DSIZE;
+    int f = 31 - __builtin_clz(w | SL_CNT);
+
+    return ((f - SL_SHIFT) << SL_SHIFT) + (w >> (f - SL_SHIFT));
 }
 
 /*================================================================
  * insert_node
  *
- *  Insert a free block `bp` of given `size` into the appropriate
- *  segregated free list (sorted in descending order by block size).
- *  We first determine which list index to use, then traverse that
- *  list until we find the correct spot so that larger‐blocks appear
- *  earlier (head) and smaller‐blocks appear later (tail).
+ *  Push a free block `bp` of given `size` onto the head of its
+ *  segregated free list and mark the list non-empty. Lists are
+ *  unordered (LIFO), so this is O(1).
  *================================================================*/
 static void insert_node(void *bp, size_t size) {
-    int idx = 0;
-    size_t size_class = size;
-
-    idx = get_list_index(size_class);
-
-    /* Head of the chosen list */
-    char *curr = seg_free_lists[idx];
-    char *prev = NULL;
-
-    /* Traverse until we find a block equal or bigger than `size` */
-    while (curr && GET_SIZE(HDRP(curr)) < size) {
-        prev = curr;
-        curr = NEXT(curr);
-    }
+    int idx = get_list_index(size);
+    char *head = LIST_HEAD(idx);
 
-    /* Insert bp between prev and curr */
-    PREV(bp) = prev;
-    NEXT(bp) = curr;
-    if (prev) {
-        NEXT(prev) = bp;
-    } else {
-        /* Inserting at head of this list */
-        seg_free_lists[idx] = bp;
-    }
-    
-    if (curr) {
-        PREV(curr) = bp;
+    SET_PREV(bp, NULL);
+    SET_NEXT(bp, head);
+    if (head) {
+        SET_PREV(head, bp);
     }
+    seg_free_lists[idx] = OFFSET(bp);
+    seg_sl_bitmap[idx >> SL_SHIFT] |= 1U << (idx & (SL_CNT - 1));
+    seg_fl_bitmap |= 1U << (idx >> SL_SHIFT);
 }
 
 /*================================================================
@@ -139,14 +352,21 @@ static void delete_node(void *bp) {
     char *next = NEXT(bp);
 
     if (prev) {
-        NEXT(prev) = next;
+        SET_NEXT(prev, next);
     } else {
         /* bp was head of this list */
-        seg_free_lists[idx] = next;
+        seg_free_lists[idx] = OFFSET(next);
+        if (next == NULL) {
+            int fl = idx >> SL_SHIFT;
+            seg_sl_bitmap[fl] &= ~(1U << (idx & (SL_CNT - 1)));
+            if (seg_sl_bitmap[fl] == 0) {
+                seg_fl_bitmap &= ~(1U << fl);
+            }
+        }
     }
 
     if (next) {
-        PREV(next) = prev;
+        SET_PREV(next, prev);
     }
 }
 
@@ -154,7 +374,9 @@ static void delete_node(void *bp) {
  * mm_init
  *
  *  Initialize the heap and segregated free lists. We allocate
- *  space for SEGLIST_CNT pointers (each 4 bytes), then set up
+ *  space for SEGLIST_CNT list heads, FL_CNT bitmaps, MAX_THREADS
+ *  cache slots and SLAB_CLASSES run lists (each 4 bytes) at
+ *  heap_base, and map (or clear) run_map, then set up
  *  a small prologue block (8 bytes) and an epilogue header. After
  *  that, we extend the heap by CHUNKSIZE bytes to create the
  *  first free block.
@@ -162,31 +384,67 @@ static void delete_node(void *bp) {
 int mm_init(void) {
     void *heap_start;
 
-    /* Allocate space for SEGLIST_CNT pointers + 4 words of prologue */
-    if ((heap_start = mem_sbrk((SEGLIST_CNT + 4) * sizeof(char*))) == (void *)-1) {
+    /* Allocate space for the list heads and bitmaps + 4 words of prologue */
+    if ((heap_start = mem_sbrk(LISTS_SIZE + 4 * WSIZE)) == (void *)-1) {
         return -1;
     }
 
     /* seg_free_lists points to the start of that region */
-    seg_free_lists = (char **)heap_start;
+    heap_base = heap_start;
+    seg_free_lists = (uint32_t *)heap_start;
+    seg_sl_bitmap = seg_free_lists + SEGLIST_CNT;
+
+    /* Heap bounds and the large-block thresholds */
+    __atomic_store_n(&heap_size, LISTS_SIZE + 4 * WSIZE, __ATOMIC_RELAXED);
+    page_size = sysconf(_SC_PAGESIZE);
+    __atomic_store_n(&mmap_min, MMAP_MIN, __ATOMIC_RELAXED);
+    trim_pending = 0;
 
-    /* Initialize all list heads to NULL */
+    /* Initialize all list heads to NULL and all lists to empty */
     for (int i = 0; i < SEGLIST_CNT; i++) {
-        seg_free_lists[i] = NULL;
+        seg_free_lists[i] = 0;
+    }
+    for (int i = 0; i < FL_CNT; i++) {
+        seg_sl_bitmap[i] = 0;
     }
+    seg_fl_bitmap = 0;
 
-    /* The first address after those SEGLIST_CNT pointers is our "heap_listp" */
-    char *heap_listp = (char *)heap_start + SEGLIST_CNT * sizeof(char*);
+    /* No thread caches yet; those of a previous heap are void */
+    tcache_table = seg_sl_bitmap + FL_CNT;
+    for (int i = 0; i < MAX_THREADS; i++) {
+        tcache_table[i] = 0;
+    }
+    heap_shared = 0;
+
+    /* No runs yet */
+    slab_lists = tcache_table + MAX_THREADS;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        slab_lists[i] = 0;
+    }
+    if (run_map == NULL) {
+        void *map = mmap(NULL, RUN_MAP_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        run_map = map;
+    } else {
+        madvise(run_map, RUN_MAP_SIZE, MADV_DONTNEED); /* Zero it */
+    }
+    __atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
+
+    /* The first address after the lists is our "heap_listp" */
+    char *heap_listp = (char *)heap_start + LISTS_SIZE;
 
     /* Alignment padding */
     PUT(heap_listp, 0);                            /* (0) Alignment padding */
 
     /* Prologue header and footer (each 4 bytes, total payload = 8) */
-    PUT(heap_listp + WSIZE, PACK(DSIZE, 1));       /* (1) Prologue header: size=8, alloc=1 */
+    PUT(heap_listp + WSIZE, PACK(DSIZE, PREV_ALLOC | 1));  /* (1) Prologue header: size=8, alloc=1 */
     PUT(heap_listp + 2 * WSIZE, PACK(DSIZE, 1));   /* (2) Prologue footer: size=8, alloc=1 */
 
     /* Epilogue header */
-    PUT(heap_listp + 3 * WSIZE, PACK(0, 1));       /* (3) Epilogue header: size=0, alloc=1 */
+    PUT(heap_listp + 3 * WSIZE, PACK(0, PREV_ALLOC | 1));  /* (3) Epilogue header: size=0, alloc=1 */
 
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
     if (extend_heap(CHUNKSIZE / WSIZE) == NULL) {
@@ -201,7 +459,8 @@ int mm_init(void) {
  *
  *  Extend the heap by `words * WSIZE` bytes. We always allocate
  *  an even number of words to maintain alignment. We set up the
- *  new free block’s header/footer, plus a new epilogue header.
+ *  new free block’s header/footer in place of the old epilogue
+ *  (keeping its prev-allocated bit), plus a new epilogue header.
  *  Finally, we coalesce with the previous block (if it was free),
  *  then insert the resulting block into the segregated lists.
  *================================================================*/
@@ -211,15 +470,16 @@ static void *extend_heap(size_t words) {
 
     /* Allocate an even number of words to maintain alignment (round up) */
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-    if ((long)(bp = mem_sbrk(size)) == -1) {
+    if (size > INT32_MAX || (long)(bp = mem_sbrk(size)) == -1) {
         return NULL;
     }
+    __atomic_store_n(&heap_size, heap_size + size, __ATOMIC_RELAXED);
 
     /* Initialize free block header/footer */
-    PUT(HDRP(bp), PACK(size, 0));       /* Free block header */
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));  /* Free block header */
     PUT(FTRP(bp), PACK(size, 0));       /* Free block footer */
 
-    /* New epilogue header */
+    /* New epilogue header (previous block is free) */
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));
 
     /* Coalesce with previous if possible */
@@ -238,15 +498,18 @@ static void *extend_heap(size_t words) {
  *  remove them from their free lists, merge sizes, write new header/
  *  footer, and return the pointer to the coalesced block. This
  *  function does NOT insert the result back, caller must insert.
+ *  The previous block's status comes from bp's prev-allocated bit;
+ *  its footer is only read when it is free. The block before a
+ *  free block is always allocated, so the merged header keeps
+ *  PREV_ALLOC set.
  *================================================================*/
 static void *coalesce(void *bp) {
-    /* Compute prev/next block pointers just once */
-    char *prev_bp = PREV_BLKP(bp);
     char *next_bp = NEXT_BLKP(bp);
+    char *prev_bp;
 
     /* Check their allocation status */
-    size_t prev_alloc = GET_ALLOC(HDRP(PREV_BLKP(bp)));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(next_bp));
     size_t size = GET_SIZE(HDRP(bp)); /* Current block's size */
 
     /* Case 1: both previous and next blocks are allocated -> no coalescing */
@@ -260,12 +523,14 @@ static void *coalesce(void *bp) {
         delete_node(next_bp);
 
         size += GET_SIZE(HDRP(next_bp));
-        PUT(HDRP(bp), PACK(size, 0));
+        PUT(HDRP(bp), PACK(size, PREV_ALLOC));
         PUT(FTRP(bp), PACK(size, 0));
 
         return bp;
     }
 
+    prev_bp = PREV_BLKP(bp);
+
     /* Case 3: prev free, next allocated -> merge with prev only */
     if (!prev_alloc && next_alloc) {
         /* Remove previous block from its free list */
@@ -273,7 +538,7 @@ static void *coalesce(void *bp) {
 
         size += GET_SIZE(HDRP(prev_bp));
         PUT(FTRP(bp), PACK(size, 0));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+        PUT(HDRP(prev_bp), PACK(size, PREV_ALLOC));
         
         return prev_bp;
     }
@@ -285,7 +550,7 @@ static void *coalesce(void *bp) {
         delete_node(next_bp);
 
         size += GET_SIZE(HDRP(prev_bp)) + GET_SIZE(HDRP(next_bp));
-        PUT(HDRP(prev_bp), PACK(size, 0));
+        PUT(HDRP(prev_bp), PACK(size, PREV_ALLOC));
         PUT(FTRP(next_bp), PACK(size, 0));
         
         return prev_bp;
@@ -297,32 +562,82 @@ static void *coalesce(void *bp) {
 /*================================================================
  * find_fit
  *
- *  Search for a free block of at least asize bytes. 
- *  1. Compute the starting list index by repeatedly halving `asize`. 
- *  2. From that index onward, scan each free list:
- *     - Traverse the chain of free blocks (which are sorted by size descending).
- *     - If a block’s size ≥ asize, return it immediately.
- *  3. If no block is big enough, return NULL.
+ *  Search for a free block of at least asize bytes.
+ *  1. A small size has an exact bin, so any block in it fits.
+ *     A large size shares its bin with smaller blocks: look for
+ *     the best fit among the first FIT_SCAN blocks there.
+ *  2. Otherwise every block in a higher non-empty list fits.
+ *     The first one comes from the bitmaps (next_list); take the
+ *     best of its first FIT_SCAN blocks.
+ *  3. If no list above is non-empty, return NULL.
  *================================================================*/
 static void *find_fit(size_t asize) {
-    /* 1) Determine starting list index */
-    int idx = 0;
-    size_t size_class = asize;
+    int idx = get_list_index(asize);
+    char *bp;
 
-    idx = get_list_index(size_class);
+    /* 1) The list asize maps to */
+    if (idx < SMALL_BINS) {
+        if ((bp = LIST_HEAD(idx)) != NULL) {
+            return bp;
+        }
+    } else if ((bp = best_fit(LIST_HEAD(idx), asize)) != NULL) {
+        return bp;
+    }
 
-    /* 2) Scan from list[idx] up to the last list */
-    for (int i = idx; i < SEGLIST_CNT; i++) {
-        for (char *bp = seg_free_lists[i]; bp != NULL; bp = NEXT(bp)) {
-            if (GET_SIZE(HDRP(bp)) >= asize) {
-                /* Found a large enough block */
-                return bp;
-            }
+    /* 2) Smallest non-empty list above it */
+    if ((idx = next_list(idx + 1)) < 0) {
+        return NULL;
+    }
+    bp = LIST_HEAD(idx);
+    return idx < SMALL_BINS ? bp : best_fit(bp, asize);
+}
+
+/*================================================================
+ * next_list
+ *
+ *  Return the first non-empty list at or after idx, or -1: one
+ *  find-first-set in the second-level bitmap of idx's first level,
+ *  and if that has none, one in the first-level bitmap.
+ *================================================================*/
+static int next_list(int idx) {
+    int fl = idx >> SL_SHIFT;
+    uint32_t map = 0;
+
+    if (fl < FL_CNT) {
+        map = seg_sl_bitmap[fl] & (~0U << (idx & (SL_CNT - 1)));
+    }
+    if (map == 0) {
+        uint32_t fl_map = fl + 1 < 32 ? seg_fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (fl_map == 0) {
+            return -1;
         }
+        fl = __builtin_ctz(fl_map);
+        map = seg_sl_bitmap[fl];
     }
+    return (fl << SL_SHIFT) + __builtin_ctz(map);
+}
 
-    /* No fit found */
-    return NULL;
+/*================================================================
+ * best_fit
+ *
+ *  Return the smallest block of at least asize bytes among the
+ *  first FIT_SCAN blocks of the list starting at bp, or NULL.
+ *================================================================*/
+static void *best_fit(char *bp, size_t asize) {
+    char *best = NULL;
+    size_t best_size = 0;
+
+    for (int n = 0; bp != NULL && n < FIT_SCAN; bp = NEXT(bp), n++) {
+        size_t size = GET_SIZE(HDRP(bp));
+        if (size >= asize && (best == NULL || size < best_size)) {
+            best = bp;
+            best_size = size;
+            if (size == asize) {
+                break;
+            }
+        }
+    }
+    return best;
 }
 
 /*================================================================
@@ -339,18 +654,20 @@ static void *find_fit(size_t asize) {
  *     create a small “remainder” free block at the beginning of `bp`,
  *     and allocate the tail end of `bp` for `asize` bytes:
  *       - Write a free header/footer of size = remainder at `bp`
- *       - Write an allocated header/footer of size = asize at NEXT_BLKP(bp)
+ *       - Write an allocated header of size = asize at NEXT_BLKP(bp)
  *       - Insert the small free block (at `bp`, size=remainder) back into its free list
  *       - Return a pointer to the allocated chunk (NEXT_BLKP(bp))
  *
  *  Case 3) Otherwise (remainder > 340 bytes), split normally:
- *       - Write an allocated header/footer of size = asize at `bp`
+ *       - Write an allocated header of size = asize at `bp`
  *       - Create a free block at NEXT_BLKP(bp) with size = remainder
  *       - Insert the new free block into its free list
  *       - Return `bp`
  *
  *  In all cases, the returned pointer points to the start of the
- *  allocated payload (not the free-list metadata).
+ *  allocated payload (not the free-list metadata). Allocated blocks
+ *  get no footer; the block after the allocated one gets PREV_ALLOC.
+ *  `bp` is free, so the block before it is allocated.
  *================================================================*/
 static void *place(void *bp, size_t asize) {
     size_t ptr_size = GET_SIZE(HDRP(bp));
@@ -359,22 +676,22 @@ static void *place(void *bp, size_t asize) {
     /* Remove this block from free list */
     delete_node(bp);
 
-    /* Case 1: remainder < minimum split size (16 bytes) */
-    if (remainder < 2 * DSIZE) {
+    /* Case 1: remainder < minimum block size (16 bytes) */
+    if (remainder < MIN_BLOCK) {
         /* Mark entire block allocated */
-        PUT(HDRP(bp), PACK(ptr_size, 1));
-        PUT(FTRP(bp), PACK(ptr_size, 1));
+        PUT(HDRP(bp), PACK(ptr_size, PREV_ALLOC | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
         return bp;
     }
     /* Case 2: small remainder (16 ≤ remainder ≤ 340) */
     else if (remainder <= 340) {
         /* Create a free block at the front of size = remainder */
-        PUT(HDRP(bp), PACK(remainder, 0));
+        PUT(HDRP(bp), PACK(remainder, PREV_ALLOC));
         PUT(FTRP(bp), PACK(remainder, 0));
         /* Allocate tail end of the block for asize bytes */
         char *alloc_bp = NEXT_BLKP(bp);
         PUT(HDRP(alloc_bp), PACK(asize, 1));
-        PUT(FTRP(alloc_bp), PACK(asize, 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(alloc_bp)));
         /* Insert the small free block (at `bp`) back into free list */
         insert_node(bp, remainder);
         return alloc_bp;
@@ -382,11 +699,10 @@ static void *place(void *bp, size_t asize) {
     /* Case 3: normal split (remainder > 340) */
     else {
         /* Allocate first asize bytes */
-        PUT(HDRP(bp), PACK(asize, 1));
-        PUT(FTRP(bp), PACK(asize, 1));
+        PUT(HDRP(bp), PACK(asize, PREV_ALLOC | 1));
         /* Create a free block for the leftover */
         char *next_bp = NEXT_BLKP(bp);
-        PUT(HDRP(next_bp), PACK(remainder, 0));
+        PUT(HDRP(next_bp), PACK(remainder, PREV_ALLOC));
         PUT(FTRP(next_bp), PACK(remainder, 0));
         /* Insert the leftover free block into free list */
         insert_node(next_bp, remainder);
@@ -396,69 +712,735 @@ static void *place(void *bp, size_t asize) {
 
 
 /*================================================================
- * mm_malloc
+ * alloc_block
  *
- *  If size == 0, return NULL. Otherwise, compute adjusted block size
- *  `asize` = max(2*DSIZE, aligned(size + DSIZE)). Then search for a fit
- *  in the segregated lists. If found, call place() and return pointer.
- *  If no fit, extend the heap by max(asize, CHUNKSIZE) and then place.
+ *  Allocate a block of asize bytes from the central heap (caller
+ *  holds heap_lock). Search for a fit in the segregated lists; if
+ *  none, extend the heap by max(asize, CHUNKSIZE). Then place().
  *================================================================*/
-void *mm_malloc(size_t size) {
-    /* Ignore the size == 0 request */
-    if (size == 0) {
-        return NULL;
-    }
-
-    /* Compute asize = aligned(size + DSIZE) with minimum of 2*DSIZE */
-    size_t asize = (size <= DSIZE) ? (2 * DSIZE) : ALIGN(size + DSIZE);
-
+static void *alloc_block(size_t asize) {
     /* Search for a fit in the segregated free lists */
     char *bp = find_fit(asize);
     if (bp == NULL) {
         /* No fit found, extend heap by max(asize, CHUNKSIZE) */
         size_t extend_bytes = MAX(asize, CHUNKSIZE);
-        //size_t extend_bytes = (asize < 512 ? 512 : asize);
         if ((bp = extend_heap(extend_bytes / WSIZE)) == NULL) return NULL;
     }
 
     /* place the block and return the (possibly split) block pointer */
-    bp = place(bp, asize);
-    return bp;
+    return place(bp, asize);
 }
 
 /*================================================================
- * mm_free
+ * free_block
  *
- *  Free a block: set its header/footer to “free,” coalesce, then
- *  insert the coalesced block into the segregated free lists.
+ *  Return a block to the central heap (caller holds heap_lock): set
+ *  its header to “free,” write its footer, clear the next block's
+ *  prev-allocated bit, coalesce, then insert the coalesced block
+ *  into the segregated free lists. Every TRIM_EVERY bytes, trim.
  *================================================================*/
-void mm_free(void *bp) {
-    if (bp == NULL) return;
-
+static void free_block(void *bp) {
     size_t size = GET_SIZE(HDRP(bp));
 
     /* Mark header/footer as free */
-    PUT(HDRP(bp), PACK(size, 0));
+    PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
     PUT(FTRP(bp), PACK(size, 0));
+    CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
 
     /* Coalesce with neighbors and insert into free list */
     char *merged_bp = coalesce(bp);
 
     /* Insert the coalesced block into the segregated free list */
     insert_node(merged_bp, GET_SIZE(HDRP(merged_bp)));
+
+    /* Now and then, give the pages of large free blocks back */
+    if ((trim_pending += size) >= TRIM_EVERY) {
+        trim_pending = 0;
+        trim_heap();
+    }
+}
+
+/*================================================================
+ * tcache_get
+ *
+ *  Return the calling thread's cache, attaching one on its first
+ *  use of this heap. NULL if every owner id is taken: the thread
+ *  then goes to the central heap for everything.
+ *================================================================*/
+static tcache_t *tcache_get(void) {
+    if (tcache_gen == __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) {
+        return tcache_self;
+    }
+    return tcache_attach();
+}
+
+/*================================================================
+ * tcache_attach
+ *
+ *  Adopt the cache of a thread that exited (with its id, and any
+ *  blocks freed to it since), or carve a new one from the heap.
+ *================================================================*/
+static tcache_t *tcache_attach(void) {
+    tcache_t *tc = NULL;
+    int id;
+
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_mutex_lock(&heap_lock);
+    for (id = 1; id < MAX_THREADS && tcache_table[id]; id++) {
+        tc = (tcache_t *)BLOCK(tcache_table[id]);
+        if (!tc->in_use) {
+            break;
+        }
+        tc = NULL;
+    }
+    if (tc == NULL && id < MAX_THREADS
+        && (tc = alloc_block(ASIZE(sizeof(tcache_t)))) != NULL) {
+        memset(tc, 0, sizeof(tcache_t));
+        tc->id = id;
+        tcache_table[id] = OFFSET(tc);
+    }
+    if (tc) {
+        tc->in_use = 1;
+    }
+    if (id > 1) {
+        __atomic_store_n(&heap_shared, 1, __ATOMIC_RELAXED);
+    }
+    tcache_gen = heap_gen;
+    pthread_mutex_unlock(&heap_lock);
+
+    tcache_self = tc;
+    pthread_setspecific(tcache_key, tc);
+    return tc;
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_release);
+}
+
+/*================================================================
+ * tcache_release
+ *
+ *  Thread exit: give every cached block back to the central heap and
+ *  leave the cache, with its runs, for the next thread to adopt.
+ *  Blocks other threads free to it meanwhile wait on its remote list.
+ *================================================================*/
+static void tcache_release(void *arg) {
+    tcache_t *tc = arg;
+
+    if (tcache_gen != __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE)) {
+        return; /* The heap it lived in is gone */
+    }
+    tcache_drain(tc);
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache_flush(tc, bin, 0);
+    }
+    pthread_mutex_lock(&heap_lock);
+    tc->in_use = 0;
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*================================================================
+ * tcache_alloc
+ *
+ *  Pop a block of asize bytes (asize <= TCACHE_MAX) from the cache.
+ *  An empty bin is first refilled from the remote list, then from
+ *  the central heap.
+ *================================================================*/
+static void *tcache_alloc(tcache_t *tc, size_t asize) {
+    int bin = TCACHE_BIN(asize);
+    char *bp = BLOCK(tc->bins[bin]);
+
+    if (bp == NULL && __atomic_load_n(&tc->remote, __ATOMIC_RELAXED)) {
+        tcache_drain(tc);
+        bp = BLOCK(tc->bins[bin]);
+    }
+    if (bp == NULL) {
+        return tcache_refill(tc, asize);
+    }
+    tc->bins[bin] = GET(bp);
+    tc->counts[bin]--;
+    return bp;
+}
+
+/*================================================================
+ * tcache_refill
+ *
+ *  Take one block of TCACHE_REFILL * asize bytes from the central
+ *  heap and cut it into owned blocks of asize bytes. The last one
+ *  (with any slack place() left) goes to the caller, the rest to
+ *  the bin.
+ *================================================================*/
+static void *tcache_refill(tcache_t *tc, size_t asize) {
+    int bin = TCACHE_BIN(asize);
+    uint32_t owner = OWNED | tc->id << OWNER_SHIFT;
+    char *bp, *last;
+    size_t size;
+
+    pthread_mutex_lock(&heap_lock);
+    if ((bp = alloc_block(TCACHE_REFILL * asize)) == NULL) {
+        pthread_mutex_unlock(&heap_lock);
+        return NULL;
+    }
+    size = GET_SIZE(HDRP(bp));
+    last = bp + (TCACHE_REFILL - 1) * asize;
+    for (char *p = bp; p < last; p += asize) {
+        PUT(HDRP(p), PACK(asize, (p == bp ? GET_PREV_ALLOC(HDRP(p)) : PREV_ALLOC) | owner | 1));
+        PUT(p, tc->bins[bin]);
+        tc->bins[bin] = OFFSET(p);
+    }
+    size -= last - bp;
+    PUT(HDRP(last), PACK(size, PREV_ALLOC | (size <= TCACHE_MAX ? owner : 0) | 1));
+    pthread_mutex_unlock(&heap_lock);
+
+    tc->counts[bin] += TCACHE_REFILL - 1;
+    return last;
+}
+
+/*================================================================
+ * tcache_free
+ *
+ *  Push one of tc's own blocks on its bin, trimming an overfull bin.
+ *================================================================*/
+static void tcache_free(tcache_t *tc, void *bp) {
+    int bin = TCACHE_BIN(GET_CACHED_SIZE(HDRP(bp)));
+
+    PUT(bp, tc->bins[bin]);
+    tc->bins[bin] = OFFSET(bp);
+    if (++tc->counts[bin] > TCACHE_COUNT) {
+        tcache_flush(tc, bin, TCACHE_COUNT / 2);
+    }
+}
+
+/*================================================================
+ * tcache_flush
+ *
+ *  Give all but `keep` blocks of a bin back to the central heap,
+ *  under one lock.
+ *================================================================*/
+static void tcache_flush(tcache_t *tc, int bin, int keep) {
+    if (tc->counts[bin] <= keep) {
+        return;
+    }
+    pthread_mutex_lock(&heap_lock);
+    while (tc->counts[bin] > keep) {
+        char *bp = BLOCK(tc->bins[bin]);
+        tc->bins[bin] = GET(bp);
+        tc->counts[bin]--;
+        uncache(bp);
+    }
+    pthread_mutex_unlock(&heap_lock);
+}
+
+/*================================================================
+ * tcache_drain
+ *
+ *  Move every block on tc's remote list to its bin, or its run for
+ *  a slab object. The owner is
+ *  the only thread taking from the list, and takes all of it at
+ *  once, so pushes and this exchange never race on a node (no ABA).
+ *================================================================*/
+static void tcache_drain(tcache_t *tc) {
+    uint32_t head = __atomic_exchange_n(&tc->remote, 0, __ATOMIC_ACQUIRE);
+    char *bp = BLOCK(head);
+
+    while (bp != NULL) {
+        char *next = BLOCK(GET(bp));
+
+        if (IS_RUN(bp)) {
+            slab_free(RUN_OF(bp), bp);
+        } else {
+            int bin = TCACHE_BIN(GET_CACHED_SIZE(HDRP(bp)));
+            PUT(bp, tc->bins[bin]);
+            tc->bins[bin] = OFFSET(bp);
+            tc->counts[bin]++;
+        }
+        bp = next;
+    }
+    for (int bin = 0; bin < TCACHE_BINS; bin++) {
+        if (tc->counts[bin] > TCACHE_COUNT) {
+            tcache_flush(tc, bin, TCACHE_COUNT);
+        }
+    }
+}
+
+/*================================================================
+ * remote_free
+ *
+ *  Push a block (or slab object) owned by another thread's cache on
+ *  its remote list.
+ *================================================================*/
+static void remote_free(tcache_t *tc, void *bp) {
+    uint32_t head = __atomic_load_n(&tc->remote, __ATOMIC_RELAXED);
+
+    do {
+        PUT(bp, head);
+    } while (!__atomic_compare_exchange_n(&tc->remote, &head, OFFSET(bp), 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*================================================================
+ * uncache
+ *
+ *  Turn a cached block back into a plain allocated block and free
+ *  it to the central heap (caller holds heap_lock).
+ *================================================================*/
+static void uncache(void *bp) {
+    PUT(HDRP(bp), PACK(GET_CACHED_SIZE(HDRP(bp)), GET_PREV_ALLOC(HDRP(bp)) | 1));
+    free_block(bp);
+}
+
+/*================================================================
+ * slab_class
+ *
+ *  Map a request of 1..SLAB_MAX bytes to its class.
+ *================================================================*/
+static inline int slab_class(size_t size) {
+    return (size - 1) >> 3;
+}
+
+/*================================================================
+ * slab_alloc
+ *
+ *  Take an object of class cls from the first run in lists[cls],
+ *  starting a new run if there is none. The caller has exclusive
+ *  use of lists: it holds heap_lock for the central heap's
+ *  (owner 0), or owns the thread cache they belong to.
+ *================================================================*/
+static void *slab_alloc(uint32_t *lists, int cls, uint32_t owner) {
+    run_t *run = (run_t *)BLOCK(lists[cls]);
+    char *p;
+
+    if (run == NULL) {
+        if (owner) {
+            pthread_mutex_lock(&heap_lock);
+        }
+        run = new_run(cls, owner);
+        if (owner) {
+            pthread_mutex_unlock(&heap_lock);
+        }
+        if (run == NULL) {
+            return NULL;
+        }
+        lists[cls] = OFFSET(run);
+    }
+
+    if ((p = BLOCK(run->free)) != NULL) {
+        run->free = GET(p);
+    } else {
+        p = (char *)run + run->bump;
+        run->bump += run->size;
+    }
+    run->used++;
+
+    /* Full: off the list until an object comes back */
+    if (run->free == 0 && run->bump + run->size > RUN_END) {
+        unlink_run(lists, run);
+    }
+    return p;
+}
+
+/*================================================================
+ * slab_free
+ *
+ *  Return object p to its run (same exclusive use as slab_alloc).
+ *  A run that was full rejoins its list; a run left empty goes back
+ *  to the heap if its list has another run.
+ *================================================================*/
+static void slab_free(run_t *run, void *p) {
+    uint32_t *lists = run_lists(run);
+    int was_full = run->free == 0 && run->bump + run->size > RUN_END;
+
+    PUT(p, run->free);
+    run->free = OFFSET(p);
+    run->used--;
+
+    if (was_full) {
+        run->prev = 0;
+        run->next = lists[run->cls];
+        if (run->next) {
+            ((run_t *)BLOCK(run->next))->prev = OFFSET(run);
+        }
+        lists[run->cls] = OFFSET(run);
+    } else if (run->used == 0 && (run->next || run->prev)) {
+        uint32_t owner = run->owner;
+
+        unlink_run(lists, run);
+        if (owner) {
+            pthread_mutex_lock(&heap_lock);
+        }
+        IS_RUN(run) = 0;
+        free_block(run);
+        if (owner) {
+            pthread_mutex_unlock(&heap_lock);
+        }
+    }
+}
+
+/*================================================================
+ * new_run
+ *
+ *  Carve a RUN_SIZE-aligned run out of the heap (caller holds
+ *  heap_lock): from a free block with an aligned window in it
+ *  (run_fit), or else from one big enough to hold a run wherever it
+ *  starts. The block is cut in up to three: the gap before the run
+ *  and the slack after it, if at least MIN_BLOCK, are freed again.
+ *================================================================*/
+static run_t *new_run(int cls, uint32_t owner) {
+    char *bp, *run;
+    size_t size, gap, tail;
+    run_t *r;
+
+    if ((bp = run_fit()) == NULL
+        && (bp = alloc_block(2 * RUN_SIZE + MIN_BLOCK)) == NULL) {
+        return NULL;
+    }
+    size = GET_SIZE(HDRP(bp));
+    run = run_start(bp);
+    gap = run - bp;
+    tail = size - gap - RUN_BLOCK;
+    if (tail < MIN_BLOCK) {
+        tail = 0;
+    }
+
+    /* Write all the headers as allocated, then free the pieces */
+    if (gap) {
+        PUT(HDRP(bp), PACK(gap, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        PUT(HDRP(run), PACK(size - gap - tail, PREV_ALLOC | 1));
+    } else {
+        PUT(HDRP(run), PACK(size - tail, GET_PREV_ALLOC(HDRP(run)) | 1));
+    }
+    if (tail) {
+        PUT(HDRP(NEXT_BLKP(run)), PACK(tail, PREV_ALLOC | 1));
+        free_block(NEXT_BLKP(run));
+    }
+    if (gap) {
+        free_block(bp);
+    }
+
+    r = (run_t *)run;
+    memset(r, 0, sizeof(run_t));
+    r->bump = RUN_HDR;
+    r->size = SLAB_SIZE(cls);
+    r->cls = cls;
+    r->owner = owner;
+    IS_RUN(run) = 1;
+    return r;
+}
+
+/* run_start - The first run address in block bp that leaves no
+ * gap, or one of at least MIN_BLOCK, before it */
+static char *run_start(char *bp) {
+    char *run = (char *)(((uintptr_t)bp + RUN_SIZE - 1) & ~(uintptr_t)(RUN_SIZE - 1));
+
+    if (run != bp && run - bp < MIN_BLOCK) {
+        run += RUN_SIZE;
+    }
+    return run;
+}
+
+/*================================================================
+ * run_fit
+ *
+ *  Look for a free block too small for new_run's fallback request
+ *  that still holds an aligned run: a freed run, or one merged with
+ *  its neighbors. Scan the first FIT_SCAN blocks of each list in
+ *  between; take the block off its list and mark it allocated.
+ *================================================================*/
+static void *run_fit(void) {
+    int last = get_list_index(2 * RUN_SIZE + MIN_BLOCK);
+
+    for (int idx = next_list(get_list_index(RUN_BLOCK)); idx >= 0 && idx < last;
+         idx = next_list(idx + 1)) {
+        char *bp = LIST_HEAD(idx);
+        for (int n = 0; bp != NULL && n < FIT_SCAN; bp = NEXT(bp), n++) {
+            size_t size = GET_SIZE(HDRP(bp));
+            if ((size_t)(run_start(bp) - bp) + RUN_BLOCK <= size) {
+                delete_node(bp);
+                PUT(HDRP(bp), PACK(size, PREV_ALLOC | 1));
+                SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+                return bp;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* unlink_run - Take run off lists[run->cls] */
+static void unlink_run(uint32_t *lists, run_t *run) {
+    if (run->prev) {
+        ((run_t *)BLOCK(run->prev))->next = run->next;
+    } else {
+        lists[run->cls] = run->next;
+    }
+    if (run->next) {
+        ((run_t *)BLOCK(run->next))->prev = run->prev;
+    }
+    run->next = run->prev = 0;
+}
+
+/* run_lists - The lists of the run's owner */
+static uint32_t *run_lists(run_t *run) {
+    if (run->owner == 0) {
+        return slab_lists;
+    }
+    return ((tcache_t *)BLOCK(tcache_table[run->owner]))->runs;
+}
+
+/*================================================================
+ * mmap_alloc
+ *
+ *  Map a large block of its own: whole pages holding the length word
+ *  and `size` bytes of payload.
+ *================================================================*/
+static void *mmap_alloc(size_t size) {
+    size_t len = (size + DSIZE + page_size - 1) & ~(page_size - 1);
+    char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    *(size_t *)p = len;
+    __atomic_add_fetch(&mapped_bytes, len, __ATOMIC_RELAXED);
+    return p + DSIZE;
+}
+
+/* mmap_free - Unmap a large block, and raise mmap_min to its size */
+static void mmap_free(void *bp) {
+    size_t len = MAP_LEN(bp);
+
+    if (len - DSIZE > __atomic_load_n(&mmap_min, __ATOMIC_RELAXED) && len - DSIZE <= MMAP_MAX_MIN) {
+        __atomic_store_n(&mmap_min, len - DSIZE, __ATOMIC_RELAXED);
+    }
+    __atomic_sub_fetch(&mapped_bytes, len, __ATOMIC_RELAXED);
+    munmap((char *)bp - DSIZE, len);
+}
+
+/*================================================================
+ * mmap_realloc
+ *
+ *  Resize a large block with mremap: the kernel moves its pages, if
+ *  it must move it at all, so nothing is copied.
+ *================================================================*/
+static void *mmap_realloc(void *bp, size_t size) {
+    size_t len = (size + DSIZE + page_size - 1) & ~(page_size - 1);
+    char *p;
+
+    if (len == MAP_LEN(bp)) {
+        return bp;
+    }
+    p = mremap((char *)bp - DSIZE, MAP_LEN(bp), len, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    __atomic_add_fetch(&mapped_bytes, len - *(size_t *)p, __ATOMIC_RELAXED);
+    *(size_t *)p = len;
+    return p + DSIZE;
+}
+
+/* mm_mapped - Bytes mapped for large blocks, outside the heap */
+size_t mm_mapped(void) {
+    return __atomic_load_n(&mapped_bytes, __ATOMIC_RELAXED);
+}
+
+/*================================================================
+ * trim_heap
+ *
+ *  Drop the whole pages past the first TRIM_KEEP bytes of every free
+ *  block of at least TRIM_MIN bytes (caller holds heap_lock). The
+ *  footer stays; pages trimmed before cost the kernel little to trim
+ *  again.
+ *================================================================*/
+static void trim_heap(void) {
+    for (int idx = next_list(get_list_index(TRIM_MIN)); idx >= 0; idx = next_list(idx + 1)) {
+        for (char *bp = LIST_HEAD(idx); bp != NULL; bp = NEXT(bp)) {
+            char *start = PAGE_UP(bp + TRIM_KEEP);
+            char *end = PAGE_DOWN(FTRP(bp));
+
+            if (GET_SIZE(HDRP(bp)) >= TRIM_MIN && start < end) {
+                madvise(start, end - start, MADV_DONTNEED);
+            }
+        }
+    }
+}
+
+/*================================================================
+ * resize_block
+ *
+ *  Resize an allocated block of the central heap to asize bytes
+ *  without leaving its neighborhood (caller holds heap_lock); copy
+ *  is the number of payload bytes to keep. In order of preference:
+ *   1) It is big enough, or can take in the free block after it.
+ *   2) It is the last block (or the free one after it is): extend
+ *      the heap, and take in the new space.
+ *   3) The free blocks before and after it together make enough:
+ *      take in both and memmove the payload down.
+ *  The surplus is split off and freed only once it is half the block
+ *  (and at least MIN_BLOCK): a buffer resized up and down in steps
+ *  keeps room to change in place, instead of losing it to small
+ *  blocks and having to move.
+ *  Return the block, or NULL if none of these applies.
+ *================================================================*/
+static void *resize_block(char *bp, size_t asize, size_t copy) {
+    size_t size = GET_SIZE(HDRP(bp));
+    char *next = NEXT_BLKP(bp);
+    size_t next_size = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+    size_t prev_size = GET_PREV_ALLOC(HDRP(bp)) ? 0 : GET_SIZE(bp - DSIZE);
+
+    /* 2) At the top of the heap: the new space coalesces into next */
+    if (size + next_size < asize
+        && GET_SIZE(HDRP(next_size ? NEXT_BLKP(next) : next)) == 0) {
+        if (extend_heap(MAX(asize - size - next_size, CHUNKSIZE) / WSIZE) == NULL) {
+            return NULL;
+        }
+        next_size = GET_SIZE(HDRP(next));
+    }
+
+    if (size + next_size >= asize) {
+        /* 1) Grow forward, if at all */
+        if (next_size) {
+            delete_node(next);
+            size += next_size;
+            PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)) | 1));
+            SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+        }
+    } else if (prev_size + size + next_size >= asize) {
+        /* 3) Grow both ways and slide the payload down */
+        char *prev = PREV_BLKP(bp);
+
+        delete_node(prev);
+        if (next_size) {
+            delete_node(next);
+        }
+        size += prev_size + next_size;
+        PUT(HDRP(prev), PACK(size, GET_PREV_ALLOC(HDRP(prev)) | 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(prev)));
+        memmove(prev, bp, copy);
+        bp = prev;
+    } else {
+        return NULL;
+    }
+
+    /* Give back the surplus */
+    if (size - asize >= MIN_BLOCK && size - asize >= size / 2) {
+        PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(size - asize, PREV_ALLOC | 1));
+        free_block(NEXT_BLKP(bp));
+    }
+    return bp;
+}
+
+/*================================================================
+ * mm_malloc
+ *
+ *  If size == 0, return NULL. Otherwise, compute adjusted block size
+ *  `asize` = max(MIN_BLOCK, aligned(size + WSIZE)). Small blocks come
+ *  from the thread's cache once the heap is shared; anything else,
+ *  or a thread without a cache, goes to alloc_block() under heap_lock.
+ *  Requests of at most SLAB_MAX bytes are slab objects instead, from
+ *  the thread's runs or the central heap's, and those of mmap_min
+ *  bytes or more are mapped on their own.
+ *================================================================*/
+void *mm_malloc(size_t size) {
+    tcache_t *tc;
+    void *bp;
+
+    /* Ignore the size == 0 request, and sizes a header cannot hold */
+    if (size == 0 || size > MAX_REQUEST) {
+        return NULL;
+    }
+
+    /* Compute asize = aligned(size + header) with minimum of MIN_BLOCK */
+    size_t asize = ASIZE(size);
+
+    if (size >= __atomic_load_n(&mmap_min, __ATOMIC_RELAXED)) {
+        return mmap_alloc(size);
+    }
+
+    if (size <= SLAB_MAX) {
+        int cls = slab_class(size);
+        if ((tc = tcache_get()) != NULL
+            && __atomic_load_n(&heap_shared, __ATOMIC_RELAXED)) {
+            return slab_alloc(tc->runs, cls, tc->id);
+        }
+        pthread_mutex_lock(&heap_lock);
+        bp = slab_alloc(slab_lists, cls, 0);
+        pthread_mutex_unlock(&heap_lock);
+        return bp;
+    }
+
+    if (asize <= TCACHE_MAX && (tc = tcache_get()) != NULL
+        && __atomic_load_n(&heap_shared, __ATOMIC_RELAXED)) {
+        return tcache_alloc(tc, asize);
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    bp = alloc_block(asize);
+    pthread_mutex_unlock(&heap_lock);
+    return bp;
+}
+
+/*================================================================
+ * mm_free
+ *
+ *  A mapped block is unmapped. A cached block or slab object goes
+ *  back to its owner: directly if this thread owns it, through the
+ *  owner's remote list if not. Any other block (or a central run's
+ *  object) is freed under heap_lock.
+ *================================================================*/
+void mm_free(void *bp) {
+    if (bp == NULL) return;
+
+    if (!IN_HEAP(bp)) {
+        mmap_free(bp);
+        return;
+    }
+
+    if (IS_RUN(bp)) {
+        run_t *run = RUN_OF(bp);
+        if (run->owner == 0) {
+            pthread_mutex_lock(&heap_lock);
+            slab_free(run, bp);
+            pthread_mutex_unlock(&heap_lock);
+        } else if (tcache_gen == heap_gen && tcache_self && tcache_self->id == run->owner) {
+            slab_free(run, bp);
+        } else {
+            remote_free((tcache_t *)BLOCK(tcache_table[run->owner]), bp);
+        }
+        return;
+    }
+
+    uint32_t hdr = GET(HDRP(bp));
+    if (hdr & OWNED) {
+        uint32_t owner = hdr >> OWNER_SHIFT;
+        if (tcache_gen == heap_gen && tcache_self && tcache_self->id == owner) {
+            tcache_free(tcache_self, bp);
+        } else {
+            remote_free((tcache_t *)BLOCK(tcache_table[owner]), bp);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&heap_lock);
+    free_block(bp);
+    pthread_mutex_unlock(&heap_lock);
 }
 
 /*================================================================
  * mm_realloc
  *
  *  If size == 0, free the block and return NULL. If bp == NULL,
- *  equivalent to malloc(size). Otherwise, compute new_size = aligned(size+DSIZE).
- *  Cases:
- *   1) If new_size ≤ old_size: return same bp.
- *   2) If next block is free and (old_size + next_size) ≥ new_size:
- *      remove next block from free list, merge sizes, update header/footer,
- *      return bp.
- *   3) Else, malloc new region, copy payload, free old block.
+ *  equivalent to malloc(size). A mapped block is resized with
+ *  mremap. A slab object stays put if size fits its class and moves
+ *  otherwise. Else compute new_size = ASIZE(size). Cases:
+ *   1) A cached block with new_size ≤ old_size: return same bp.
+ *   2) Any other block: resize_block() under heap_lock, which grows
+ *      into its free neighbors or the end of the heap, and shrinks
+ *      by splitting off the surplus once it is half the block. Not
+ *      for growing to mmap_min or more: that would extend the heap
+ *      by a block mm_malloc would have mapped.
+ *   3) Else, malloc new region, copy payload, free old block. Past
+ *      mmap_min that is a mapping, which later grows by mremap.
  *================================================================*/
 void *mm_realloc(void *bp, size_t size) {
     /* size == 0 -> free and return NULL */
@@ -472,29 +1454,54 @@ void *mm_realloc(void *bp, size_t size) {
         return mm_malloc(size);
     }
 
-    /* Compute old block size and adjusted new size (including overhead & alignment) */
-    size_t old_size = GET_SIZE(HDRP(bp));
-    size_t new_size = (size <= DSIZE) ? (2 * DSIZE) : ALIGN(size + DSIZE);
+    if (size > MAX_REQUEST) {
+        return NULL;
+    }
 
-    /* Case 1: current block already large enough */
-    if (new_size <= old_size) {
-        return bp;
+    if (!IN_HEAP(bp)) {
+        return mmap_realloc(bp, size);
     }
 
-    /* Case 2: check if next block is free and big enough when combined */
-    char *next_bp = NEXT_BLKP(bp);
-    size_t next_alloc = GET_ALLOC(HDRP(next_bp));
-    size_t next_size = next_alloc ? 0 : GET_SIZE(HDRP(next_bp));
-    size_t total_size = old_size + next_size;
+    /* A slab object moves unless it fits its class */
+    if (IS_RUN(bp)) {
+        size_t old_size = RUN_OF(bp)->size;
+        void *new_bp;
 
-    if (!next_alloc && total_size >= new_size) {
-        /* Remove next block from free list */
-        delete_node(next_bp);
+        if (size <= old_size) {
+            return bp;
+        }
+        if ((new_bp = mm_malloc(size)) == NULL) {
+            return NULL;
+        }
+        memcpy(new_bp, bp, old_size);
+        mm_free(bp);
+        return new_bp;
+    }
 
-        /* Update header/footer of merged block */
-        PUT(HDRP(bp), PACK(total_size, 1));
-        PUT(FTRP(bp), PACK(total_size, 1));
-        return bp;
+    /* Compute old block size and adjusted new size (including overhead & alignment) */
+    int cached = GET(HDRP(bp)) & OWNED;
+    size_t old_size = cached ? GET_CACHED_SIZE(HDRP(bp)) : GET_SIZE(HDRP(bp));
+    size_t new_size = ASIZE(size);
+
+    /* Payload to keep: the smaller of old payload and requested size */
+    size_t copy_bytes = old_size - WSIZE;
+    if (size < copy_bytes) {
+        copy_bytes = size;
+    }
+
+    /* Case 1: cached block already large enough */
+    if (cached) {
+        if (new_size <= old_size) {
+            return bp;
+        }
+    } else if (new_size <= old_size || size < __atomic_load_n(&mmap_min, __ATOMIC_RELAXED)) {
+        /* Case 2: resize in place, or next to where it is */
+        pthread_mutex_lock(&heap_lock);
+        void *new_bp = resize_block(bp, new_size, copy_bytes);
+        pthread_mutex_unlock(&heap_lock);
+        if (new_bp) {
+            return new_bp;
+        }
     }
 
     /* Case 3: fallback to malloc + copy + free */
@@ -502,13 +1509,281 @@ void *mm_realloc(void *bp, size_t size) {
     if (!new_bp) {
         return NULL;
     }
-
-    /* Copy payload (only up to the smaller of old payload and requested size) */
-    size_t copy_bytes = old_size - DSIZE;
-    if (size < copy_bytes) {
-        copy_bytes = size;
-    }
     memcpy(new_bp, bp, copy_bytes);
     mm_free(bp);
     return new_bp;
 }
+
+/*================================================================
+ * mm_checkheap
+ *
+ *  Check the heap's invariants, print each broken one to stderr and
+ *  return how many were found; fill in prof, if not NULL, with the
+ *  heap's fragmentation profile. One pass over the blocks, one over
+ *  each list and run_map, all under heap_lock. Thread caches are
+ *  read as well, so their threads must be out of the allocator.
+ *   1) Every block from the prologue to the epilogue: a sane size
+ *      inside the heap, PREV_ALLOC equal to the previous block's
+ *      allocated bit, and if free, a footer matching its header
+ *      and no free block before it (coalescing missed nothing).
+ *      Cached blocks belong to a cache, runs are checked whole.
+ *   2) Every free list: each node a free block of the list's class,
+ *      back links that match, no cycle, bitmaps that agree with
+ *      the lists, and all the free blocks of step 1 on a list.
+ *      (Lists are LIFO, so there is no order to check.)
+ *   3) run_map marks exactly the runs; every run with room, and no
+ *      other, is on its owner's list for its class.
+ *   4) Every thread cache bin holds its count of blocks, owned by
+ *      the cache and of the bin's size.
+ *================================================================*/
+int mm_checkheap(mm_profile_t *prof) {
+    mm_profile_t pr;
+    char *bp, *end;
+    size_t size = 0, owned = 0, nfree = 0, listed = 0, nruns = 0, room = 0, marked = 0;
+    uint32_t prev_alloc = PREV_ALLOC;
+
+    memset(&pr, 0, sizeof(pr));
+    pthread_mutex_lock(&heap_lock);
+    check_errors = 0;
+    end = heap_base + heap_size;
+
+    /* 1) Blocks in address order, from the prologue's */
+    bp = heap_base + LISTS_SIZE + DSIZE;
+    if (GET(HDRP(bp)) != PACK(DSIZE, PREV_ALLOC | 1) || GET(bp) != PACK(DSIZE, 1)) {
+        check_fail(bp, "bad prologue");
+    }
+    for (bp += DSIZE; ; bp += size) {
+        uint32_t hdr = GET(HDRP(bp));
+
+        size = (hdr & OWNED) ? GET_CACHED_SIZE(HDRP(bp)) : GET_SIZE(HDRP(bp));
+        if ((hdr & PREV_ALLOC) != prev_alloc) {
+            check_fail(bp, "prev-allocated bit disagrees with the block before");
+        }
+        if (size == 0) {
+            if (bp != end || !(hdr & 1)) {
+                check_fail(bp, "bad epilogue");
+            }
+            break;
+        }
+        if (size % DSIZE != 0 || size < MIN_BLOCK || size > (size_t)(end - bp)) {
+            check_fail(bp, "bad block size");
+            break;
+        }
+        if (IS_RUN(bp) && (!(hdr & 1) || (hdr & OWNED) || (uintptr_t)bp % RUN_SIZE != 0)) {
+            check_fail(bp, "run_map marks a block that is not a run");
+        }
+
+        if (!(hdr & 1)) {
+            if (hdr & OWNED) {
+                check_fail(bp, "free block marked cached");
+            }
+            if (GET(bp + size - DSIZE) != size) {
+                check_fail(bp, "footer does not match header");
+            }
+            if (!prev_alloc) {
+                check_fail(bp, "two free blocks in a row");
+            }
+            nfree++;
+            pr.free += size;
+            pr.largest_free = MAX(pr.largest_free, size);
+            pr.hist[31 - __builtin_clz(size)]++;
+        } else if (hdr & OWNED) {
+            uint32_t owner = hdr >> OWNER_SHIFT;
+            if (owner == 0 || owner >= MAX_THREADS || tcache_table[owner] == 0
+                || size < TCACHE_MIN || size > TCACHE_MAX) {
+                check_fail(bp, "cached block of no cache, or of a size none holds");
+            }
+            owned += size;
+        } else if (IS_RUN(bp) && (uintptr_t)bp % RUN_SIZE == 0) {
+            nruns++;
+            room += check_run((run_t *)bp, size, &pr);
+        } else {
+            pr.used += size;
+        }
+        prev_alloc = (hdr & 1) ? PREV_ALLOC : 0;
+    }
+
+    /* 2) Free lists and bitmaps */
+    for (int idx = 0; idx < SEGLIST_CNT; idx++) {
+        uint32_t prev = 0, set;
+        size_t n = 0;
+
+        for (uint32_t off = seg_free_lists[idx]; off != 0; off = GET(NEXT_PTR(bp))) {
+            bp = heap_base + off;
+            if (off < LISTS_SIZE + 2 * DSIZE || off >= heap_size || off % DSIZE != 0
+                || GET_ALLOC(HDRP(bp))) {
+                check_fail(bp, "free list holds a block that is not free");
+                break;
+            }
+            if (get_list_index(GET_SIZE(HDRP(bp))) != idx) {
+                check_fail(bp, "free block on the wrong list");
+            }
+            if (GET(PREV_PTR(bp)) != prev) {
+                check_fail(bp, "free list back link is wrong");
+            }
+            if (++n > nfree) {
+                check_fail(bp, "cycle in a free list");
+                break;
+            }
+            prev = off;
+        }
+        listed += n;
+        set = seg_sl_bitmap[idx >> SL_SHIFT] >> (idx & (SL_CNT - 1)) & 1;
+        if (set != (seg_free_lists[idx] != 0)) {
+            check_fail(&seg_free_lists[idx], "second-level bitmap disagrees with its list");
+        }
+    }
+    for (int fl = 0; fl < FL_CNT; fl++) {
+        if ((seg_fl_bitmap >> fl & 1) != (seg_sl_bitmap[fl] != 0)) {
+            check_fail(&seg_sl_bitmap[fl], "first-level bitmap disagrees with the second");
+        }
+    }
+    if (listed != nfree) {
+        check_fail(heap_base, "free blocks missing from the free lists");
+    }
+
+    /* 3) run_map and the central run lists */
+    for (size_t page = 0; page <= RUN_INDEX(heap_base + heap_size - 1); page++) {
+        marked += run_map[page];
+    }
+    if (marked != nruns) {
+        check_fail(heap_base, "run_map marks pages inside other blocks");
+    }
+    listed = check_run_lists(slab_lists, 0, nruns);
+
+    /* 4) Thread caches: bins, and runs */
+    for (uint32_t id = 1; id < MAX_THREADS; id++) {
+        tcache_t *tc = (tcache_t *)BLOCK(tcache_table[id]);
+
+        if (tc == NULL) {
+            continue;
+        }
+        if (tc->id != id) {
+            check_fail(tc, "thread cache under the wrong id");
+        }
+        for (int bin = 0; bin < TCACHE_BINS; bin++) {
+            size_t n = 0;
+            for (uint32_t off = tc->bins[bin]; off != 0; off = GET(bp)) {
+                bp = heap_base + off;
+                if (off >= heap_size || off % DSIZE != 0 || !(GET(HDRP(bp)) & OWNED)
+                    || GET_OWNER(HDRP(bp)) != id
+                    || TCACHE_BIN(GET_CACHED_SIZE(HDRP(bp))) != (uint32_t)bin) {
+                    check_fail(bp, "thread cache bin holds a block not its own");
+                    break;
+                }
+                if (++n > tc->counts[bin]) {
+                    break;
+                }
+                pr.cached += GET_CACHED_SIZE(HDRP(bp));
+            }
+            if (n != tc->counts[bin]) {
+                check_fail(tc, "thread cache bin count is off");
+            }
+        }
+        listed += check_run_lists(tc->runs, id, nruns);
+    }
+    if (listed != room) {
+        check_fail(heap_base, "runs with room missing from their lists");
+    }
+
+    pr.heap = heap_size;
+    pr.mapped = mm_mapped();
+    pr.used += (owned > pr.cached ? owned - pr.cached : 0) + pr.mapped;
+    pr.free_blocks = nfree;
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        pr.slab_size[cls] = SLAB_SIZE(cls);
+    }
+    pthread_mutex_unlock(&heap_lock);
+
+    if (prof) {
+        *prof = pr;
+    }
+    return check_errors;
+}
+
+/* check_fail - Report a broken invariant at heap address p */
+static void check_fail(const void *p, const char *msg) {
+    fprintf(stderr, "mm_checkheap: %s (heap offset %zu)\n", msg, (size_t)((char *)p - heap_base));
+    check_errors++;
+}
+
+/*================================================================
+ * check_run
+ *
+ *  Check one run, in a block of `size` bytes: the block holds one
+ *  run and less than MIN_BLOCK of slack (new_run frees any more),
+ *  then its class, its bump offset, and its free list, which with
+ *  the objects in use must make up every object carved so far.
+ *  Count the objects in use in prof. Return whether the run has
+ *  room (so belongs on a list).
+ *================================================================*/
+static int check_run(run_t *run, size_t size, mm_profile_t *prof) {
+    char *base = (char *)run + RUN_HDR;
+    size_t carved, n = 0;
+
+    if (size < RUN_BLOCK || size >= RUN_BLOCK + MIN_BLOCK) {
+        check_fail(run, "run block of the wrong size");
+    }
+    if (run->cls >= SLAB_CLASSES || run->size != SLAB_SIZE(run->cls)
+        || run->bump < RUN_HDR || run->bump > RUN_END || (run->bump - RUN_HDR) % run->size != 0) {
+        check_fail(run, "run of a bad class or bump offset");
+        return 0;
+    }
+    if (run->owner >= MAX_THREADS || (run->owner != 0 && tcache_table[run->owner] == 0)) {
+        check_fail(run, "run of no owner");
+    }
+    carved = (run->bump - RUN_HDR) / run->size;
+    for (uint32_t off = run->free; off != 0; off = GET(heap_base + off)) {
+        char *p = heap_base + off;
+        if (p < base || p >= (char *)run + run->bump || (p - base) % run->size != 0) {
+            check_fail(p, "run free list holds a bad object");
+            break;
+        }
+        if (++n > carved) {
+            check_fail(run, "cycle in a run free list");
+            break;
+        }
+    }
+    if (run->used + n != carved) {
+        check_fail(run, "run count of objects in use is off");
+    }
+    prof->used += (size_t)run->used * run->size;
+    prof->runs[run->cls]++;
+    prof->objects[run->cls] += run->used;
+    return run->free != 0 || run->bump + run->size <= RUN_END;
+}
+
+/*================================================================
+ * check_run_lists
+ *
+ *  Check the run lists of one owner: each entry a run of the list's
+ *  class and this owner with room, back links that match, no cycle
+ *  (more than the nruns runs in the heap). Return the runs listed.
+ *================================================================*/
+static size_t check_run_lists(uint32_t *lists, uint32_t owner, size_t nruns) {
+    size_t listed = 0;
+
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        uint32_t prev = 0;
+        size_t n = 0;
+
+        for (uint32_t off = lists[cls]; off != 0; off = ((run_t *)(heap_base + off))->next) {
+            run_t *run = (run_t *)(heap_base + off);
+            if (off >= heap_size || (uintptr_t)run % RUN_SIZE != 0 || !IS_RUN(run)) {
+                check_fail(run, "run list holds a block that is not a run");
+                break;
+            }
+            if (run->cls != cls || run->owner != owner || run->prev != prev
+                || (run->free == 0 && run->bump + run->size > RUN_END)) {
+                check_fail(run, "run on the wrong list, or full, or badly linked");
+            }
+            if (++n > nruns) {
+                check_fail(run, "cycle in a run list");
+                break;
+            }
+            prev = off;
+        }
+        listed += n;
+    }
+    return listed;
+}
@@ -0,0 +1,50 @@
+/*
+ * mm.h - Interface of the allocator in mm.c
+ */
+#ifndef __MM_H__
+#define __MM_H__
+
+#include <stddef.h>
+
+int mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, size_t size);
+
+/* Bytes in blocks mapped outside the memlib heap */
+size_t mm_mapped(void);
+
+/*
+ * What mm_checkheap found besides errors. Free lists are classed by
+ * size, so hist also gives their lengths.
+ */
+#define MM_SLAB_CLASSES 1
+
+typedef struct {
+    size_t heap;                        /* memlib heap bytes */
+    size_t mapped;                      /* mm_mapped() */
+    size_t used;                        /* Handed out: blocks, slab objects, mappings */
+    size_t cached;                      /* Held in thread caches */
+    size_t free;                        /* In free blocks */
+    size_t free_blocks;
+    size_t largest_free;
+    size_t hist[32];                    /* Free blocks by floor(log2(size)) */
+    size_t slab_size[MM_SLAB_CLASSES];  /* Object size of each class */
+    size_t runs[MM_SLAB_CLASSES];       /* Runs of each class */
+    size_t objects[MM_SLAB_CLASSES];    /* Their objects in use */
+} mm_profile_t;
+
+/* Check the heap (errors to stderr), profile it if prof is set;
+ * returns the number of errors */
+int mm_checkheap(mm_profile_t *prof);
+
+/* Whoever wrote mm.c (filled in there) */
+typedef struct {
+    char *id;               /* Student ID */
+    char *name;
+    char *email;
+} team_t;
+
+extern team_t team;
+
+#endif /* __MM_H__ */
@@ -0,0 +1,91 @@
+/*
+ * mmclass_test.c - Check mm.c's free-list classes against a table
+ *
+ * usage: make test   (builds and runs this with every SL_SHIFT)
+ *
+ * The table of classes is built the slow way: SMALL_BINS exact sizes
+ * (in double words), then each power of two from 2 * SL_CNT double
+ * words up cut into SL_CNT equal ranges, until block sizes pass 2^32.
+ * get_list_index (included with the rest of mm.c) must give class i
+ * at both ends of range i, and at random sizes inside it; up to 1 MB
+ * every block size is tried, and the index must never fall or skip.
+ * A few known indexes of the default SL_SHIFT are checked too.
+ */
+#include "mm.c"
+
+#define MAX_CLASSES     (32 * SL_CNT)
+#define DENSE_MAX       (1 << 20)
+
+static unsigned long lo[MAX_CLASSES + 1];   /* First double word of each class */
+static int nclasses, errors;
+
+static void check(int ok, const char *what, size_t size)
+{
+    if (!ok) {
+        printf("SL_SHIFT=%d: %s (size %zu, index %d)\n", SL_SHIFT, what, size,
+               get_list_index(size));
+        errors++;
+    }
+}
+
+static void build_table(void)
+{
+    for (unsigned long w = 0; w < SMALL_BINS; w++)
+        lo[nclasses++] = w;
+    for (int k = SL_SHIFT + 1; (8UL << k) <= 0xFFFFFFFFUL; k++)
+        for (unsigned long j = 0; j < SL_CNT; j++)
+            lo[nclasses++] = (SL_CNT + j) << (k - SL_SHIFT);
+    lo[nclasses] = (0xFFFFFFFFUL >> 3) + 1;     /* End of the last class */
+}
+
+int main(void)
+{
+    unsigned int seed = 1;
+    int prev = get_list_index(MIN_BLOCK);
+
+    build_table();
+    check(nclasses == SEGLIST_CNT, "table and SEGLIST_CNT disagree", 0);
+
+    /* Every class, at both ends and inside */
+    for (int i = 0; i < nclasses; i++) {
+        size_t first = lo[i] * DSIZE, last = (lo[i + 1] - 1) * DSIZE;
+
+        if (first < MIN_BLOCK)
+            continue;
+        check(get_list_index(first) == i, "first size of a class maps elsewhere", first);
+        check(get_list_index(last) == i, "last size of a class maps elsewhere", last);
+        for (int n = 0; n < 8; n++) {
+            size_t size = first + (rand_r(&seed) % (lo[i + 1] - lo[i])) * DSIZE;
+            check(get_list_index(size) == i, "size maps outside its class", size);
+        }
+    }
+
+    /* Small sizes have lists of their own */
+    for (size_t size = MIN_BLOCK; size < SMALL_BINS * DSIZE; size += DSIZE)
+        check(get_list_index(size) == (int)(size / DSIZE), "small size not in its exact list", size);
+
+    /* Monotone, no gaps, in range */
+    for (size_t size = MIN_BLOCK + DSIZE; size <= DENSE_MAX; size += DSIZE) {
+        int idx = get_list_index(size);
+        check(idx == prev || idx == prev + 1, "index falls or skips a list", size);
+        prev = idx;
+    }
+    check(get_list_index(0xFFFFFFF8UL) == SEGLIST_CNT - 1, "largest size not in the last list",
+          0xFFFFFFF8UL);
+
+#if SL_SHIFT == 4
+    {
+        static const struct { size_t size; int idx; } known[] = {
+            { 16, 2 }, { 24, 3 }, { 248, 31 }, { 256, 32 }, { 264, 32 }, { 272, 33 },
+            { 504, 47 }, { 512, 48 }, { 544, 49 }, { 1024, 64 }, { 4096, 96 },
+            { 1 << 20, 224 }, { 0xFFFFFFF8UL, 415 },
+        };
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++)
+            check(get_list_index(known[i].size) == known[i].idx, "known index wrong",
+                  known[i].size);
+    }
+#endif
+
+    printf("SL_SHIFT=%d: %d classes, %s\n", SL_SHIFT, nclasses, errors ? "FAILED" : "ok");
+    return errors != 0;
+}
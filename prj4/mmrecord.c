@@ -0,0 +1,249 @@
+/*
+ * mmrecord.c - Record a program's heap calls as an mdriver trace
+ *
+ * usage: MMRECORD=out.rep LD_PRELOAD=./mmrecord.so <program> [args...]
+ *
+ * malloc, calloc, realloc and free (and the aligned allocators, as
+ * plain mallocs) are passed on to the C library and logged. Each block
+ * gets a new id; a table from address to id, kept in its own mapping,
+ * turns frees and reallocs into trace operations. Blocks the program
+ * never frees stay allocated in the trace. Frees of blocks allocated
+ * before recording started are dropped. Only the first process is
+ * recorded: LD_PRELOAD is removed for programs it runs, and a forked
+ * child stops logging.
+ *
+ * The header is written last, over space left for it at the start.
+ * Without MMRECORD the trace goes to mmrecord.rep.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define TABLE_SIZE  (1UL << 24)     /* Live blocks tracked (power of two) */
+#define BUF_SIZE    (64 << 10)
+#define HDR_LINE    21              /* Header field, right-aligned, and '\n' */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+extern void *__libc_memalign(size_t align, size_t size);
+
+typedef struct {
+    uintptr_t addr;                 /* 0: empty */
+    int id;
+} entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int fd = -1;
+static entry_t *table;
+static int next_id, nops;
+static char buf[BUF_SIZE];
+static size_t buf_len;
+
+static void flush(void)
+{
+    char *p = buf;
+
+    while (buf_len > 0) {
+        ssize_t n = write(fd, p, buf_len);
+        if (n <= 0)
+            break;
+        p += n;
+        buf_len -= n;
+    }
+    buf_len = 0;
+}
+
+static size_t slot(uintptr_t addr)
+{
+    return (addr >> 4) * 0x9E3779B97F4A7C15ULL >> 40 & (TABLE_SIZE - 1);
+}
+
+/* Table: linear probing, deletion by shifting the cluster back */
+static void put(void *p, int id)
+{
+    size_t i = slot((uintptr_t)p);
+
+    while (table[i].addr != 0)
+        i = (i + 1) & (TABLE_SIZE - 1);
+    table[i].addr = (uintptr_t)p;
+    table[i].id = id;
+}
+
+static int take(void *p)
+{
+    size_t i = slot((uintptr_t)p), j;
+    int id;
+
+    while (table[i].addr != (uintptr_t)p) {
+        if (table[i].addr == 0)
+            return -1;
+        i = (i + 1) & (TABLE_SIZE - 1);
+    }
+    id = table[i].id;
+    for (j = (i + 1) & (TABLE_SIZE - 1); table[j].addr != 0; j = (j + 1) & (TABLE_SIZE - 1)) {
+        size_t home = slot(table[j].addr);
+        /* Move j into the hole at i unless its home lies in (i, j] */
+        if (((j - home) & (TABLE_SIZE - 1)) >= ((j - i) & (TABLE_SIZE - 1))) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].addr = 0;
+    return id;
+}
+
+/* log_op - Append one operation (size unused for 'f') */
+static void log_op(char type, int id, size_t size)
+{
+    if (BUF_SIZE - buf_len < 64)
+        flush();
+    if (type == 'f')
+        buf_len += sprintf(buf + buf_len, "f %d\n", id);
+    else
+        buf_len += sprintf(buf + buf_len, "%c %d %zu\n", type, id, size);
+    nops++;
+}
+
+static void stop_child(void)
+{
+    fd = -1;
+}
+
+__attribute__((constructor))
+static void start(void)
+{
+    const char *path = getenv("MMRECORD") ? getenv("MMRECORD") : "mmrecord.rep";
+    char hdr[4 * HDR_LINE];
+
+    unsetenv("LD_PRELOAD");
+    table = mmap(NULL, TABLE_SIZE * sizeof(entry_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED)
+        return;
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        perror(path);
+        return;
+    }
+    memset(hdr, ' ', sizeof(hdr));
+    for (int i = 1; i <= 4; i++)
+        hdr[i * HDR_LINE - 1] = '\n';
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+        fd = -1;
+    pthread_atfork(NULL, NULL, stop_child);
+}
+
+__attribute__((destructor))
+static void finish(void)
+{
+    char hdr[4 * HDR_LINE + 1];
+
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        flush();
+        sprintf(hdr, "%20d\n%20d\n%20d\n%20d\n", 0, next_id, nops, 1);
+        if (pwrite(fd, hdr, 4 * HDR_LINE, 0) != 4 * HDR_LINE)
+            perror("mmrecord");
+        close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static void record_alloc(void *p, size_t size)
+{
+    if (p == NULL)
+        return;
+    pthread_mutex_lock(&lock);
+    if (fd >= 0) {
+        put(p, next_id);
+        log_op('a', next_id++, size);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+    record_alloc(p, size);
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p = __libc_calloc(n, size);
+    record_alloc(p, n * size);
+    return p;
+}
+
+void free(void *p)
+{
+    if (p != NULL) {
+        pthread_mutex_lock(&lock);
+        if (fd >= 0) {
+            int id = take(p);
+            if (id >= 0)
+                log_op('f', id, 0);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    __libc_free(p);
+}
+
+/* realloc - Logged while locked: the old address may be reused at once */
+void *realloc(void *p, size_t size)
+{
+    void *q;
+    int id;
+
+    if (p == NULL)
+        return malloc(size);
+    if (size == 0) {
+        free(p);
+        return NULL;
+    }
+    pthread_mutex_lock(&lock);
+    q = __libc_realloc(p, size);
+    if (fd >= 0 && q != NULL) {
+        if ((id = take(p)) < 0) {
+            id = next_id++;
+            log_op('a', id, size);
+        } else {
+            log_op('r', id, size);
+        }
+        put(q, id);
+    }
+    pthread_mutex_unlock(&lock);
+    return q;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+    record_alloc(p, size);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **pp, size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+
+    if (p == NULL)
+        return ENOMEM;
+    record_alloc(p, size);
+    *pp = p;
+    return 0;
+}
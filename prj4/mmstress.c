@@ -0,0 +1,262 @@
+/*
+ * mmstress.c - Multi-threaded stress benchmark for mm.c
+ *
+ * usage: ./mmstress [-g] [-n ops per thread] [-t max threads]
+ *
+ * For 1, 2, 4, ... up to the maximum thread count, every thread runs
+ * the same mix on a private table of SLOTS blocks: allocate into an
+ * empty slot (a fifth the 1 to 8 bytes of slab objects, most others
+ * small, a few up to 4 KB), free a full one, and now and then realloc
+ * one. One free in REMOTE_EVERY is handed to the next thread over a
+ * single-producer ring, so blocks are also freed by threads that do
+ * not own them. Every payload is stamped and checked before it is
+ * freed. -g runs the same mix on the C library's malloc for comparison.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SLOTS           1024
+#define REMOTE_EVERY    8               /* One free in 8 goes to a neighbor */
+#define RING_SIZE       256             /* Handoff ring per thread (power of two) */
+#define MAX_THREADS     32
+
+typedef struct {
+    char *p;
+    size_t size;                        /* As requested: what the stamp says */
+} block_t;
+
+typedef struct {
+    block_t slot[RING_SIZE];
+    unsigned int head;                  /* Consumer: next to take */
+    char pad[60];
+    unsigned int tail;                  /* Producer: next to fill */
+} ring_t;
+
+typedef struct {
+    int id;
+    pthread_t tid;
+    ring_t ring;                        /* Blocks the previous thread hands us */
+} worker_t;
+
+static void *(*do_malloc)(size_t) = mm_malloc;
+static void (*do_free)(void *) = mm_free;
+static void *(*do_realloc)(void *, size_t) = mm_realloc;
+
+static worker_t workers[MAX_THREADS];
+static int nthreads;
+static long nops = 1000000;
+static pthread_barrier_t start;
+
+static void unix_error(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/* xorshift: cheap per-thread randomness */
+static unsigned int rnd(unsigned int *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static size_t rnd_size(unsigned int *s)
+{
+    unsigned int r = rnd(s) % 100;
+
+    if (r < 20)
+        return 1 + rnd(s) % 8;
+    if (r < 70)
+        return 9 + rnd(s) % 56;
+    if (r < 95)
+        return 65 + rnd(s) % 448;
+    return 513 + rnd(s) % 3584;
+}
+
+/*
+ * A block starts with its size and ends with a byte derived from it;
+ * one with no room for both has that byte everywhere. release()
+ * checks the stamp against the size recorded with the pointer, so a
+ * block handed out twice or overwritten is caught.
+ */
+static void stamp(block_t b)
+{
+    if (b.size <= sizeof(b.size)) {
+        memset(b.p, (char)b.size, b.size);
+        return;
+    }
+    memcpy(b.p, &b.size, sizeof(b.size));
+    b.p[b.size - 1] = (char)b.size;
+}
+
+static void release(block_t b)
+{
+    size_t size, i;
+    int ok;
+
+    if (b.size <= sizeof(size)) {
+        for (i = 0; i < b.size && b.p[i] == (char)b.size; i++)
+            ;
+        ok = i == b.size;
+    } else {
+        memcpy(&size, b.p, sizeof(size));
+        ok = size == b.size && b.p[size - 1] == (char)size;
+    }
+    if (!ok) {
+        fprintf(stderr, "mmstress: corrupt block %p\n", (void *)b.p);
+        exit(1);
+    }
+    do_free(b.p);
+}
+
+/* Hand b to the next thread; returns 0 if its ring is full */
+static int pass(worker_t *w, block_t b)
+{
+    ring_t *r = &workers[(w->id + 1) % nthreads].ring;
+    unsigned int tail = r->tail;
+
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SIZE)
+        return 0;
+    r->slot[tail % RING_SIZE] = b;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/* Free whatever the previous thread handed us */
+static void collect(worker_t *w)
+{
+    ring_t *r = &w->ring;
+    unsigned int head = r->head;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+        release(r->slot[head % RING_SIZE]);
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+static void *worker(void *arg)
+{
+    worker_t *w = arg;
+    block_t *slot = calloc(SLOTS, sizeof(block_t));
+    unsigned int seed = 2463534242u + w->id * 7919;
+
+    if (slot == NULL)
+        unix_error("calloc");
+    pthread_barrier_wait(&start);
+    for (long op = 0; op < nops; op++) {
+        block_t *b = &slot[rnd(&seed) % SLOTS];
+
+        if ((op & 63) == 0)
+            collect(w);
+        if (b->p == NULL) {
+            b->size = rnd_size(&seed);
+            if ((b->p = do_malloc(b->size)) == NULL) {
+                fprintf(stderr, "mmstress: out of memory\n");
+                exit(1);
+            }
+            stamp(*b);
+        } else if (rnd(&seed) % 16 == 0) {
+            b->size = rnd_size(&seed);
+            if ((b->p = do_realloc(b->p, b->size)) == NULL) {
+                fprintf(stderr, "mmstress: out of memory\n");
+                exit(1);
+            }
+            stamp(*b);
+        } else {
+            if (rnd(&seed) % REMOTE_EVERY != 0 || nthreads == 1 || !pass(w, *b))
+                release(*b);
+            b->p = NULL;
+        }
+    }
+    pthread_barrier_wait(&start); /* Neighbors are done passing */
+    collect(w);
+    for (int i = 0; i < SLOTS; i++)
+        if (slot[i].p != NULL)
+            release(slot[i]);
+    free(slot);
+    return NULL;
+}
+
+static double run(int n)
+{
+    struct timespec t0, t1;
+
+    nthreads = n;
+    memset(workers, 0, sizeof(workers));
+    if (do_malloc == mm_malloc) {
+        mem_reset_brk();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mmstress: mm_init failed\n");
+            exit(1);
+        }
+    }
+    pthread_barrier_init(&start, NULL, n + 1);
+    for (int i = 0; i < n; i++) {
+        workers[i].id = i;
+        if (pthread_create(&workers[i].tid, NULL, worker, &workers[i]) != 0)
+            unix_error("pthread_create");
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    for (int i = 0; i < n; i++)
+        pthread_join(workers[i].tid, NULL);
+    pthread_barrier_destroy(&start);
+    return (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+static void usage(char *argv0)
+{
+    fprintf(stderr, "usage: %s [-g] [-n ops per thread] [-t max threads]\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int maxthreads = MAX_THREADS, opt;
+    double base = 0;
+
+    while ((opt = getopt(argc, argv, "gn:t:")) != -1) {
+        switch (opt) {
+        case 'g':
+            do_malloc = malloc;
+            do_free = free;
+            do_realloc = realloc;
+            break;
+        case 'n':
+            nops = atol(optarg);
+            break;
+        case 't':
+            maxthreads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nops <= 0 || maxthreads < 1 || maxthreads > MAX_THREADS)
+        usage(argv[0]);
+
+    mem_init();
+    printf("%s, %ld ops per thread (%ld online CPUs)\n",
+           do_malloc == mm_malloc ? "mm" : "libc", nops, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %12s %9s\n", "threads", "Mops/sec", "speedup");
+    for (int n = 1; n <= maxthreads; n *= 2) {
+        double secs = run(n);
+        double mops = n * nops / secs / 1e6;
+        if (n == 1)
+            base = mops;
+        printf("%8d %12.2f %8.2fx\n", n, mops, mops / base);
+    }
+    return 0;
+}
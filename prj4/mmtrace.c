@@ -0,0 +1,220 @@
+/*
+ * mmtrace.c - Write a synthetic allocation trace for mdriver
+ *
+ * usage: mmtrace <pattern> <ops> <seed> > trace
+ *
+ * Patterns:
+ *   small     churn over a few thousand live objects of 1-256 bytes,
+ *             with an occasional realloc
+ *   mixed     mostly small blocks, some up to 8 KB, a few up to 200 KB,
+ *             freed and resized at random
+ *   binary    CS:APP's binary-bal: blocks of 64 and 448 bytes in turn,
+ *             all 448s freed, then blocks of 512: the freed holes only
+ *             fit if the allocator does not waste them
+ *   coalesce  rounds of many blocks freed in random order, then fewer,
+ *             larger blocks that only fit if the holes were merged
+ *   realloc   a few buffers grown a little at a time, with small blocks
+ *             allocated in between (CS:APP's realloc-bal)
+ *   large     blocks of 64 KB-4 MB among small ones
+ *
+ * ops is approximate. Every allocation gets a new id, so the trace
+ * reads the same in any driver. One seed always gives the same trace.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+static op_t *ops;
+static int nops, cap;
+static int next_id;
+static unsigned int seed;
+
+static void emit(char type, int id, size_t size)
+{
+    if (nops == cap) {
+        cap = cap ? 2 * cap : 1024;
+        if ((ops = realloc(ops, cap * sizeof(op_t))) == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    ops[nops].type = type;
+    ops[nops].id = id;
+    ops[nops++].size = size;
+}
+
+static int alloc(size_t size)
+{
+    emit('a', next_id, size);
+    return next_id++;
+}
+
+static unsigned int rnd(void)
+{
+    return rand_r(&seed);
+}
+
+/* Shuffle ids[0..n) */
+static void shuffle(int *ids, int n)
+{
+    for (int i = n - 1; i > 0; i--) {
+        int j = rnd() % (i + 1), t = ids[i];
+        ids[i] = ids[j];
+        ids[j] = t;
+    }
+}
+
+static size_t small_size(void)
+{
+    return 1 + rnd() % (rnd() % 4 ? 64 : 256);
+}
+
+static size_t mixed_size(void)
+{
+    unsigned int r = rnd() % 100;
+
+    if (r < 60)
+        return 1 + rnd() % 64;
+    if (r < 85)
+        return 1 + rnd() % 512;
+    if (r < 97)
+        return 1 + rnd() % 8192;
+    return 1 + rnd() % 200000;
+}
+
+static size_t large_size(void)
+{
+    return rnd() % 8 ? 1 + rnd() % 512 : (64 << 10) + rnd() % (4 << 20);
+}
+
+/* Random churn over `slots` live blocks, sizes from size_fn */
+static void churn(int n, int slots, size_t (*size_fn)(void), int realloc_pct)
+{
+    int *id = malloc(slots * sizeof(int));
+    size_t *sz = malloc(slots * sizeof(size_t));
+
+    for (int i = 0; i < slots; i++)
+        id[i] = -1;
+    while (nops < n) {
+        int i = rnd() % slots;
+        if (id[i] < 0) {
+            sz[i] = size_fn();
+            id[i] = alloc(sz[i]);
+        } else if ((int)(rnd() % 100) < realloc_pct) {
+            sz[i] = rnd() % 2 ? sz[i] + 1 + rnd() % (sz[i] + 64) : 1 + rnd() % sz[i];
+            emit('r', id[i], sz[i]);
+        } else {
+            emit('f', id[i], 0);
+            id[i] = -1;
+        }
+    }
+    for (int i = 0; i < slots; i++)
+        if (id[i] >= 0)
+            emit('f', id[i], 0);
+    free(id);
+    free(sz);
+}
+
+static void binary(int n)
+{
+    int pairs = n / 5, *small = malloc(pairs * sizeof(int)), *big = malloc(pairs * sizeof(int));
+
+    for (int i = 0; i < pairs; i++) {
+        small[i] = alloc(64);
+        big[i] = alloc(448);
+    }
+    for (int i = 0; i < pairs; i++)
+        emit('f', big[i], 0);
+    for (int i = 0; i < pairs; i++)
+        big[i] = alloc(512);
+    for (int i = 0; i < pairs; i++) {
+        emit('f', small[i], 0);
+        emit('f', big[i], 0);
+    }
+    free(small);
+    free(big);
+}
+
+static void coalesce(int n)
+{
+    int round = 2000, *ids = malloc(round * sizeof(int));
+
+    while (nops < n) {
+        int k = 0;
+        for (int i = 0; i < round; i++)
+            ids[i] = alloc(16 + rnd() % 240);
+        shuffle(ids, round);
+        for (int i = 0; i < round; i++)
+            emit('f', ids[i], 0);
+        for (int i = 0; i < round / 8; i++)
+            ids[k++] = alloc(1024 + rnd() % 3072);
+        for (int i = 0; i < k; i++)
+            emit('f', ids[i], 0);
+    }
+    free(ids);
+}
+
+static void grow(int n)
+{
+    int nbuf = 4, buf[4];
+    size_t len[4];
+
+    for (int i = 0; i < nbuf; i++) {
+        len[i] = 512;
+        buf[i] = alloc(len[i]);
+    }
+    while (nops < n) {
+        int i = rnd() % nbuf;
+        len[i] += 1 + rnd() % 128;
+        emit('r', buf[i], len[i]);
+        if (rnd() % 4 == 0)
+            alloc(16 + rnd() % 112); /* Never freed: pins the heap */
+    }
+    for (int i = 0; i < nbuf; i++)
+        emit('f', buf[i], 0);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s <small|mixed|binary|coalesce|realloc|large> <ops> <seed>\n", argv[0]);
+        exit(1);
+    }
+    char *pattern = argv[1];
+    int n = atoi(argv[2]);
+    seed = strtoul(argv[3], NULL, 10);
+
+    if (strcmp(pattern, "small") == 0)
+        churn(n, 2000, small_size, 5);
+    else if (strcmp(pattern, "mixed") == 0)
+        churn(n, 1000, mixed_size, 20);
+    else if (strcmp(pattern, "binary") == 0)
+        binary(n);
+    else if (strcmp(pattern, "coalesce") == 0)
+        coalesce(n);
+    else if (strcmp(pattern, "realloc") == 0)
+        grow(n);
+    else if (strcmp(pattern, "large") == 0)
+        churn(n, 200, large_size, 10);
+    else {
+        fprintf(stderr, "mmtrace: unknown pattern %s\n", pattern);
+        exit(1);
+    }
+
+    /* Header: suggested heap size (unused), ids, operations, weight */
+    printf("0\n%d\n%d\n1\n", next_id, nops);
+    for (int i = 0; i < nops; i++) {
+        if (ops[i].type == 'f')
+            printf("f %d\n", ops[i].id);
+        else
+            printf("%c %d %zu\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    free(ops);
+    return 0;
+}